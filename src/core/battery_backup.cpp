@@ -0,0 +1,206 @@
+#include "battery_backup.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <print>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    int openSaveFile(const std::string& path) {
+        #ifdef _WIN32
+        int file = -1;
+        _sopen_s(&file, path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE);
+        return file;
+        #else
+        return ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        #endif
+    }
+
+    bool writeAt(int file, const uint8_t* data, size_t bytes, size_t offset) {
+        #ifdef _WIN32
+        return _lseeki64(file, static_cast<__int64>(offset), SEEK_SET) >= 0 && _write(file, data, static_cast<unsigned int>(bytes)) == static_cast<int>(bytes);
+        #else
+        return pwrite(file, data, bytes, static_cast<off_t>(offset)) == static_cast<ssize_t>(bytes);
+        #endif
+    }
+
+    // Waits until the written data is on disk
+    void syncFile(int file) {
+        #if defined(_WIN32)
+        _commit(file);
+        #elif defined(__APPLE__)
+        fsync(file);
+        #else
+        fdatasync(file);
+        #endif
+    }
+
+    void closeFile(int file) {
+        #ifdef _WIN32
+        _close(file);
+        #else
+        ::close(file);
+        #endif
+    }
+}
+
+/*
+    Loads the save file into PRG-RAM if there is one, then starts the background writer.
+    A missing file leaves PRG-RAM as it is, and is created with its contents.
+    PRG-RAM must be a page-aligned region of the arena, so its pages are not shared with anything else.
+*/
+BatteryBackup::BatteryBackup(const std::string& newPath, std::span<uint8_t> newRAM, MemoryArena& arena,
+    std::chrono::milliseconds newInterval /* = DEFAULT_INTERVAL */) {
+    path = newPath;
+    ram = newRAM;
+    written = &arena.dirtyPages();
+    ramOffset = static_cast<size_t>(ram.data() - arena.data());
+    interval = newInterval;
+    nextUpdate = std::chrono::steady_clock::now() + interval;
+    pending = stopping = false;
+
+    std::ifstream saveFile(path, std::ios::binary);
+    if (saveFile) {
+        saveFile.read(reinterpret_cast<char*>(ram.data()), static_cast<std::streamsize>(ram.size()));
+        std::println("Loaded {} bytes of saved data from {}.", saveFile.gcount(), path);
+    }
+    saveFile.close();
+
+    file = openSaveFile(path);
+    if (file < 0) {
+        std::println(stderr, "Could not open save file {}, so progress will not be saved.", path);
+    }
+
+    // Whatever the file held is now in PRG-RAM, so writing it all back brings the file to full size
+    staged.resize(ram.size());
+    stagedPages.assign((ram.size() + PAGE_SIZE - 1) / PAGE_SIZE, 0);
+    written->mark(ramOffset, ram.size());
+    stage();
+    writer = std::thread(&BatteryBackup::run, this);
+    wake.notify_one();
+}
+
+/*
+    Writes everything that is left and stops the background writer.
+*/
+BatteryBackup::~BatteryBackup() {
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+    if (file >= 0) {
+        closeFile(file);
+    }
+}
+
+/*
+    Hands the pages of PRG-RAM that changed to the background writer, if an interval has passed
+    since the last hand-off. This is cheap enough to call every frame from the emulation thread,
+    and must only be called from that thread.
+*/
+void BatteryBackup::update() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < nextUpdate) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return; // The writer is taking the staged pages, so try again next time
+    }
+    nextUpdate = now + interval;
+    if (stage()) {
+        lock.unlock();
+        wake.notify_one();
+    }
+}
+
+/*
+    Writes the current contents of PRG-RAM to disk and waits until they are there.
+    This blocks, so it is meant for shutting down and for switching games.
+*/
+void BatteryBackup::flush() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stage();
+    }
+    writeStaged();
+}
+
+/*
+    Copies each page of PRG-RAM written since it was last staged, taking the arena's battery marks.
+    The mutex must be held. Returns true if any page changed.
+*/
+bool BatteryBackup::stage() {
+    bool changed = false;
+    for (size_t page = 0; page < stagedPages.size(); page++) {
+        size_t offset = page * PAGE_SIZE, bytes = std::min(PAGE_SIZE, ram.size() - offset);
+        if (written->take(ramOffset + offset, DirtyPages::BATTERY)) {
+            memcpy(&staged[offset], &ram[offset], bytes);
+            stagedPages[page] = 1;
+            changed = true;
+        }
+    }
+    pending |= changed;
+    return changed;
+}
+
+/*
+    Writes staged pages whenever the emulation thread hands some over, until stopped.
+*/
+void BatteryBackup::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return pending || stopping; });
+        if (stopping) {
+            return;
+        }
+        lock.unlock();
+        writeStaged();
+        lock.lock();
+    }
+}
+
+/*
+    Takes the staged pages, then writes them to the file and flushes it without holding the mutex,
+    so the emulation thread is only ever kept waiting for a copy.
+*/
+void BatteryBackup::writeStaged() {
+    std::lock_guard<std::mutex> writeLock(writeMutex);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pending) {
+            return;
+        }
+        writing = staged;
+        writingPages = stagedPages;
+        std::fill(stagedPages.begin(), stagedPages.end(), 0);
+        pending = false;
+    }
+    if (file < 0) {
+        return;
+    }
+
+    bool written = true;
+    for (size_t page = 0; page < writingPages.size(); page++) {
+        if (writingPages[page]) {
+            size_t offset = page * PAGE_SIZE, bytes = std::min(PAGE_SIZE, writing.size() - offset);
+            written &= writeAt(file, &writing[offset], bytes, offset);
+        }
+    }
+    if (!written) {
+        std::println(stderr, "Could not write to save file {}.", path);
+    }
+    syncFile(file);
+}
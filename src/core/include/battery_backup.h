@@ -0,0 +1,63 @@
+#pragma once
+#include "memory_arena.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+    Keeps a cartridge's battery-backed PRG-RAM in a .sav file.
+
+    The file is read into PRG-RAM when the game is loaded. While the game runs, the emulation
+    thread hands the pages written since the last hand-off, as marked in the arena holding PRG-RAM,
+    to a background thread at most once per interval,
+    and that thread writes them to the file and flushes them to disk. The emulation thread
+    never waits on the disk: if the writer is still busy, the hand-off is tried again next time.
+    A crash therefore loses at most one interval of saved data.
+*/
+class BatteryBackup {
+    public:
+        static constexpr std::chrono::milliseconds DEFAULT_INTERVAL {1000};
+        static const size_t PAGE_SIZE = DirtyPages::PAGE_SIZE;
+
+        BatteryBackup(const std::string& path, std::span<uint8_t> ram, MemoryArena& arena,
+            std::chrono::milliseconds interval = DEFAULT_INTERVAL);
+        ~BatteryBackup();
+
+        void update();
+        void flush();
+
+    private:
+        bool stage();
+        void run();
+        void writeStaged();
+
+        std::string path;
+        std::span<uint8_t> ram;
+        DirtyPages* written; // The arena's marks, of which PRG-RAM's pages start at ramOffset
+        size_t ramOffset;
+        std::chrono::milliseconds interval;
+        std::chrono::steady_clock::time_point nextUpdate;
+        int file; // Descriptor of the open .sav file, or -1 if it could not be opened
+
+        // Copies of PRG-RAM waiting to be written, guarded by the mutex
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<uint8_t> staged;
+        std::vector<uint8_t> stagedPages; // Nonzero for each page of staged that has not been written yet
+        bool pending, stopping;
+
+        // Only used by the writer, so the mutex is not held while writing
+        std::vector<uint8_t> writing;
+        std::vector<uint8_t> writingPages;
+        std::mutex writeMutex;
+
+        std::thread writer;
+
+        BatteryBackup(const BatteryBackup&) = delete;
+        BatteryBackup& operator=(const BatteryBackup&) = delete;
+};
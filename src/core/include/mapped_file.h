@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+/*
+    The bytes of a file, read-only.
+    Regular files are memory-mapped where the platform allows it, so they are used in place
+    without being copied. Inputs that cannot be mapped, such as pipes, are read into a buffer instead,
+    and bytes that are already in memory can be handed over as a buffer directly.
+*/
+class MappedFile {
+    public:
+        ~MappedFile();
+
+        static std::unique_ptr<const MappedFile> open(const std::string& path);
+        static std::unique_ptr<const MappedFile> fromBuffer(std::vector<uint8_t> buffer);
+
+        std::span<const uint8_t> bytes() const;
+        bool isMapped() const;
+
+    private:
+        MappedFile();
+        bool map(const std::string& path);
+
+        const uint8_t* data;
+        size_t size;
+        bool mapped;
+        std::vector<uint8_t> buffer; // Holds the bytes when the file is not mapped
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+};
@@ -3,17 +3,27 @@
 #include "core_memory.h"
 #include "cpu.h"
 #include "ppu.h"
+#include "battery_backup.h"
+#include <string_view>
 
 class NES {
     public:
         NES();
+        ~NES();
         void loadROM(ROM& rom);
+        void saveSnapshot(MemorySnapshot& snapshot);
+        void restoreSnapshot(MemorySnapshot& snapshot);
+        void saveBattery();
+        bool addCheat(std::string_view code);
 
         std::shared_ptr<CoreMemory> memory;
         std::unique_ptr<CPU> cpu;
         std::shared_ptr<PPU> ppu;
         
     private:
+        uint64_t snapshotGeneration;
+        std::unique_ptr<BatteryBackup> battery; // Declared after memory, so it is destroyed first
+
         NES(const NES&) = delete;
         NES& operator=(const NES&) = delete;
 };
@@ -1,10 +1,41 @@
 #pragma once
 #include "core_memory.h"
-#include <condition_variable>
+#include "ppu_render.h"
+#include "spsc_queue.h"
+#include <atomic>
 #include <array>
+#include <bitset>
+#include <functional>
+#include <span>
+#include <thread>
+#include <vector>
 
 class CPU;
 
+/*
+    Tracks the PPU's position within the frame.
+    Both the PPU itself and the CPU-side timing model step one of these.
+*/
+struct PPUClock {
+    uint64_t ticks = 0; // Number of times the clock has been stepped
+    uint64_t cyclesExecuted = 0; // Dots since power-on, counting the dot skipped on odd frames
+    int scanline = 0, cyclesOnLine = 0;
+    bool oddFrame = false;
+
+    void tick(bool renderingEnabled);
+    int statusFrame() const;
+};
+
+/*
+    PPUSTATUS is never stored as bits. Reads of $2002 work it out from the ticks of the
+    last vblank edge, pre-render clear, and status read, so nothing is spent until a read.
+*/
+struct StatusEdges {
+    uint64_t vblankSet = 0, frameClear = 0, lastRead = 0;
+
+    bool vblank() const;
+};
+
 class PPU {
     friend class NES;
     friend class CPU;
@@ -13,32 +44,190 @@ class PPU {
         PPU(CPU& cpu);
 
         uint8_t readRegister(addr_t address);
+        uint8_t peekRegister(addr_t address);
         void writeRegister(addr_t address, uint8_t data);
+        void writeOAM(const uint8_t* data);
+
+        void mapCHR(int slot, uint8_t* page, bool writable);
+        void mapCHR(int slot, const uint8_t* page);
+        void setMirroring(mirroringMode mirroring);
 
+        void setPipelined(bool pipelined);
+        void setSerialOnly(bool serialOnly);
         void start();
+        void stop(std::thread& t);
         void cycle();
         void cycles(int n);
         bool checkRunning();
-        
+        bool checkPipelined();
+        const PPUClock& timing();
+        const uint8_t* frame();
+        const uint8_t* frameEmphasis();
+        uint64_t frameHash();
+        void setFrameRecorder(std::function<void(const FrameRecording&)> recorder);
+        void setIncrementalRedraw(bool enabled);
+        void setPixelOutput(bool enabled);
+
+        size_t saveSnapshot(MemorySnapshot& snapshot, bool current);
+        void restoreSnapshot(const MemorySnapshot& snapshot, bool current);
+
     private:
         bool renderingEnabled();
-        bool oddFrame = false;
+
+        uint8_t readMemory(addr_t address);
+        void writeMemory(addr_t address, uint8_t data);
+        uint8_t& paletteEntry(addr_t address);
+        uint8_t readRegisterDirect(addr_t address);
+        void writeRegisterDirect(addr_t address, uint8_t data);
+        static void incrementY(uint16_t& address);
+        void drawScanline();
+        void evaluateSprites(int line, ScanlineState& state);
+        uint8_t currentSpriteFlags();
+        uint64_t dirtyTiles(int line, const ScanlineState& state);
+        void startRecording();
+        void recordWrite(RecordedWrite::kind type, const uint8_t* page, uint16_t offset, uint8_t data);
+        void predictSpriteFlags();
+        bool spriteHitPending();
+        uint64_t ticksAt(int line, int dot);
 
         std::shared_ptr<CoreMemory> memory;
 
         /*
             Control and status registers for the PPU.
+            Only the open bus bits of $2002 are kept here; its flags come from status.
         */
         std::array<uint8_t, 8> registers {};
+        StatusEdges status;
+
+        // Internal scroll and address registers (see https://www.nesdev.org/wiki/PPU_scrolling)
+        uint16_t v, t;
+        uint8_t fineX, readBuffer;
+        bool w;
+
+        /*
+            PPU-side memory.
+            CHR is owned by the cartridge, so we only keep pointers to its 1 KB pages.
+            Nametables point into VRAM according to the current mirroring mode.
+            VRAM, OAM, and palette RAM share one block, so that snapshots can copy just its written pages.
+        */
+        static const size_t OAM_OFFSET = 0x1000, PALETTE_OFFSET = 0x1100, VIDEO_MEMORY_BYTES = 0x1120;
+        std::array<uint8_t, VIDEO_MEMORY_BYTES> videoMemory {};
+        DirtyPages videoDirty;
+        std::span<uint8_t, 0x1000> vram {videoMemory.data(), 0x1000};
+        std::span<uint8_t, 0x100> oam {videoMemory.data() + OAM_OFFSET, 0x100};
+        std::span<uint8_t, 0x20> palette {videoMemory.data() + PALETTE_OFFSET, 0x20};
+        std::array<uint8_t, 0x400> unmappedCHR {};
+        std::array<uint8_t*, 8> chrPages;
+        std::array<bool, 8> chrWritable {};
+        std::vector<uint8_t*> chrRamPages; // Every writable CHR page that has been mapped
+        std::array<uint8_t*, 4> nametables;
+        std::array<uint8_t, 4> nametableLayout;
+
+        // Palette indices of the current frame, drawn one scanline at a time
+        std::array<uint8_t, NES_FRAME_WIDTH * NES_FRAME_HEIGHT> framebuffer {};
+        // Color emphasis bits (PPUMASK bits 5-7) that each line was drawn with
+        std::array<uint8_t, NES_FRAME_HEIGHT> lineEmphasis {};
+
+        /*
+            Incremental redraw leaves the previous frame in the framebuffer and only redraws
+            the 8x8 tiles of a line whose inputs changed since the line was last drawn.
+            A line is redrawn in full if its scroll, control, mask, or banks differ.
+            Writes are marked for both the frame being drawn and the next one, since
+            part of the current frame may already have been drawn with the old data.
+        */
+        struct DirtyMemory {
+            std::bitset<0x1000> nametable; // VRAM nametable entries, including those under changed attributes
+            std::bitset<0x200> patterns; // 16-byte tiles of the pattern tables
+            uint32_t palette = 0;
+            bool any = false; // True if anything at all is marked
+
+            void clear();
+        };
+        bool incrementalRedraw;
+        DirtyMemory frameDirty, pendingDirty;
+
+        /*
+            With pixel output off, lines are not drawn at all, but everything the CPU can see still runs.
+            The setting is latched at the top of each frame, so frames are either drawn whole or skipped.
+        */
+        bool pixelOutput, drawingFrame;
+        std::array<ScanlineState, NES_FRAME_HEIGHT> previousLines;
+        std::bitset<NES_FRAME_HEIGHT> previousLinesValid;
+
+        // Optional capture of each frame's scanline states for offline rendering
+        std::function<void(const FrameRecording&)> frameRecorder;
+        FrameRecording recording;
+        bool recordingFrame;
 
         // Background-rendering shift registers
         uint8_t bg8sr0, bg8sr1;
         uint16_t bg16sr0, bg16sr1;
 
-        // For synchronizing with CPU clock
-        std::condition_variable cpuToPpuCV;
-        std::mutex cpuToPpuMutex;
-        int cyclesExecuted, scanline, cyclesOnLine;
+        /*
+            The sprite 0 hit and sprite overflow flags are set at PPU ticks predicted ahead of time
+            from OAM, CHR, and the background tiles, rather than found while drawing.
+            Any write that could move them marks the prediction stale.
+        */
+        static const uint64_t NO_EVENT = UINT64_MAX;
+        uint64_t sprite0HitTicks, spriteOverflowTicks;
+        bool spriteFlagsStale;
+
+        PPUClock clock;
         CPU& cpu;
-        bool running;
+        std::atomic<bool> running;
+
+        /*
+            Pipelined mode runs the PPU on its own thread.
+            The CPU thread logs every change to PPU-visible state with the PPU cycle
+            at which it happened, and the PPU thread replays the log as it catches up.
+        */
+        struct LoggedWrite {
+            enum kind : uint8_t { REGISTER, STATUS_READ, CHR_PAGE, MIRRORING, PIXEL_OUTPUT };
+
+            uint64_t timestamp;
+            kind type;
+
+            // REGISTER and STATUS_READ, with the mirroring mode or the pixel output flag also in data
+            addr_t address;
+            uint8_t data;
+
+            // CHR_PAGE
+            uint8_t* page;
+            uint8_t slot;
+            bool writable;
+        };
+
+        /*
+            The CPU thread's view of the PPU while pipelined.
+            This is enough to answer vblank and open bus reads of $2002 without waiting.
+        */
+        struct TimingModel {
+            PPUClock clock;
+            StatusEdges status;
+            uint8_t mask = 0, openBus = 0;
+            bool renderingThisFrame = false;
+
+            void advance(int n);
+        };
+
+        void logWrite(const LoggedWrite& entry);
+        void applyWrite(const LoggedWrite& entry);
+        void synchronize();
+        void catchUp(uint64_t target);
+        void publishSpriteFlags();
+        bool predictedSpriteFlags(uint8_t& flags);
+
+        bool pipelined;
+        bool serialOnly; // Keeps pipelining off for games that need the PPU in step with the CPU
+        TimingModel model;
+        SPSCQueue<LoggedWrite, 4096> writeLog;
+        std::atomic<uint64_t> publishedTicks, completedTicks;
+        // Every log entry pushed by the CPU thread, and every entry replayed as of the PPU thread's last catchUp()
+        uint64_t pushedEntries, poppedEntries;
+        std::atomic<uint64_t> replayedEntries;
+
+        // The PPU thread's latest sprite flag prediction, guarded by a sequence lock
+        std::atomic<uint64_t> predictionSequence, predictedFrame, predictedHitTicks, predictedOverflowTicks, predictedWrites;
+        // Number of state-changing log entries written by the CPU thread and applied by the PPU thread
+        uint64_t loggedWrites, appliedWrites;
 };
@@ -0,0 +1,105 @@
+#pragma once
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+const int NES_FRAME_WIDTH = 256, NES_FRAME_HEIGHT = 240;
+
+// Mask covering all 33 background tiles that can be drawn on a finely scrolled line
+const uint64_t ALL_TILES = (1ull << 33) - 1;
+
+/*
+    Everything the PPU needs to draw one scanline besides VRAM and palette RAM.
+    The PPU captures one of these each time it draws a line.
+*/
+struct ScanlineState {
+    uint16_t v; // Scroll position at the start of the line
+    uint8_t fineX, ctrl, mask, spriteCount;
+    bool sprite0OnLine; // True if the first sprite in the list is OAM entry 0
+    std::array<uint8_t, 4> nametableLayout; // Physical VRAM page for each logical nametable
+    std::array<const uint8_t*, 8> chrPages;
+    std::array<uint8_t, 32> sprites; // OAM entries of the sprites on this line, in priority order
+};
+
+/*
+    Where the i-th background tile drawn on a line comes from.
+*/
+struct BackgroundTileSource {
+    uint16_t entry; // Offset of the nametable entry in VRAM
+    uint16_t pattern; // Pattern table address of the tile's row on this line
+    uint8_t paletteHigh; // Attribute palette bits, shifted into place
+};
+
+BackgroundTileSource locateBackgroundTile(const ScanlineState& state, const uint8_t* vram, int i);
+int spritePatternAddress(const ScanlineState& state, int line, const uint8_t* sprite);
+
+/*
+    Draws one scanline as palette indices into out.
+    Bit i of tiles selects the pixels of the i-th background tile on the line, where tile 0
+    starts fineX pixels left of the screen. Pixels outside the selected tiles are not touched.
+    Returns the X position of the first sprite 0 hit among the drawn pixels, or -1 if there is none.
+*/
+int renderScanline(int line, const ScanlineState& state,
+    const uint8_t* vram, const uint8_t* palette, uint8_t* out, uint64_t tiles = ALL_TILES);
+
+int findSprite0Hit(int line, const ScanlineState& state, const uint8_t* vram, int fromX);
+
+uint64_t hashFrame(const uint8_t* frame, const uint8_t* emphasis);
+
+/*
+    A PPU memory write made during a recorded frame.
+    Line is the number of lines already drawn when the write happened.
+*/
+struct RecordedWrite {
+    enum kind : uint8_t { NAMETABLE, PALETTE, CHR };
+
+    const uint8_t* page; // CHR page written, if any
+    uint16_t offset;
+    uint8_t line, data;
+    kind type;
+};
+
+/*
+    The PPU-visible state of a whole frame, captured at each scanline boundary.
+    This is enough to redraw the frame later without running the emulator.
+*/
+struct FrameRecording {
+    // Memory contents at the start of the frame
+    std::array<uint8_t, 0x1000> vram;
+    std::array<uint8_t, 0x20> palette;
+    std::vector<std::pair<const uint8_t*, std::array<uint8_t, 0x400>>> chrRam;
+
+    std::array<ScanlineState, NES_FRAME_HEIGHT> lines;
+    std::vector<RecordedWrite> writes;
+};
+
+/*
+    Renders recorded frames by splitting the 240 lines into bands
+    that are drawn in parallel on a pool of worker threads.
+*/
+class ParallelFrameRenderer {
+    public:
+        ParallelFrameRenderer(int threadCount);
+        ~ParallelFrameRenderer();
+
+        void render(const FrameRecording& frame, uint8_t* framebuffer);
+
+    private:
+        void work(int band);
+        void renderBand(int band);
+
+        std::vector<std::thread> workers;
+        std::mutex jobMutex;
+        std::condition_variable jobCV, doneCV;
+        const FrameRecording* frame;
+        uint8_t* framebuffer;
+        int bands, bandsRemaining;
+        uint64_t generation;
+        bool stopping;
+
+        ParallelFrameRenderer(const ParallelFrameRenderer&) = delete;
+        ParallelFrameRenderer& operator=(const ParallelFrameRenderer&) = delete;
+};
@@ -0,0 +1,4 @@
+#pragma once
+#include <string>
+
+bool runPpuTest(std::string testName);
@@ -1,7 +1,55 @@
 #pragma once
 #include "core_memory.h"
+#include "mapped_file.h"
 #include <string>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+/*
+    The raw bytes of a ROM file, as a MappedFile so that PRG-ROM and CHR-ROM are used in place
+    without being copied, along with the CRC32 of its contents, which is worked out once when it is opened.
+*/
+class ROMImage {
+    public:
+        static std::shared_ptr<const ROMImage> open(const std::string& path);
+        static std::shared_ptr<const ROMImage> fromBuffer(std::vector<uint8_t> buffer);
+
+        std::span<const uint8_t> bytes() const;
+        std::span<const uint8_t> contents() const;
+        bool isMapped() const;
+        uint32_t checksum() const;
+
+    private:
+        ROMImage(std::unique_ptr<const MappedFile> file);
+
+        std::unique_ptr<const MappedFile> file;
+        uint32_t crc;
+
+        ROMImage(const ROMImage&) = delete;
+        ROMImage& operator=(const ROMImage&) = delete;
+};
+
+uint32_t crc32(std::span<const uint8_t> bytes);
+
+/*
+    Keeps a single copy of each distinct ROM image per process, keyed by the CRC32 of its contents.
+    Images are only held weakly, so an image is released once the last console using it is gone.
+*/
+class ROMCache {
+    public:
+        static std::shared_ptr<const ROMImage> share(std::shared_ptr<const ROMImage> image);
+        static size_t size();
+
+    private:
+        static std::mutex mutex;
+        static std::unordered_multimap<uint32_t, std::weak_ptr<const ROMImage>> images;
+};
+
+class ROMDatabase;
 
 class ROM {
     public:
@@ -10,12 +58,25 @@ class ROM {
         bool persistentMemory, trainer, fourScreenVRAM, nes2,
             playchoice10, VS_unisystem;
         uint8_t mapper, PRG_ROM_size, CHR_ROM_size, PRG_RAM_size;
+        bool serialPPU; // Recommended by the ROM database for games that need the PPU in step with the CPU
+        bool knownROM; // True if the ROM database had an entry for this ROM
 
         void setPath(std::string path);
+        std::string savePath() const;
+        void setImage(std::shared_ptr<const ROMImage> image);
+        void setDatabase(std::shared_ptr<const ROMDatabase> database);
         void parseHeader();
         std::unique_ptr<CoreMemory> loadIntoMemory();
 
+        std::span<const uint8_t> PRG_ROM() const;
+        std::span<const uint8_t> CHR_ROM() const;
+
     private:
         uint8_t flags6, flags7, flags9, flags10;
         std::string path;
+        std::shared_ptr<const ROMImage> image;
+        std::shared_ptr<const ROMDatabase> database;
+
+        void applyDatabase();
+        std::span<const uint8_t> prg, chr; // Point into the image
 };
@@ -0,0 +1,53 @@
+#pragma once
+#include "core_memory.h"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+/*
+    A local database of known ROMs, which corrects the many iNES headers that are wrong.
+    Entries are keyed by the CRC32 of everything after the header and trainer, which is
+    the PRG-ROM and CHR-ROM, so a ROM is recognised whatever its header says.
+
+    The file is a sorted array of fixed-size records that is memory-mapped and binary searched
+    in place, so opening it costs nothing per entry and each lookup is O(log n).
+    Every number is stored little-endian:
+    0-5: "NESDB" followed by MS-DOS EOF
+    6: Format version
+    7: Zero
+    8-11: Number of entries
+    12-: Entries of 12 bytes each, sorted by CRC32
+*/
+class ROMDatabase {
+    public:
+        enum entryFlag : uint8_t {
+            BATTERY = 0x1, // PRG-RAM is battery-backed
+            SERIAL_PPU = 0x2 // The game needs the PPU run in step with the CPU rather than pipelined
+        };
+
+        struct Entry {
+            uint32_t crc;
+            uint8_t PRG_ROM_size, CHR_ROM_size; // In 16 KB and 8 KB units, as in the header
+            uint8_t mapper;
+            mirroringMode mirroring;
+            uint8_t PRG_RAM_size; // In 8 KB units
+            uint8_t flags;
+        };
+
+        static const size_t HEADER_SIZE = 12, ENTRY_SIZE = 12;
+
+        static std::shared_ptr<const ROMDatabase> open(const std::string& path);
+        static bool write(const std::string& path, std::vector<Entry> entries);
+
+        std::optional<Entry> find(uint32_t crc) const;
+        size_t size() const;
+
+    private:
+        ROMDatabase() = default;
+        Entry entry(size_t index) const;
+
+        std::shared_ptr<const ROMImage> image; // The mapped file
+        size_t count = 0;
+};
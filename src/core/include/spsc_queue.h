@@ -0,0 +1,58 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+/*
+    A fixed-capacity, lock-free queue for passing items from exactly one
+    producer thread to exactly one consumer thread.
+    The capacity must be a power of two so that indices can wrap with a mask.
+*/
+template <typename T, size_t Capacity>
+class SPSCQueue {
+    static_assert(Capacity && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two.");
+
+    public:
+        /*
+            Adds an item to the back of the queue (producer only).
+            Returns false without blocking if the queue is full.
+        */
+        bool push(const T& item) {
+            size_t tail = tailIndex.load(std::memory_order_relaxed);
+            if (tail - headIndex.load(std::memory_order_acquire) == Capacity) {
+                return false;
+            }
+            buffer[tail & (Capacity - 1)] = item;
+            tailIndex.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /*
+            Returns the item at the front of the queue (consumer only),
+            or nullptr if the queue is empty. The item stays queued until pop().
+        */
+        T* front() {
+            size_t head = headIndex.load(std::memory_order_relaxed);
+            if (head == tailIndex.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            return &buffer[head & (Capacity - 1)];
+        }
+
+        /*
+            Removes the item at the front of the queue (consumer only).
+        */
+        void pop() {
+            headIndex.store(headIndex.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        bool empty() const {
+            return headIndex.load(std::memory_order_acquire) == tailIndex.load(std::memory_order_acquire);
+        }
+
+    private:
+        // The buffer sits between the two indices to keep them off the same cache line
+        std::atomic<size_t> headIndex {0};
+        std::array<T, Capacity> buffer {};
+        std::atomic<size_t> tailIndex {0};
+};
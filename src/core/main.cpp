@@ -1,6 +1,9 @@
 #include "nes.h"
 #include "display.h"
 #include "cpu_test.h"
+#include "ppu_test.h"
+#include "trace.h"
+#include <algorithm>
 #include <string>
 #include <print>
 
@@ -20,6 +23,21 @@ int main(int argc, char* argv[]) {
     if (path == "CPU_TEST") {
         std::string testName = argc > 2 ? argv[2] : "";
         runCpuTest(testName);
+    } else if (path == "PPU_TEST") {
+        std::string testName = argc > 2 ? argv[2] : "";
+        return runPpuTest(testName) ? 0 : 1;
+    } else if (path == "TRACE_CONVERT" || path == "TRACE_COMPARE") {
+        // Traces can be binary or text, and options follow the two paths
+        if (argc < 4) {
+            std::println("Usage: {} <input or expected trace> <output or actual trace> [REVERSE_PPU] [PREFIX]", path);
+            return 1;
+        }
+        bool reversePPU = std::find(argv + 4, argv + argc, std::string("REVERSE_PPU")) != argv + argc;
+        bool allowPrefix = std::find(argv + 4, argv + argc, std::string("PREFIX")) != argv + argc;
+        if (path == "TRACE_CONVERT") {
+            return convertTrace(argv[2], argv[3], reversePPU) ? 0 : 1;
+        }
+        return compareTraces(argv[2], argv[3], reversePPU, allowPrefix) ? 0 : 1;
     } else if (path == "DISPLAY_TEST") {
         std::string testType = argc > 2 ? argv[2] : "rectangle";
         runDisplayTest(testType);
@@ -0,0 +1,98 @@
+#include "mapped_file.h"
+#include <array>
+#include <fstream>
+
+#ifndef _WIN32
+#define MAPPED_FILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() {
+    data = nullptr;
+    size = 0;
+    mapped = false;
+}
+
+MappedFile::~MappedFile() {
+    #ifdef MAPPED_FILE_MMAP
+    if (mapped) {
+        munmap(const_cast<uint8_t*>(data), size);
+    }
+    #endif
+}
+
+/*
+    Opens a file, mapping it into memory if it is a regular file.
+    Anything else is read into a buffer. Returns nullptr if the file cannot be read.
+*/
+std::unique_ptr<const MappedFile> MappedFile::open(const std::string& path) {
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    if (file->map(path)) {
+        return file;
+    }
+
+    // The input may not be seekable, so read it in chunks until it ends
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return nullptr;
+    }
+    std::array<char, 0x10000> chunk;
+    while (input.read(chunk.data(), chunk.size()) || input.gcount()) {
+        file->buffer.insert(file->buffer.end(), chunk.begin(), chunk.begin() + input.gcount());
+    }
+    file->data = file->buffer.data();
+    file->size = file->buffer.size();
+    return file;
+}
+
+/*
+    Wraps bytes that are already in memory, such as a file taken out of an archive.
+*/
+std::unique_ptr<const MappedFile> MappedFile::fromBuffer(std::vector<uint8_t> buffer) {
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    file->buffer = std::move(buffer);
+    file->data = file->buffer.data();
+    file->size = file->buffer.size();
+    return file;
+}
+
+/*
+    Maps a regular file read-only. Returns false if the file cannot be mapped.
+*/
+bool MappedFile::map([[maybe_unused]] const std::string& path) {
+    #ifdef MAPPED_FILE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    void* address = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd); // The mapping stays valid after the file is closed
+    if (address == MAP_FAILED) {
+        return false;
+    }
+    data = static_cast<const uint8_t*>(address);
+    size = static_cast<size_t>(info.st_size);
+    mapped = true;
+    return true;
+    #else
+    return false;
+    #endif
+}
+
+std::span<const uint8_t> MappedFile::bytes() const {
+    return {data, size};
+}
+
+/*
+    Returns true if the bytes are mapped straight from the file rather than copied into a buffer.
+*/
+bool MappedFile::isMapped() const {
+    return mapped;
+}
@@ -1,16 +1,83 @@
 #include "nes.h"
+#include "cheats.h"
 
 NES::NES() {
     memory = nullptr;
+    snapshotGeneration = 0;
     cpu = std::make_unique<CPU>();
     ppu = std::make_shared<PPU>(*cpu);
     cpu->ppu = ppu;
+    cpu->setFrameHandler([this] () { saveBattery(); });
+}
+
+/*
+    The PPU and the cartridge point at each other, so one of the links has to be broken
+    for either of them (and the ROM image) to be released.
+*/
+NES::~NES() {
+    if (memory) {
+        memory->ppu = nullptr;
+    }
 }
 
 void NES::loadROM(ROM& rom) {
+    battery = nullptr; // Saves the previous game first
     memory = rom.loadIntoMemory();
+    ppu->setSerialOnly(rom.serialPPU);
     cpu->memory = memory;
+    memory->attachCPU(*cpu);
     ppu->memory = memory;
     memory->ppu = ppu;
+    memory->syncPPU();
+    if (rom.persistentMemory && !rom.savePath().empty()) {
+        battery = std::make_unique<BatteryBackup>(rom.savePath(), memory->batteryRAM(), memory->arena);
+    }
     cpu->setPC(true); // Load initial program counter from reset vector, don't add cycles
 }
+
+/*
+    Saves the console's writable memory into a snapshot.
+    Saving into the snapshot last saved into or restored from only copies the pages written since.
+*/
+void NES::saveSnapshot(MemorySnapshot& snapshot) {
+    bool current = snapshot.console == this && snapshot.generation == snapshotGeneration;
+    if (ppu->pipelined) {
+        ppu->synchronize(); // CHR-RAM lives in the arena, so logged writes to it must land before it is copied
+    }
+    snapshot.pagesCopied = memory->saveSnapshot(snapshot, current) + ppu->saveSnapshot(snapshot, current);
+    snapshot.console = this;
+    snapshot.generation = ++snapshotGeneration;
+}
+
+/*
+    Restores the console's writable memory from a snapshot, which then becomes the current one.
+*/
+void NES::restoreSnapshot(MemorySnapshot& snapshot) {
+    bool current = snapshot.console == this && snapshot.generation == snapshotGeneration;
+    if (ppu->pipelined) {
+        ppu->synchronize(); // Otherwise logged writes to CHR-RAM could land on top of the restored bytes
+    }
+    memory->restoreSnapshot(snapshot, current);
+    ppu->restoreSnapshot(snapshot, current);
+    snapshot.console = this;
+    snapshot.generation = ++snapshotGeneration;
+}
+
+/*
+    Hands battery-backed RAM that changed to the background writer, at most once per flush interval.
+    This never waits on the disk, so the CPU thread calls it at the start of every frame.
+*/
+void NES::saveBattery() {
+    if (battery) {
+        battery->update();
+    }
+}
+
+/*
+    Adds a Game Genie code or a raw patch (see parseCheat()).
+    Returns false if the code is not valid or patches a register.
+*/
+bool NES::addCheat(std::string_view code) {
+    std::optional<Cheat> cheat = parseCheat(code);
+    return cheat && memory->addCheat(*cheat);
+}
@@ -1,54 +1,531 @@
 #include "ppu.h"
 #include "cpu.h"
+#include <algorithm>
 
 PPU::PPU(CPU& cpu) : cpu(cpu) {
-    cyclesExecuted = scanline = cyclesOnLine = 0;
-    running = false;
+    running = pipelined = serialOnly = false;
+    publishedTicks = completedTicks = 0;
+    pushedEntries = poppedEntries = replayedEntries = 0;
+    predictionSequence = predictedFrame = predictedWrites = 0;
+    predictedHitTicks = predictedOverflowTicks = NO_EVENT;
+    loggedWrites = appliedWrites = 0;
+    sprite0HitTicks = spriteOverflowTicks = NO_EVENT;
+    spriteFlagsStale = true;
     bg16sr0 = bg16sr1 = bg8sr0 = bg8sr1 = 0;
-    
-    // Set the PPU registers to 0xff?
-    // Set initial state of 0x2002 register
-    // Note that 0xa0 would be used if we began with the pre-render scanline
-    writeRegister(0x2, 0x20);
+    v = t = 0;
+    fineX = readBuffer = 0;
+    w = recordingFrame = false;
+    incrementalRedraw = pixelOutput = drawingFrame = true;
+    chrPages.fill(unmappedCHR.data());
+    videoDirty.resize(VIDEO_MEMORY_BYTES);
+    setMirroring(HORIZONTAL);
 }
 
+/*
+    Reads one of the PPU registers on behalf of the CPU.
+*/
 uint8_t PPU::readRegister(addr_t address) {
-    uint8_t ret = registers[address];
-    if (address & 0x2) {
-        // TODO: Handle more special cases with PPU registers, especially VBL timing
-        // See https://www.nesdev.org/wiki/PPU_frame_timing for more details
-        
-        // Reading status register will change the value of bit 7
-        // TODO: Fix very precise timing constraints here
-        writeRegister(address, ret & ~0x80);
-        // printf("Cleared VBL value!\n");
+    if (!pipelined) {
+        return readRegisterDirect(address);
+    }
+
+    if (address == 0x2) {
+        // Vblank and open bus come straight from the timing model
+        // The sprite flags can only be set while rendering, and they come from the PPU thread's
+        // prediction then. We only wait for the PPU if that prediction is out of date.
+        uint8_t spriteFlags = 0;
+        if (model.renderingThisFrame && !predictedSpriteFlags(spriteFlags)) {
+            synchronize();
+            spriteFlags = currentSpriteFlags();
+        }
+        uint8_t ret = (model.status.vblank() ? 0x80 : 0) | spriteFlags | (model.openBus & 0x1f);
+        model.status.lastRead = model.clock.ticks;
+        logWrite({model.clock.ticks, LoggedWrite::STATUS_READ, address, 0, nullptr, 0, false});
+        return ret;
+    }
+
+    // Other reads depend on the PPU's internal state, so it has to catch up first
+    synchronize();
+    uint8_t ret = readRegisterDirect(address);
+    if (spriteFlagsStale) {
+        // The PPU thread is idle, so we can publish the new prediction ourselves
+        predictSpriteFlags();
     }
     return ret;
 }
 
+/*
+    Returns what a read of one of the PPU registers would, without clearing vblank,
+    moving the VRAM address, or waiting for the PPU thread.
+    While pipelined, the PPU's internal state belongs to its thread, so $2004 and $2007
+    peek as open bus, and the sprite flags read as clear if the latest prediction is out of date.
+*/
+uint8_t PPU::peekRegister(addr_t address) {
+    if (pipelined) {
+        if (address != 0x2) {
+            return model.openBus;
+        }
+        uint8_t spriteFlags = 0;
+        if (model.renderingThisFrame) {
+            predictedSpriteFlags(spriteFlags);
+        }
+        return (model.status.vblank() ? 0x80 : 0) | spriteFlags | (model.openBus & 0x1f);
+    }
+
+    switch (address) {
+        case 0x2:
+            return (status.vblank() ? 0x80 : 0) | currentSpriteFlags() | (registers[0x2] & 0x1f);
+        case 0x4:
+            return oam[registers[0x3]];
+        case 0x7:
+            return (v & 0x3fff) < 0x3f00 ? readBuffer : readMemory(v);
+        default:
+            return registers[address];
+    }
+}
+
+/*
+    Writes to one of the PPU registers on behalf of the CPU.
+*/
 void PPU::writeRegister(addr_t address, uint8_t data) {
+    if (!pipelined) {
+        writeRegisterDirect(address, data);
+        return;
+    }
+
+    // Keep the timing model in step with the registers it depends on
+    if (address == 0x1) {
+        model.mask = data;
+        model.renderingThisFrame |= (data & 0b11000) != 0;
+    } else if (address == 0x2) {
+        model.openBus = data;
+    }
+    model.openBus = (model.openBus & 0xf0) | (data & 0x0f);
+
+    loggedWrites++;
+    logWrite({model.clock.ticks, LoggedWrite::REGISTER, address, data, nullptr, 0, false});
+}
+
+/*
+    Writes a whole page into OAM, as 256 writes to $2004 would.
+*/
+void PPU::writeOAM(const uint8_t* data) {
+    if (pipelined) {
+        // The CPU is stalled for the transfer anyway, so let the PPU catch up and copy directly
+        synchronize();
+        model.openBus = (model.openBus & 0xf0) | (data[0xff] & 0x0f);
+    }
+
+    // The copy starts at OAMADDR and wraps around, leaving OAMADDR where it was
+    uint8_t start = registers[0x3];
+    std::copy(data, data + (0x100 - start), oam.begin() + start);
+    std::copy(data + (0x100 - start), data + 0x100, oam.begin());
+    videoDirty.mark(OAM_OFFSET);
+
+    registers[0x4] = data[0xff];
+    registers[0x2] = (registers[0x2] & 0xf0) | (data[0xff] & 0x0f);
+    spriteFlagsStale = true;
+    if (pipelined) {
+        // The PPU thread is idle, so we can publish the new prediction ourselves
+        predictSpriteFlags();
+    }
+}
+
+uint8_t PPU::readRegisterDirect(addr_t address) {
+    uint8_t ret = registers[address];
+    switch (address) {
+        case 0x2:
+            // The flags are worked out from timestamps, and the low bits are open bus
+            ret = (status.vblank() ? 0x80 : 0) | currentSpriteFlags() | (registers[0x2] & 0x1f);
+            // Reading clears vblank, and a read just before vblank starts keeps it from being set
+            // See https://www.nesdev.org/wiki/PPU_frame_timing for more details
+            status.lastRead = clock.ticks;
+            // It also resets the write toggle shared by $2005 and $2006
+            w = false;
+            break;
+        case 0x4:
+            ret = oam[registers[0x3]];
+            break;
+        case 0x7:
+            if ((v & 0x3fff) < 0x3f00) {
+                // Reads are delayed by one byte through the read buffer
+                ret = readBuffer;
+                readBuffer = readMemory(v);
+            } else {
+                // Palette reads are immediate, but the buffer still gets the nametable byte underneath
+                ret = readMemory(v);
+                readBuffer = readMemory(v - 0x1000);
+            }
+            v += (registers[0x0] & 0x4) ? 32 : 1;
+            spriteFlagsStale = true;
+            break;
+        default:
+            break;
+    }
+    return ret;
+}
+
+void PPU::writeRegisterDirect(addr_t address, uint8_t data) {
+    uint8_t changed = registers[address] ^ data;
     registers[address] = data;
     // Write to the PPU open bus
     registers[0x2] = (registers[0x2] & 0xf0) | (data & 0x0f);
+
+    // Only writes that can change the predicted sprite flags make them stale, so that
+    // raster effects writing the scroll after the hit do not pay for a new prediction
+    switch (address) {
+        case 0x0:
+            // The base nametable bits are copied into t
+            t = (t & 0xf3ff) | ((data & 0x3) << 10);
+            // Sprite size and the pattern tables change both flags, and the nametable bits move the background
+            if ((changed & 0x38) || ((changed & 0x3) && spriteHitPending())) {
+                spriteFlagsStale = true;
+            }
+            break;
+        case 0x1:
+            // Of the mask bits, only the rendering and left column enables matter
+            if (changed & 0x1e) {
+                spriteFlagsStale = true;
+            }
+            break;
+        case 0x4:
+            // Sprite 0 decides the hit, and the Y position of every sprite decides the overflow
+            if (registers[0x3] < 4 || (registers[0x3] & 0x3) == 0) {
+                spriteFlagsStale = true;
+            }
+            oam[registers[0x3]++] = data;
+            videoDirty.mark(OAM_OFFSET);
+            break;
+        case 0x5:
+            if (!w) {
+                // Coarse X scroll goes into t, fine X scroll into x
+                t = (t & 0xffe0) | (data >> 3);
+                fineX = data & 0x7;
+            } else {
+                // Fine and coarse Y scroll go into t
+                t = (t & 0x8c1f) | ((data & 0x7) << 12) | ((data & 0xf8) << 2);
+            }
+            w = !w;
+            spriteFlagsStale |= spriteHitPending();
+            break;
+        case 0x6:
+            if (!w) {
+                t = (t & 0x00ff) | ((data & 0x3f) << 8);
+            } else {
+                t = (t & 0xff00) | data;
+                v = t;
+            }
+            w = !w;
+            spriteFlagsStale |= spriteHitPending();
+            break;
+        case 0x7:
+            writeMemory(v, data);
+            v += (registers[0x0] & 0x4) ? 32 : 1;
+            spriteFlagsStale |= spriteHitPending();
+            break;
+        default:
+            break;
+    }
 }
 
+/*
+    Reads a byte from the PPU's own 14-bit address space.
+*/
+uint8_t PPU::readMemory(addr_t address) {
+    address &= 0x3fff;
+    if (address < 0x2000) {
+        return chrPages[address >> 10][address & 0x3ff];
+    } else if (address < 0x3f00) {
+        return nametables[(address >> 10) & 0x3][address & 0x3ff];
+    }
+    return paletteEntry(address);
+}
+
+/*
+    Writes a byte to the PPU's own 14-bit address space.
+*/
+void PPU::writeMemory(addr_t address, uint8_t data) {
+    address &= 0x3fff;
+    if (address < 0x2000) {
+        // Pattern table writes only stick if the cartridge uses CHR-RAM
+        if (chrWritable[address >> 10]) {
+            uint8_t* page = chrPages[address >> 10];
+            page[address & 0x3ff] = data;
+            if (memory) {
+                memory->markWritten(page + (address & 0x3ff));
+            }
+            spriteFlagsStale |= spriteHitPending();
+            recordWrite(RecordedWrite::CHR, page, address & 0x3ff, data);
+
+            // The same page may be mapped into more than one slot
+            for (int slot = 0; slot < 8; slot++) {
+                if (chrPages[slot] == page) {
+                    int tile = (slot * 0x400 + (address & 0x3ff)) >> 4;
+                    frameDirty.patterns.set(tile);
+                    pendingDirty.patterns.set(tile);
+                    frameDirty.any = pendingDirty.any = true;
+                }
+            }
+        }
+    } else if (address < 0x3f00) {
+        uint8_t* entry = nametables[(address >> 10) & 0x3] + (address & 0x3ff);
+        *entry = data;
+        int offset = static_cast<int>(entry - vram.data());
+        videoDirty.mark(offset);
+        spriteFlagsStale |= spriteHitPending();
+        recordWrite(RecordedWrite::NAMETABLE, nullptr, static_cast<uint16_t>(offset), data);
+
+        frameDirty.any = pendingDirty.any = true;
+        if ((offset & 0x3ff) < 0x3c0) {
+            frameDirty.nametable.set(offset);
+            pendingDirty.nametable.set(offset);
+        } else {
+            // An attribute byte covers a block of 4x4 tiles
+            int block = (offset & 0x3ff) - 0x3c0, table = offset & ~0x3ff;
+            for (int row = (block >> 3) * 4; row < (block >> 3) * 4 + 4 && row < 30; row++) {
+                for (int column = (block & 7) * 4; column < (block & 7) * 4 + 4; column++) {
+                    frameDirty.nametable.set(table + row * 32 + column);
+                    pendingDirty.nametable.set(table + row * 32 + column);
+                }
+            }
+        }
+    } else {
+        // Palette RAM is only six bits wide
+        uint8_t& entry = paletteEntry(address);
+        entry = data & 0x3f;
+        int index = static_cast<int>(&entry - palette.data());
+        videoDirty.mark(PALETTE_OFFSET);
+        recordWrite(RecordedWrite::PALETTE, nullptr, static_cast<uint16_t>(index), entry);
+
+        frameDirty.palette |= 1u << index;
+        pendingDirty.palette |= 1u << index;
+        frameDirty.any = pendingDirty.any = true;
+    }
+}
+
+/*
+    Returns the palette RAM entry for an address.
+    Entries $3F10, $3F14, $3F18, and $3F1C mirror $3F00, $3F04, $3F08, and $3F0C.
+*/
+uint8_t& PPU::paletteEntry(addr_t address) {
+    address &= 0x1f;
+    if ((address & 0x13) == 0x10) {
+        address &= 0x0f;
+    }
+    return palette[address];
+}
+
+/*
+    Points one of the eight 1 KB pattern table slots at cartridge memory.
+    Mappers call this whenever they switch CHR banks.
+*/
+void PPU::mapCHR(int slot, uint8_t* page, bool writable) {
+    LoggedWrite entry {model.clock.ticks, LoggedWrite::CHR_PAGE, 0, 0, page, static_cast<uint8_t>(slot), writable};
+    if (pipelined) {
+        loggedWrites++;
+        logWrite(entry);
+    } else {
+        applyWrite(entry);
+    }
+}
+
+/*
+    Points a pattern table slot at read-only cartridge memory, such as CHR-ROM inside a ROM image.
+*/
+void PPU::mapCHR(int slot, const uint8_t* page) {
+    // Pattern table writes only go through writable slots, so the page is never modified
+    mapCHR(slot, const_cast<uint8_t*>(page), false);
+}
+
+/*
+    Changes which VRAM pages the four logical nametables refer to.
+*/
+void PPU::setMirroring(mirroringMode mirroring) {
+    LoggedWrite entry {model.clock.ticks, LoggedWrite::MIRRORING, 0, static_cast<uint8_t>(mirroring), nullptr, 0, false};
+    if (pipelined) {
+        loggedWrites++;
+        logWrite(entry);
+    } else {
+        applyWrite(entry);
+    }
+}
+
+/*
+    Applies a change to PPU-visible state, either immediately or when replayed from the log.
+*/
+void PPU::applyWrite(const LoggedWrite& entry) {
+    // Physical nametable used by each logical nametable, indexed by mirroringMode
+    static const int nametableLayouts[][4] = {
+        {0, 0, 1, 1}, // HORIZONTAL
+        {0, 1, 0, 1}, // VERTICAL
+        {0, 0, 0, 0}, // SINGLE_LOWER
+        {1, 1, 1, 1}, // SINGLE_UPPER
+        {0, 1, 2, 3}, // FOUR_SCREEN
+    };
+
+    switch (entry.type) {
+        case LoggedWrite::REGISTER:
+            appliedWrites++;
+            writeRegisterDirect(entry.address, entry.data);
+            break;
+        case LoggedWrite::STATUS_READ:
+            readRegisterDirect(0x2);
+            break;
+        case LoggedWrite::CHR_PAGE:
+            appliedWrites++;
+            spriteFlagsStale = true;
+            chrPages[entry.slot] = entry.page;
+            chrWritable[entry.slot] = entry.writable;
+            if (entry.writable && std::find(chrRamPages.begin(), chrRamPages.end(), entry.page) == chrRamPages.end()) {
+                chrRamPages.push_back(entry.page);
+            }
+            break;
+        case LoggedWrite::PIXEL_OUTPUT:
+            pixelOutput = entry.data;
+            break;
+        case LoggedWrite::MIRRORING:
+            appliedWrites++;
+            spriteFlagsStale = true;
+            for (int i = 0; i < 4; i++) {
+                nametableLayout[i] = static_cast<uint8_t>(nametableLayouts[entry.data][i]);
+                nametables[i] = vram.data() + nametableLayout[i] * 0x400;
+            }
+            break;
+    }
+}
+
+/*
+    Queues a change for the PPU thread, waiting for space if it has fallen too far behind.
+*/
+void PPU::logWrite(const LoggedWrite& entry) {
+    while (!writeLog.push(entry)) {
+        std::this_thread::yield();
+    }
+    pushedEntries++;
+}
+
+/*
+    Waits until the PPU thread has caught up with the CPU thread.
+    The PPU thread stays idle until more cycles are published, so the CPU
+    thread may then safely touch the PPU's state directly.
+    An empty log is not enough, since the PPU thread may still be working on the last entry
+    it took, so this waits for catchUp() to report every entry as replayed.
+*/
+void PPU::synchronize() {
+    while (replayedEntries.load(std::memory_order_acquire) != pushedEntries
+        || completedTicks.load(std::memory_order_acquire) < model.clock.ticks) {
+        std::this_thread::yield();
+    }
+}
+
+/*
+    Switches pipelined mode on or off. This must only be called while the PPU thread is stopped.
+    Pipelining stays off while setSerialOnly() is in effect.
+*/
+void PPU::setPipelined(bool newPipelined) {
+    pipelined = newPipelined && !serialOnly;
+    if (pipelined) {
+        // Start the timing model from the PPU's current state
+        model.clock = clock;
+        model.mask = registers[0x1];
+        model.status = status;
+        model.openBus = registers[0x2];
+        model.renderingThisFrame = renderingEnabled();
+        publishedTicks = completedTicks = clock.ticks;
+        pushedEntries = poppedEntries = replayedEntries = 0;
+        loggedWrites = appliedWrites = 0;
+        predictSpriteFlags();
+    }
+}
+
+/*
+    Keeps the PPU in step with the CPU, for games the ROM database marks as needing it.
+    This turns pipelining off, and setPipelined() leaves it off until this is cleared again.
+    This must only be called while the PPU thread is stopped.
+*/
+void PPU::setSerialOnly(bool newSerialOnly) {
+    serialOnly = newSerialOnly;
+    if (serialOnly) {
+        setPipelined(false);
+    }
+}
+
+/*
+    Runs the PPU on its own thread in pipelined mode until stopped by PPU::stop().
+    The PPU never runs past the last cycle published by the CPU thread, and it
+    replays each logged write once it reaches the cycle at which the write happened.
+    If pipelining is off, the CPU thread steps the PPU itself, so this thread has nothing to do.
+*/
 void PPU::start() {
     running = true;
+    if (!pipelined) {
+        return;
+    }
 
     while (running) {
-        std::unique_lock lck(cpuToPpuMutex);
-        cpuToPpuCV.wait(lck);
-        
-        // We want 3 PPU cycles for every CPU cycle.
-        for (int i = 0; i < 3; i++) {
+        uint64_t target = publishedTicks.load(std::memory_order_acquire);
+        if (clock.ticks == target && writeLog.empty()) {
+            std::this_thread::yield();
+            continue;
+        }
+        catchUp(target);
+    }
+
+    // Finish the remaining work so the PPU state is complete once pipelining ends
+    catchUp(publishedTicks.load(std::memory_order_acquire));
+}
+
+/*
+    Runs PPU cycles and replays logged writes until the PPU reaches the target cycle.
+*/
+void PPU::catchUp(uint64_t target) {
+    while (true) {
+        LoggedWrite* entry = writeLog.front();
+        if (entry && entry->timestamp <= clock.ticks) {
+            // The write must become visible before it is removed from the log
+            applyWrite(*entry);
+            writeLog.pop();
+            poppedEntries++;
+            continue;
+        }
+
+        uint64_t until = entry ? std::min(target, entry->timestamp) : target;
+        if (clock.ticks >= until) {
+            break;
+        }
+        while (clock.ticks < until) {
             cycle();
         }
+    }
+    if (spriteFlagsStale) {
+        // Publish a fresh prediction before going idle, so $2002 reads need not wait for us
+        predictSpriteFlags();
+    }
+    completedTicks.store(clock.ticks, std::memory_order_release);
+    // This is the last thing the PPU thread does before going idle, so synchronize() waits for it
+    replayedEntries.store(poppedEntries, std::memory_order_release);
+}
 
-        cpu.ppuToCpuCV.notify_one();
+/*
+    Stops the PPU thread after it catches up with the CPU thread.
+    Argument t is the thread running PPU::start() that needs to end.
+*/
+void PPU::stop(std::thread& t) {
+    running = false;
+
+    if (t.joinable()) {
+        t.join();
     }
 }
 
 void PPU::cycle() {
+    int scanline = clock.scanline, cyclesOnLine = clock.cyclesOnLine;
+
+    // Sprite flags can only be set on visible lines, so predictions wait until then
+    if (spriteFlagsStale && scanline < 240) {
+        predictSpriteFlags();
+    }
+
     if (scanline < 240) {
         if (cyclesOnLine > 0) {
             // The first cycle is idle and should be ignored
@@ -62,6 +539,13 @@ void PPU::cycle() {
                     - Pattern table tile low
                     - Pattern table tile high
                 */
+                if (cyclesOnLine == 256) {
+                    // Draw the whole line now, then move down to the next one
+                    drawScanline();
+                    if (renderingEnabled()) {
+                        incrementY(v);
+                    }
+                }
             }
             else if (cyclesOnLine < 321) {
                 /*
@@ -72,6 +556,10 @@ void PPU::cycle() {
                     - Pattern table tile high
                     Each takes two cycles, and we repeat for each of the eight sprites.
                 */
+                if (cyclesOnLine == 257 && renderingEnabled()) {
+                    // Reload the horizontal scroll bits for the next line
+                    v = (v & ~0x041f) | (t & 0x041f);
+                }
             }
             else if (cyclesOnLine < 337) {
                 /*
@@ -98,35 +586,504 @@ void PPU::cycle() {
     else /* 241 to 261 */ {
         // Vertical blanking
         if (scanline == 241 && cyclesOnLine == 0) {
-            // Set the vblank value on the second cycle of this line
-            writeRegister(0x2, readRegister(0x2) | 0x80);
+            // Vblank is set on the second cycle of this line
+            status.vblankSet = clock.ticks;
+        }
+        if (scanline == 261) {
+            if (cyclesOnLine == 0) {
+                // Vblank, sprite 0 hit, and sprite overflow are cleared on the second cycle of this line
+                status.frameClear = clock.ticks;
+                sprite0HitTicks = spriteOverflowTicks = NO_EVENT;
+                spriteFlagsStale = true;
+            } else if (renderingEnabled()) {
+                // The pre-render line reloads the scroll position for the top of the next frame
+                if (cyclesOnLine == 257) {
+                    v = (v & ~0x041f) | (t & 0x041f);
+                } else if (cyclesOnLine == 280) {
+                    v = (v & ~0x7be0) | (t & 0x7be0);
+                }
+            }
         }
-        if (scanline == 261 && cyclesOnLine == 0) {
-            // Clear the vblank bit on the second cycle of this line
-            // TODO: Also clear sprite overflow bit?
-            writeRegister(0x2, readRegister(0x2) & ~0x80);
+    }
+
+    clock.tick(renderingEnabled());
+}
+
+/*
+    Moves a scroll address like v down by one pixel row, wrapping into the vertically adjacent nametable.
+*/
+void PPU::incrementY(uint16_t& address) {
+    if ((address & 0x7000) != 0x7000) {
+        // Increment fine Y
+        address += 0x1000;
+        return;
+    }
+
+    address &= ~0x7000;
+    int coarseY = (address & 0x03e0) >> 5;
+    if (coarseY == 29) {
+        // The last row of tiles, so switch vertical nametables
+        coarseY = 0;
+        address ^= 0x0800;
+    } else if (coarseY == 31) {
+        // Out of bounds (into attribute memory), so wrap without switching
+        coarseY = 0;
+    } else {
+        coarseY++;
+    }
+    address = (address & ~0x03e0) | (coarseY << 5);
+}
+
+/*
+    Captures the state used for the current scanline and draws it into the framebuffer.
+*/
+void PPU::drawScanline() {
+    int line = clock.scanline;
+
+    if (line == 0) {
+        drawingFrame = pixelOutput;
+        // Changes made since the last frame started now apply to this one
+        frameDirty = pendingDirty;
+        pendingDirty.clear();
+    }
+    if (!drawingFrame) {
+        // The framebuffer keeps the last drawn frame, which this line no longer matches
+        previousLinesValid.reset(line);
+        return;
+    }
+
+    ScanlineState state;
+    state.v = v;
+    state.fineX = fineX;
+    state.ctrl = registers[0x0];
+    state.mask = registers[0x1];
+    state.nametableLayout = nametableLayout;
+    std::copy(chrPages.begin(), chrPages.end(), state.chrPages.begin());
+    evaluateSprites(line, state);
+
+    if (frameRecorder) {
+        if (line == 0) {
+            startRecording();
         }
+        recording.lines[line] = state;
     }
 
+    // The sprite 0 hit flag is set separately at its predicted dot (see predictSpriteFlags)
+    lineEmphasis[line] = state.mask >> 5;
+    uint64_t tiles = dirtyTiles(line, state);
+    if (tiles) {
+        renderScanline(line, state, vram.data(), palette.data(), &framebuffer[line * NES_FRAME_WIDTH], tiles);
+    }
+    previousLines[line] = state;
+    previousLinesValid.set(line);
+
+    if (recordingFrame && line == NES_FRAME_HEIGHT - 1) {
+        recordingFrame = false;
+        frameRecorder(recording);
+    }
+}
+
+/*
+    Finds the first eight sprites on a scanline.
+    Overflow past eight sprites is flagged separately at its predicted dot (see predictSpriteFlags).
+*/
+void PPU::evaluateSprites(int line, ScanlineState& state) {
+    state.spriteCount = 0;
+    state.sprite0OnLine = false;
+    if (!renderingEnabled()) {
+        return;
+    }
+
+    int height = (registers[0x0] & 0x20) ? 16 : 8;
+    for (int i = 0; i < 64; i++) {
+        int row = line - oam[i * 4] - 1;
+        if (row < 0 || row >= height) {
+            continue;
+        }
+        if (state.spriteCount == 8) {
+            break;
+        }
+        if (i == 0) {
+            state.sprite0OnLine = true;
+        }
+        std::copy(&oam[i * 4], &oam[i * 4] + 4, &state.sprites[state.spriteCount * 4]);
+        state.spriteCount++;
+    }
+}
+
+/*
+    Works out which background tiles of a line need to be redrawn over the previous frame.
+    Returns ALL_TILES when the line has to be drawn from scratch.
+*/
+uint64_t PPU::dirtyTiles(int line, const ScanlineState& state) {
+    const ScanlineState& previous = previousLines[line];
+    if (!incrementalRedraw || !previousLinesValid[line] || (frameDirty.palette & 0x1)
+        || state.v != previous.v || state.fineX != previous.fineX || state.ctrl != previous.ctrl
+        || state.mask != previous.mask || state.nametableLayout != previous.nametableLayout
+        || state.chrPages != previous.chrPages) {
+        return ALL_TILES;
+    }
+
+    uint64_t tiles = 0;
+    if ((state.mask & 0x08) && frameDirty.any) {
+        for (int i = 0; i < 33; i++) {
+            BackgroundTileSource source = locateBackgroundTile(state, vram.data(), i);
+            // Each background palette uses three entries, as the first one is the backdrop
+            uint32_t paletteEntries = 0xeu << source.paletteHigh;
+            if (frameDirty.nametable[source.entry] || frameDirty.patterns[source.pattern >> 4]
+                || (frameDirty.palette & paletteEntries)) {
+                tiles |= 1ull << i;
+            }
+        }
+    }
+
+    if (state.mask & 0x10) {
+        bool spritesChanged = state.spriteCount != previous.spriteCount
+            || !std::equal(state.sprites.begin(), state.sprites.begin() + state.spriteCount * 4, previous.sprites.begin());
+        for (int i = 0; i < state.spriteCount && !spritesChanged && frameDirty.any; i++) {
+            const uint8_t* sprite = &state.sprites[i * 4];
+            uint32_t paletteEntries = 0xeu << (0x10 | ((sprite[2] & 0x3) << 2));
+            spritesChanged = frameDirty.patterns[spritePatternAddress(state, line, sprite) >> 4]
+                || (frameDirty.palette & paletteEntries);
+        }
+
+        if (spritesChanged) {
+            // Redraw wherever a sprite was drawn last frame or is drawn now
+            for (const ScanlineState* lineState : {&previous, &state}) {
+                for (int i = 0; i < lineState->spriteCount; i++) {
+                    int x = lineState->sprites[i * 4 + 3] + state.fineX;
+                    tiles |= (1ull << (x >> 3)) | (1ull << ((x + 7) >> 3));
+                }
+            }
+            tiles &= ALL_TILES;
+        }
+    }
+    return tiles;
+}
+
+/*
+    Turns incremental redraw on or off. With it off, every line is drawn in full.
+*/
+void PPU::setIncrementalRedraw(bool enabled) {
+    incrementalRedraw = enabled;
+}
+
+/*
+    Turns drawing on or off from the top of the next frame.
+    Frames drawn with it off are neither drawn nor recorded, and frame() keeps the last drawn frame.
+    Vblank, sprite 0 hit, and sprite overflow come out exactly the same either way.
+*/
+void PPU::setPixelOutput(bool enabled) {
+    LoggedWrite entry {model.clock.ticks, LoggedWrite::PIXEL_OUTPUT, 0, enabled, nullptr, 0, false};
+    if (pipelined) {
+        logWrite(entry);
+    } else {
+        applyWrite(entry);
+    }
+}
+
+/*
+    Copies VRAM, OAM, and palette RAM into a snapshot, like CoreMemory::saveSnapshot().
+*/
+size_t PPU::saveSnapshot(MemorySnapshot& snapshot, bool current) {
+    if (pipelined) {
+        synchronize();
+    }
+    if (!current || snapshot.video.size() != VIDEO_MEMORY_BYTES) {
+        snapshot.video.resize(VIDEO_MEMORY_BYTES);
+        videoDirty.markAll();
+    }
+    return videoDirty.copyMarked(videoMemory.data(), snapshot.video.data(), VIDEO_MEMORY_BYTES);
+}
+
+/*
+    Copies VRAM, OAM, and palette RAM back from a snapshot, like CoreMemory::restoreSnapshot().
+    Every line is redrawn afterwards, and the sprite flags are predicted again.
+*/
+void PPU::restoreSnapshot(const MemorySnapshot& snapshot, bool current) {
+    if (snapshot.video.size() != VIDEO_MEMORY_BYTES) {
+        throw std::runtime_error("Snapshot does not contain PPU memory!");
+    }
+    if (pipelined) {
+        // The PPU thread is idle once it has caught up, so we can copy directly
+        synchronize();
+    }
+    if (!current) {
+        videoDirty.markAll();
+    }
+    videoDirty.copyMarked(snapshot.video.data(), videoMemory.data(), VIDEO_MEMORY_BYTES);
+
+    previousLinesValid.reset();
+    spriteFlagsStale = true;
+    if (pipelined) {
+        predictSpriteFlags();
+    }
+}
+
+void PPU::DirtyMemory::clear() {
+    nametable.reset();
+    patterns.reset();
+    palette = 0;
+    any = false;
+}
+
+/*
+    Sets a callback that receives a recording of every completed frame.
+    Recording starts at the top of the next frame.
+*/
+void PPU::setFrameRecorder(std::function<void(const FrameRecording&)> recorder) {
+    frameRecorder = recorder;
+    recordingFrame = false;
+}
+
+/*
+    Snapshots PPU memory at the top of the frame. Later writes are logged by line.
+*/
+void PPU::startRecording() {
+    std::copy(vram.begin(), vram.end(), recording.vram.begin());
+    std::copy(palette.begin(), palette.end(), recording.palette.begin());
+    recording.chrRam.clear();
+    for (uint8_t* page : chrRamPages) {
+        recording.chrRam.emplace_back(page, std::array<uint8_t, 0x400> {});
+        std::copy(page, page + 0x400, recording.chrRam.back().second.begin());
+    }
+    recording.writes.clear();
+    recordingFrame = true;
+}
+
+/*
+    Logs a PPU memory write made while a frame is being recorded.
+*/
+void PPU::recordWrite(RecordedWrite::kind type, const uint8_t* page, uint16_t offset, uint8_t data) {
+    if (recordingFrame) {
+        // Lines up to the current one have been drawn once we pass dot 256
+        int linesDrawn = clock.scanline + (clock.cyclesOnLine > 256 ? 1 : 0);
+        recording.writes.push_back({page, offset, static_cast<uint8_t>(linesDrawn), data, type});
+    }
+}
+
+/*
+    Advances the clock by one PPU cycle.
+*/
+void PPUClock::tick(bool renderingEnabled) {
+    ticks++;
     cyclesExecuted++;
     // If rendering is disabled, we skip this one particular PPU cycle
-    if (renderingEnabled()) {
+    if (renderingEnabled) {
         if (scanline == 261 && cyclesOnLine == 339 && oddFrame) {
             cyclesExecuted++;
         }
     }
-    scanline = (cyclesExecuted / 341) % 262;
-    cyclesOnLine = cyclesExecuted % 341;
+    scanline = static_cast<int>((cyclesExecuted / 341) % 262);
+    cyclesOnLine = static_cast<int>(cyclesExecuted % 341);
     // Maintain flag for frame parity check
     oddFrame = cyclesExecuted / (341 * 262) % 2 > 0;
 }
 
+/*
+    Counts the pre-render lines that have started, so this changes whenever the status flags are cleared.
+*/
+int PPUClock::statusFrame() const {
+    return static_cast<int>((cyclesExecuted + 340) / (341 * 262));
+}
+
+/*
+    Vblank reads as set from its edge until the pre-render clear or the next status read.
+    A read on the very cycle the flag is set comes first, and keeps it from being seen this frame.
+*/
+bool StatusEdges::vblank() const {
+    return vblankSet > frameClear && lastRead < vblankSet;
+}
+
+/*
+    Sprite 0 hit and sprite overflow bits of $2002 as of now.
+    A predicted event counts once the cycle it happens on has been run.
+*/
+uint8_t PPU::currentSpriteFlags() {
+    return (sprite0HitTicks < clock.ticks ? 0x40 : 0) | (spriteOverflowTicks < clock.ticks ? 0x20 : 0);
+}
+
+/*
+    Works out when the sprite 0 hit and sprite overflow flags will next be set, assuming there are
+    no more writes to the PPU before the flags are cleared on the pre-render line.
+    The hit comes from OAM entry 0 and just the background tiles underneath it, and the overflow
+    from counting sprites on each line. The hardware's buggy overflow check is not emulated.
+*/
+void PPU::predictSpriteFlags() {
+    spriteFlagsStale = false;
+
+    // A flag that is already set stays set until the pre-render line
+    sprite0HitTicks = sprite0HitTicks < clock.ticks ? sprite0HitTicks : NO_EVENT;
+    spriteOverflowTicks = spriteOverflowTicks < clock.ticks ? spriteOverflowTicks : NO_EVENT;
+
+    int line = clock.scanline, dot = clock.cyclesOnLine;
+    bool findHit = sprite0HitTicks == NO_EVENT && (registers[0x1] & 0x18) == 0x18;
+    bool findOverflow = spriteOverflowTicks == NO_EVENT && renderingEnabled();
+    if (line >= NES_FRAME_HEIGHT && line < 261) {
+        // No visible lines are left before the flags are cleared
+        findHit = findOverflow = false;
+    }
+
+    uint16_t scroll = v;
+    if ((findHit || findOverflow) && line == 261) {
+        // The pre-render line reloads the scroll position for the top of the frame
+        if (dot <= 257) {
+            scroll = (scroll & ~0x041f) | (t & 0x041f);
+        }
+        if (dot <= 280) {
+            scroll = (scroll & ~0x7be0) | (t & 0x7be0);
+        }
+        line = dot = 0;
+    }
+
+    int height = (registers[0x0] & 0x20) ? 16 : 8;
+    std::array<uint8_t, NES_FRAME_HEIGHT> spritesOnLine {};
+    if (findOverflow) {
+        for (int i = 0; i < 64; i++) {
+            for (int row = 0, y = oam[i * 4] + 1; row < height && y + row < NES_FRAME_HEIGHT; row++) {
+                spritesOnLine[y + row]++;
+            }
+        }
+    }
+
+    ScanlineState state;
+    state.fineX = fineX;
+    state.ctrl = registers[0x0];
+    state.mask = registers[0x1];
+    state.spriteCount = 1;
+    state.nametableLayout = nametableLayout;
+    std::copy(chrPages.begin(), chrPages.end(), state.chrPages.begin());
+    std::copy(oam.begin(), oam.begin() + 4, state.sprites.begin());
+
+    for (; (findHit || findOverflow) && line < NES_FRAME_HEIGHT; line++, dot = 0) {
+        // Each line is drawn at dot 256, which also moves v down a row
+        if (dot <= 256) {
+            if (findOverflow && spritesOnLine[line] > 8) {
+                spriteOverflowTicks = ticksAt(line, 256);
+                findOverflow = false;
+            }
+            int row = line - oam[0] - 1;
+            if (findHit && row >= 0 && row < height) {
+                state.v = scroll;
+                state.sprite0OnLine = true;
+                // A pixel at X is output on dot X + 1, so skip those already past
+                int x = findSprite0Hit(line, state, vram.data(), dot - 1);
+                if (x >= 0) {
+                    sprite0HitTicks = ticksAt(line, x + 1);
+                    findHit = false;
+                }
+            }
+            incrementY(scroll);
+        }
+        if (dot <= 257) {
+            scroll = (scroll & ~0x041f) | (t & 0x041f);
+        }
+    }
+
+    if (pipelined) {
+        publishSpriteFlags();
+    }
+}
+
+/*
+    Returns true if sprite 0 can still hit this frame, in which case the prediction depends on
+    the scroll position, the nametables, and the pattern tables. The overflow only depends on OAM.
+*/
+bool PPU::spriteHitPending() {
+    return (registers[0x1] & 0x18) == 0x18 && sprite0HitTicks >= clock.ticks && oam[0] < NES_FRAME_HEIGHT - 1;
+}
+
+/*
+    Returns the tick at which the PPU will reach a dot on a visible line later in this frame.
+*/
+uint64_t PPU::ticksAt(int line, int dot) {
+    int64_t distance;
+    if (clock.scanline == 261) {
+        distance = (341 - clock.cyclesOnLine) + line * 341 + dot;
+        // The pre-render line is one dot shorter on odd frames while rendering
+        if (clock.oddFrame && clock.cyclesOnLine <= 339 && renderingEnabled()) {
+            distance--;
+        }
+    } else {
+        distance = (line - clock.scanline) * 341 + dot - clock.cyclesOnLine;
+    }
+    return clock.ticks + distance;
+}
+
+/*
+    Makes the current sprite flag prediction visible to the CPU thread.
+*/
+void PPU::publishSpriteFlags() {
+    uint64_t sequence = predictionSequence.load(std::memory_order_relaxed);
+    predictionSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    predictedFrame.store(clock.statusFrame(), std::memory_order_relaxed);
+    predictedHitTicks.store(sprite0HitTicks, std::memory_order_relaxed);
+    predictedOverflowTicks.store(spriteOverflowTicks, std::memory_order_relaxed);
+    predictedWrites.store(appliedWrites, std::memory_order_relaxed);
+
+    predictionSequence.store(sequence + 2, std::memory_order_release);
+}
+
+/*
+    Answers the sprite flags of $2002 on the CPU thread from the PPU thread's prediction.
+    Returns false if the prediction is out of date, because the PPU thread has not yet
+    seen every write or has not yet started this frame.
+*/
+bool PPU::predictedSpriteFlags(uint8_t& flags) {
+    uint64_t sequence = predictionSequence.load(std::memory_order_acquire);
+    if (sequence & 1) {
+        return false;
+    }
+    uint64_t frame = predictedFrame.load(std::memory_order_relaxed),
+             hitTicks = predictedHitTicks.load(std::memory_order_relaxed),
+             overflowTicks = predictedOverflowTicks.load(std::memory_order_relaxed),
+             writes = predictedWrites.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (predictionSequence.load(std::memory_order_relaxed) != sequence) {
+        return false;
+    }
+
+    if (frame != static_cast<uint64_t>(model.clock.statusFrame()) || writes != loggedWrites) {
+        return false;
+    }
+    // A flag set on some tick is visible once that tick has run
+    flags = (hitTicks < model.clock.ticks ? 0x40 : 0) | (overflowTicks < model.clock.ticks ? 0x20 : 0);
+    return true;
+}
+
+/*
+    Advances the timing model by n PPU cycles, following the same vblank edges as PPU::cycle().
+*/
+void PPU::TimingModel::advance(int n) {
+    bool renderingEnabled = (mask & 0b11000) != 0;
+    for (int i = 0; i < n; i++) {
+        if (clock.cyclesOnLine == 0) {
+            if (clock.scanline == 241) {
+                status.vblankSet = clock.ticks;
+            } else if (clock.scanline == 261) {
+                status.frameClear = clock.ticks;
+                renderingThisFrame = renderingEnabled;
+            }
+        }
+        clock.tick(renderingEnabled);
+    }
+}
+
 bool PPU::renderingEnabled() {
     uint8_t mask = registers[1];
     return (mask & 0b11000) != 0;
 }
 
 void PPU::cycles(int n) {
+    if (pipelined) {
+        // Only the timing model moves here; the PPU thread catches up on its own
+        model.advance(n);
+        publishedTicks.store(model.clock.ticks, std::memory_order_release);
+        return;
+    }
+
     for (int i = 0; i < n; i++) {
         cycle();
     }
@@ -135,3 +1092,35 @@ void PPU::cycles(int n) {
 bool PPU::checkRunning() {
     return running;
 }
+
+bool PPU::checkPipelined() {
+    return pipelined;
+}
+
+/*
+    Returns the palette indices of the most recently drawn frame, one byte per pixel.
+*/
+const uint8_t* PPU::frame() {
+    return framebuffer.data();
+}
+
+/*
+    Returns the color emphasis bits of each line of the most recently drawn frame.
+*/
+const uint8_t* PPU::frameEmphasis() {
+    return lineEmphasis.data();
+}
+
+/*
+    Returns a hash of the most recently drawn frame's palette indices and emphasis bits.
+*/
+uint64_t PPU::frameHash() {
+    return hashFrame(framebuffer.data(), lineEmphasis.data());
+}
+
+/*
+    Returns the PPU's position in the frame as seen from the CPU thread.
+*/
+const PPUClock& PPU::timing() {
+    return pipelined ? model.clock : clock;
+}
@@ -0,0 +1,368 @@
+#include "ppu_render.h"
+#include <algorithm>
+#include <cstring>
+
+/*
+    The two pattern bytes and the attribute palette bits of one background tile.
+*/
+struct BackgroundTile {
+    uint8_t low, high, paletteHigh;
+};
+
+/*
+    Finds the i-th background tile drawn on a line, counting from the scroll position in state.v.
+*/
+BackgroundTileSource locateBackgroundTile(const ScanlineState& state, const uint8_t* vram, int i) {
+    int coarseX = state.v & 0x1f, coarseY = (state.v >> 5) & 0x1f,
+        nametable = (state.v >> 10) & 0x3, fineY = (state.v >> 12) & 0x7;
+    int patternBase = (state.ctrl & 0x10) ? 0x1000 : 0;
+
+    int column = coarseX + i;
+    // Scrolling past the right edge moves into the horizontally adjacent nametable
+    int logical = nametable ^ ((column >> 5) & 1);
+    column &= 0x1f;
+    int table = state.nametableLayout[logical] * 0x400;
+
+    int entry = table + coarseY * 32 + column;
+    uint8_t attribute = vram[table + 0x3c0 + (coarseY >> 2) * 8 + (column >> 2)];
+
+    return {
+        static_cast<uint16_t>(entry),
+        static_cast<uint16_t>(patternBase + vram[entry] * 16 + fineY),
+        static_cast<uint8_t>(((attribute >> (((coarseY & 2) << 1) | (column & 2))) & 0x3) << 2)
+    };
+}
+
+/*
+    Fetches the i-th background tile drawn on a line.
+*/
+BackgroundTile fetchBackgroundTile(const ScanlineState& state, const uint8_t* vram, int i) {
+    BackgroundTileSource source = locateBackgroundTile(state, vram, i);
+    int address = source.pattern;
+    return {
+        state.chrPages[address >> 10][address & 0x3ff],
+        state.chrPages[(address + 8) >> 10][(address + 8) & 0x3ff],
+        source.paletteHigh
+    };
+}
+
+/*
+    Returns the pattern table address of the row of a sprite that falls on a line.
+*/
+int spritePatternAddress(const ScanlineState& state, int line, const uint8_t* sprite) {
+    int height = (state.ctrl & 0x20) ? 16 : 8;
+    uint8_t tile = sprite[1];
+    int row = line - sprite[0] - 1;
+    if (sprite[2] & 0x80) {
+        // Flip vertically
+        row = height - 1 - row;
+    }
+
+    if (height == 16) {
+        // Tall sprites pick their pattern table with the low bit of the tile number
+        return ((tile & 1) * 0x1000) + ((tile & 0xfe) + (row >> 3)) * 16 + (row & 7);
+    }
+    return ((state.ctrl & 0x08) ? 0x1000 : 0) + tile * 16 + row;
+}
+
+/*
+    Draws one scanline as palette indices into out.
+    This is shared by the PPU itself and by offline renderers working from recorded frames,
+    so both produce exactly the same pixels.
+    Only the pixels under the background tiles set in the tiles mask are drawn; the rest of out is left alone.
+    See https://www.nesdev.org/wiki/PPU_rendering for details.
+*/
+int renderScanline(int line, const ScanlineState& state,
+    const uint8_t* vram, const uint8_t* palette, uint8_t* out, uint64_t tiles /* = ALL_TILES */) {
+    bool showBackground = state.mask & 0x08, showSprites = state.mask & 0x10;
+    uint8_t grayscale = (state.mask & 0x01) ? 0x30 : 0x3f;
+
+    auto drawn = [&state, tiles](int x) {
+        return (tiles >> ((x + state.fineX) >> 3)) & 1;
+    };
+
+    if (!showBackground && !showSprites) {
+        // With rendering off, the whole line is the backdrop color
+        if (tiles == ALL_TILES) {
+            std::fill(out, out + NES_FRAME_WIDTH, palette[0] & grayscale);
+            return -1;
+        }
+        for (int x = 0; x < NES_FRAME_WIDTH; x++) {
+            if (drawn(x)) {
+                out[x] = palette[0] & grayscale;
+            }
+        }
+        return -1;
+    }
+
+    auto readCHR = [&state](int address) {
+        return state.chrPages[address >> 10][address & 0x3ff];
+    };
+
+    // Low four bits of the palette index for each background pixel, where zero is transparent
+    std::array<uint8_t, NES_FRAME_WIDTH> background {};
+    if (showBackground) {
+        // 33 tiles cover the line when it is finely scrolled
+        for (int i = 0; i < 33; i++) {
+            if (!((tiles >> i) & 1)) {
+                continue;
+            }
+            BackgroundTile tile = fetchBackgroundTile(state, vram, i);
+
+            for (int bit = 0; bit < 8; bit++) {
+                int x = i * 8 + bit - state.fineX;
+                if (x < 0 || x >= NES_FRAME_WIDTH) {
+                    continue;
+                }
+                uint8_t pixel = ((tile.low >> (7 - bit)) & 1) | (((tile.high >> (7 - bit)) & 1) << 1);
+                background[x] = pixel ? tile.paletteHigh | pixel : 0;
+            }
+        }
+
+        if (!(state.mask & 0x02)) {
+            // Background is hidden in the leftmost 8 pixels
+            std::fill(background.begin(), background.begin() + 8, 0);
+        }
+    }
+
+    // Palette index for each sprite pixel (with bit 4 set), and whether it sits behind the background
+    std::array<uint8_t, NES_FRAME_WIDTH> sprites {};
+    std::array<bool, NES_FRAME_WIDTH> behind {};
+    int sprite0Hit = -1;
+    if (showSprites) {
+        int minX = (state.mask & 0x04) ? 0 : 8;
+
+        for (int i = 0; i < state.spriteCount; i++) {
+            const uint8_t* sprite = &state.sprites[i * 4];
+            uint8_t attributes = sprite[2];
+            int address = spritePatternAddress(state, line, sprite);
+            uint8_t low = readCHR(address), high = readCHR(address + 8);
+
+            for (int bit = 0; bit < 8; bit++) {
+                int x = sprite[3] + bit;
+                if (x >= NES_FRAME_WIDTH) {
+                    break;
+                }
+                if (x < minX || !drawn(x)) {
+                    continue;
+                }
+                int shift = (attributes & 0x40) ? bit : 7 - bit; // Flip horizontally
+                uint8_t pixel = ((low >> shift) & 1) | (((high >> shift) & 1) << 1);
+                if (!pixel) {
+                    continue;
+                }
+                if (i == 0 && state.sprite0OnLine && background[x] && x != 255 && sprite0Hit < 0) {
+                    sprite0Hit = x;
+                }
+                // Lower OAM entries take priority over higher ones
+                if (!sprites[x]) {
+                    sprites[x] = 0x10 | ((attributes & 0x3) << 2) | pixel;
+                    behind[x] = attributes & 0x20;
+                }
+            }
+        }
+    }
+
+    for (int x = 0; x < NES_FRAME_WIDTH; x++) {
+        if (!drawn(x)) {
+            continue;
+        }
+        uint8_t index = 0;
+        if (sprites[x] && (!background[x] || !behind[x])) {
+            index = sprites[x];
+        } else if (background[x]) {
+            index = background[x];
+        }
+        out[x] = palette[index] & grayscale;
+    }
+
+    return sprite0Hit;
+}
+
+/*
+    Finds where sprite 0 first overlaps an opaque background pixel on a line, without drawing it.
+    Only the sprite's pattern row and the background tiles underneath it are fetched.
+    Pixels left of fromX are ignored.
+    Returns the same X position as renderScanline() would, or -1 if there is no hit.
+*/
+int findSprite0Hit(int line, const ScanlineState& state, const uint8_t* vram, int fromX) {
+    if ((state.mask & 0x18) != 0x18 || !state.sprite0OnLine) {
+        return -1;
+    }
+
+    const uint8_t* sprite = state.sprites.data();
+    int address = spritePatternAddress(state, line, sprite);
+    uint8_t low = state.chrPages[address >> 10][address & 0x3ff],
+            high = state.chrPages[(address + 8) >> 10][(address + 8) & 0x3ff];
+
+    // Both the sprite and the background can be hidden in the leftmost 8 pixels
+    int minX = fromX;
+    if ((state.mask & 0x06) != 0x06) {
+        minX = std::max(minX, 8);
+    }
+
+    int fetched = -1;
+    BackgroundTile tile {};
+    for (int bit = 0; bit < 8; bit++) {
+        int x = sprite[3] + bit;
+        if (x >= NES_FRAME_WIDTH - 1) {
+            // A hit never happens on the last pixel
+            break;
+        }
+        int shift = (sprite[2] & 0x40) ? bit : 7 - bit; // Flip horizontally
+        if (x < minX || !(((low | high) >> shift) & 1)) {
+            continue;
+        }
+
+        int i = (x + state.fineX) >> 3, backgroundBit = (x + state.fineX) & 7;
+        if (i != fetched) {
+            tile = fetchBackgroundTile(state, vram, i);
+            fetched = i;
+        }
+        if (((tile.low | tile.high) >> (7 - backgroundBit)) & 1) {
+            return x;
+        }
+    }
+    return -1;
+}
+
+/*
+    Hashes a frame of palette indices together with the emphasis bits of each line.
+    Frames can be compared or deduplicated this way without ever converting them to colors.
+    Eight pixels are mixed in at a time, so this costs less than a single color conversion.
+*/
+uint64_t hashFrame(const uint8_t* frame, const uint8_t* emphasis) {
+    const uint64_t prime = 0x100000001b3;
+    uint64_t hash = 0xcbf29ce484222325;
+
+    auto mix = [&hash, prime](const uint8_t* data, size_t size) {
+        for (size_t i = 0; i < size; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            hash = (hash ^ word) * prime;
+            hash ^= hash >> 29;
+        }
+    };
+    mix(frame, NES_FRAME_WIDTH * NES_FRAME_HEIGHT);
+    mix(emphasis, NES_FRAME_HEIGHT);
+    return hash;
+}
+
+ParallelFrameRenderer::ParallelFrameRenderer(int threadCount) {
+    frame = nullptr;
+    framebuffer = nullptr;
+    bands = std::max(threadCount, 1);
+    bandsRemaining = 0;
+    generation = 0;
+    stopping = false;
+
+    for (int band = 0; band < bands; band++) {
+        workers.emplace_back(&ParallelFrameRenderer::work, this, band);
+    }
+}
+
+ParallelFrameRenderer::~ParallelFrameRenderer() {
+    std::unique_lock lck(jobMutex);
+    stopping = true;
+    lck.unlock();
+    jobCV.notify_all();
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+/*
+    Renders a recorded frame into a 256x240 buffer of palette indices.
+    Blocks until every band is finished.
+*/
+void ParallelFrameRenderer::render(const FrameRecording& newFrame, uint8_t* newFramebuffer) {
+    std::unique_lock lck(jobMutex);
+    frame = &newFrame;
+    framebuffer = newFramebuffer;
+    bandsRemaining = bands;
+    generation++;
+    jobCV.notify_all();
+
+    doneCV.wait(lck, [this] { return bandsRemaining == 0; });
+}
+
+/*
+    Worker thread loop. Each worker always draws the same band of lines.
+*/
+void ParallelFrameRenderer::work(int band) {
+    uint64_t lastGeneration = 0;
+
+    while (true) {
+        std::unique_lock lck(jobMutex);
+        jobCV.wait(lck, [this, lastGeneration] { return stopping || generation != lastGeneration; });
+        if (stopping) {
+            return;
+        }
+        lastGeneration = generation;
+        lck.unlock();
+
+        renderBand(band);
+
+        lck.lock();
+        if (--bandsRemaining == 0) {
+            doneCV.notify_one();
+        }
+    }
+}
+
+/*
+    Draws one band of lines from the current frame.
+    Each band replays the frame's memory writes into its own copy of PPU memory
+    up to its first line, so bands do not depend on each other.
+*/
+void ParallelFrameRenderer::renderBand(int band) {
+    int first = band * NES_FRAME_HEIGHT / bands, last = (band + 1) * NES_FRAME_HEIGHT / bands;
+
+    std::array<uint8_t, 0x1000> vram = frame->vram;
+    std::array<uint8_t, 0x20> palette = frame->palette;
+    std::vector<std::array<uint8_t, 0x400>> chrRam;
+    for (const auto& page : frame->chrRam) {
+        chrRam.push_back(page.second);
+    }
+
+    // Finds our copy of a CHR-RAM page, or nullptr for pages that cannot change
+    auto findCHR = [this, &chrRam](const uint8_t* page) -> uint8_t* {
+        for (size_t i = 0; i < chrRam.size(); i++) {
+            if (frame->chrRam[i].first == page) {
+                return chrRam[i].data();
+            }
+        }
+        return nullptr;
+    };
+
+    size_t nextWrite = 0;
+    for (int line = first; line < last; line++) {
+        // Apply every write made before this line was drawn
+        while (nextWrite < frame->writes.size() && frame->writes[nextWrite].line <= line) {
+            const RecordedWrite& write = frame->writes[nextWrite++];
+            switch (write.type) {
+                case RecordedWrite::NAMETABLE:
+                    vram[write.offset] = write.data;
+                    break;
+                case RecordedWrite::PALETTE:
+                    palette[write.offset] = write.data;
+                    break;
+                case RecordedWrite::CHR:
+                    if (uint8_t* page = findCHR(write.page)) {
+                        page[write.offset] = write.data;
+                    }
+                    break;
+            }
+        }
+
+        ScanlineState state = frame->lines[line];
+        for (const uint8_t*& page : state.chrPages) {
+            if (const uint8_t* copy = findCHR(page)) {
+                page = copy;
+            }
+        }
+
+        renderScanline(line, state, vram.data(), palette.data(), framebuffer + line * NES_FRAME_WIDTH);
+    }
+}
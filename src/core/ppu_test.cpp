@@ -0,0 +1,478 @@
+#include "nes.h"
+#include "ppu_test.h"
+#include <algorithm>
+#include <print>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+auto ppuTestNow() {
+    return std::chrono::high_resolution_clock::now();
+}
+
+/*
+    Runs the blargg CPU test ROM while recording every frame, then redraws the
+    recordings in parallel bands and checks that they match the PPU's own output.
+*/
+bool runParallelRenderTest(int threadCount) {
+    std::println("Running parallel render test with {} threads...", threadCount);
+
+    ROM rom;
+    rom.setPath("../test/blargg_cpu_test5_official.nes");
+
+    std::unique_ptr<NES> nes = std::make_unique<NES>();
+    nes->loadROM(rom);
+    nes->cpu->setPC();
+
+    std::vector<FrameRecording> recordings;
+    std::vector<std::vector<uint8_t>> serialFrames;
+    nes->ppu->setFrameRecorder([&](const FrameRecording& recording) {
+        recordings.push_back(recording);
+        const uint8_t* frame = nes->ppu->frame();
+        serialFrames.emplace_back(frame, frame + NES_FRAME_WIDTH * NES_FRAME_HEIGHT);
+    });
+
+    std::thread cpuThread(&CPU::start, nes->cpu.get());
+
+    // Wait until the CPU starts up.
+    while (!nes->cpu->checkRunning()) {
+        std::this_thread::yield();
+    }
+
+    for (int i = 0; i < 3698351; i++) {
+        nes->cpu->cycle();
+    }
+
+    nes->cpu->stop(cpuThread);
+
+    ParallelFrameRenderer renderer(threadCount);
+    std::vector<uint8_t> frame(NES_FRAME_WIDTH * NES_FRAME_HEIGHT);
+    int mismatches = 0, drawnFrames = 0;
+
+    auto start = ppuTestNow();
+    for (size_t i = 0; i < recordings.size(); i++) {
+        renderer.render(recordings[i], frame.data());
+        if (frame != serialFrames[i]) {
+            std::println("Frame {} does not match the serial rendering.", i);
+            mismatches++;
+        }
+        // Count frames showing more than just the backdrop color
+        if (std::any_of(frame.begin(), frame.end(), [&frame](uint8_t x) { return x != frame[0]; })) {
+            drawnFrames++;
+        }
+    }
+    std::chrono::duration<double> diff = ppuTestNow() - start;
+
+    std::println("Rendered {} frames ({} with content) in {} seconds.", recordings.size(), drawnFrames, diff.count());
+    return mismatches == 0 && drawnFrames > 0;
+}
+
+/*
+    A scene for the sprite flag test, with one background tile repeated across the screen.
+    Line and dot give where the flag should be set, or -1 if it never should be.
+    A split line points the background at the empty last nametable from there on, like a raster split.
+*/
+struct SpriteFlagScene {
+    const char* name;
+    uint8_t backgroundTile, spriteTile, spriteX, spriteY, spriteAttributes, scrollX, mask;
+    int extraSprites; // Other sprites on the same lines as sprite 0
+    uint8_t flag;
+    int line, dot;
+    int splitLine = -1;
+};
+
+/*
+    Sets up a scene, then reads $2002 on every dot of one frame to find where the flag appears.
+    With pixels off, the frame must also be left undrawn.
+*/
+bool runSpriteFlagScene(const SpriteFlagScene& scene, bool pipelined, bool pixels) {
+    std::unique_ptr<NES> nes = std::make_unique<NES>();
+    PPU& ppu = *nes->ppu;
+    ppu.setPixelOutput(pixels);
+
+    // Tiles 1 to 4 are solid, the right half, a diagonal line, and the rightmost column
+    std::array<uint8_t, 0x2000> chr {};
+    for (int row = 0; row < 8; row++) {
+        chr[0x10 + row] = 0xff;
+        chr[0x20 + row] = 0x0f;
+        chr[0x30 + row] = static_cast<uint8_t>(0x80 >> row);
+        chr[0x40 + row] = 0x01;
+    }
+    for (int slot = 0; slot < 8; slot++) {
+        ppu.mapCHR(slot, &chr[slot * 0x400], false);
+    }
+
+    // Fill the first nametable and clear its attributes
+    ppu.writeRegister(0x6, 0x20);
+    ppu.writeRegister(0x6, 0x00);
+    for (int i = 0; i < 0x400; i++) {
+        ppu.writeRegister(0x7, i < 0x3c0 ? scene.backgroundTile : 0);
+    }
+
+    // Sprites past the scene's own are hidden below the screen
+    ppu.writeRegister(0x3, 0);
+    for (int i = 0; i < 64; i++) {
+        std::array<uint8_t, 4> sprite {0xff, 0, 0, 0};
+        if (i == 0) {
+            sprite = {scene.spriteY, scene.spriteTile, scene.spriteAttributes, scene.spriteX};
+        } else if (i <= scene.extraSprites) {
+            sprite = {scene.spriteY, 0, 0, static_cast<uint8_t>(i * 8)};
+        }
+        for (uint8_t byte : sprite) {
+            ppu.writeRegister(0x4, byte);
+        }
+    }
+    ppu.writeRegister(0x5, scene.scrollX);
+    ppu.writeRegister(0x5, 0);
+
+    std::thread ppuThread;
+    if (pipelined) {
+        ppu.setPipelined(true);
+        ppuThread = std::thread(&PPU::start, &ppu);
+
+        // Wait until the PPU starts up.
+        while (!ppu.checkRunning()) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Turn rendering on for the next frame as the pre-render line clears the flags
+    while (ppu.timing().scanline != 261) {
+        ppu.cycles(1);
+    }
+    ppu.writeRegister(0x1, scene.mask);
+    ppu.cycles(1);
+
+    int line = -1, dot = -1;
+    while (ppu.timing().scanline != 240) {
+        if (ppu.timing().scanline == scene.splitLine && ppu.timing().cyclesOnLine == 0) {
+            ppu.writeRegister(0x6, 0x2c);
+            ppu.writeRegister(0x6, 0x00);
+        }
+        if (ppu.readRegister(0x2) & scene.flag) {
+            line = ppu.timing().scanline;
+            dot = ppu.timing().cyclesOnLine;
+            break;
+        }
+        ppu.cycles(1);
+    }
+
+    if (pipelined) {
+        ppu.stop(ppuThread);
+    }
+
+    // The flag is visible to reads once the dot that sets it has run
+    int expectedDot = scene.line < 0 ? -1 : scene.dot + 1;
+    if (line != scene.line || dot != expectedDot) {
+        std::println("{} ({}{}): flag first seen at line {} dot {}, expected line {} dot {}.",
+            scene.name, pipelined ? "pipelined" : "direct", pixels ? "" : ", no pixels",
+            line, dot, scene.line, expectedDot);
+        return false;
+    }
+    const uint8_t* frame = ppu.frame();
+    if (!pixels && std::any_of(frame, frame + NES_FRAME_WIDTH * NES_FRAME_HEIGHT, [](uint8_t pixel) { return pixel; })) {
+        std::println("{} ({}, no pixels): the frame was drawn.", scene.name, pipelined ? "pipelined" : "direct");
+        return false;
+    }
+    return true;
+}
+
+/*
+    Reads $2002 around the start of vblank. A read on the dot the flag is set returns it clear
+    and keeps it from being seen that frame, while a read one dot later sees it and clears it.
+*/
+bool runVblankRace(bool pipelined) {
+    std::unique_ptr<NES> nes = std::make_unique<NES>();
+    PPU& ppu = *nes->ppu;
+
+    std::thread ppuThread;
+    if (pipelined) {
+        ppu.setPipelined(true);
+        ppuThread = std::thread(&PPU::start, &ppu);
+
+        // Wait until the PPU starts up.
+        while (!ppu.checkRunning()) {
+            std::this_thread::yield();
+        }
+    }
+
+    auto runTo = [&ppu](int line, int dot) {
+        while (ppu.timing().scanline != line || ppu.timing().cyclesOnLine != dot) {
+            ppu.cycles(1);
+        }
+    };
+
+    runTo(241, 0);
+    uint8_t racing = ppu.readRegister(0x2);
+    runTo(250, 0);
+    uint8_t suppressed = ppu.readRegister(0x2);
+    runTo(241, 1);
+    uint8_t set = ppu.readRegister(0x2), cleared = ppu.readRegister(0x2);
+
+    if (pipelined) {
+        ppu.stop(ppuThread);
+    }
+
+    if ((racing | suppressed | cleared) & 0x80 || !(set & 0x80)) {
+        std::println("Vblank race ({}): read {:02x}, {:02x}, {:02x}, {:02x}.",
+            pipelined ? "pipelined" : "direct", racing, suppressed, set, cleared);
+        return false;
+    }
+    return true;
+}
+
+/*
+    Checks that the sprite 0 hit and overflow flags turn on at the right dot,
+    both when the PPU runs directly and when $2002 is answered from the pipelined PPU's prediction,
+    and whether or not pixels are being drawn. Also checks the race between reading $2002 and vblank starting.
+*/
+bool runSpriteFlagTest() {
+    std::println("Running sprite flag test...");
+
+    const SpriteFlagScene scenes[] = {
+        {"solid",           1, 1, 40,  100, 0x00, 0, 0x1e, 0, 0x40, 101, 41},
+        {"behind",          1, 1, 40,  100, 0x20, 0, 0x1e, 0, 0x40, 101, 41},
+        {"half tile",       2, 1, 40,  100, 0x00, 0, 0x1e, 0, 0x40, 101, 45},
+        {"fine scroll",     2, 1, 40,  100, 0x00, 2, 0x1e, 0, 0x40, 101, 43},
+        {"diagonal",        1, 3, 100, 50,  0x00, 0, 0x1e, 0, 0x40, 51,  101},
+        {"flipped",         1, 3, 100, 50,  0x40, 0, 0x1e, 0, 0x40, 51,  108},
+        {"left clipped",    1, 1, 4,   100, 0x00, 0, 0x18, 0, 0x40, 101, 9},
+        {"left shown",      1, 1, 4,   100, 0x00, 0, 0x1e, 0, 0x40, 101, 5},
+        {"last pixel",      1, 4, 248, 100, 0x00, 0, 0x1e, 0, 0x40, -1,  -1},
+        {"no background",   0, 1, 40,  100, 0x00, 0, 0x1e, 0, 0x40, -1,  -1},
+        {"sprites hidden",  1, 1, 40,  100, 0x00, 0, 0x0e, 0, 0x40, -1,  -1},
+        {"nine sprites",    0, 0, 0,   60,  0x00, 0, 0x1e, 8, 0x20, 61,  256},
+        {"eight sprites",   0, 0, 0,   60,  0x00, 0, 0x1e, 7, 0x20, -1,  -1},
+        {"split before",    1, 1, 40,  100, 0x00, 0, 0x1e, 0, 0x40, -1,  -1, 50},
+        {"split after",     1, 1, 40,  100, 0x00, 0, 0x1e, 0, 0x40, 101, 41, 120},
+    };
+
+    int failures = 0;
+    for (const SpriteFlagScene& scene : scenes) {
+        for (bool pipelined : {false, true}) {
+            for (bool pixels : {true, false}) {
+                if (!runSpriteFlagScene(scene, pipelined, pixels)) {
+                    failures++;
+                }
+            }
+        }
+    }
+
+    std::println("{} of {} scenes failed.", failures, std::size(scenes) * 4);
+    bool race = runVblankRace(false) && runVblankRace(true);
+    return failures == 0 && race;
+}
+
+/*
+    Runs LDA #page, STA $4014 from RAM and checks the stall and what lands in OAM.
+    Returns the number of CPU cycles the DMA took, or -1 if OAM is wrong.
+*/
+int runOamDma(NES& nes, uint8_t page, uint8_t oamAddress) {
+    const uint8_t program[] = {0xa9, page, 0x8d, 0x14, 0x40};
+    for (int i = 0; i < 5; i++) {
+        nes.memory->write(static_cast<addr_t>(0x0700 + i), program[i]);
+    }
+    nes.ppu->writeRegister(0x3, oamAddress);
+
+    std::array<uint8_t, 0x100> expected;
+    for (int i = 0; i < 0x100; i++) {
+        expected[i] = nes.memory->read(static_cast<addr_t>((page << 8) | i));
+    }
+
+    nes.cpu->setPC(static_cast<addr_t>(0x0700));
+    uint64_t start = nes.ppu->timing().ticks;
+    nes.cpu->runOpcode(nes.cpu->read());
+    nes.cpu->runOpcode(nes.cpu->read());
+    int cycles = static_cast<int>(nes.ppu->timing().ticks - start) / 3 - 6; // Less LDA and STA
+
+    for (int i = 0; i < 0x100; i++) {
+        nes.ppu->writeRegister(0x3, static_cast<uint8_t>(oamAddress + i));
+        if (nes.ppu->readRegister(0x4) != expected[i]) {
+            std::println("OAM byte {} from page {:02x} does not match.", i, page);
+            return -1;
+        }
+    }
+    return cycles;
+}
+
+/*
+    Checks OAM DMA from plain RAM and from a register page, along with its cycle parity.
+*/
+bool runOamDmaTest() {
+    std::println("Running OAM DMA test...");
+
+    ROM rom;
+    rom.setPath("../test/nestest.nes");
+
+    std::unique_ptr<NES> nes = std::make_unique<NES>();
+    nes->loadROM(rom);
+
+    for (int i = 0; i < 0x100; i++) {
+        nes->memory->write(static_cast<addr_t>(0x0200 + i), static_cast<uint8_t>(i ^ 0x5a));
+        nes->memory->writeDirect(static_cast<addr_t>(0x4000 + i), static_cast<uint8_t>(i * 3));
+    }
+
+    // The CPU starts at cycle 0, so the first DMA begins on an even cycle and the others on odd ones
+    int first = runOamDma(*nes, 0x02, 0x00);
+    int second = runOamDma(*nes, 0x02, 0x80);
+    int registers = runOamDma(*nes, 0x40, 0x10);
+
+    std::println("DMA took {}, {}, and {} cycles.", first, second, registers);
+    return first == 513 && second == 514 && registers == 514;
+}
+
+/*
+    Drives one PPU with incremental redraw and one without through the same random changes,
+    then checks that every frame comes out the same. Most frames change only a few tiles,
+    but some also move sprites, scroll, switch masks, or split the screen mid-frame.
+    The incremental PPU also skips drawing some frames, which must not throw off the ones after.
+*/
+bool runIncrementalRedrawTest() {
+    std::println("Running incremental redraw test...");
+
+    std::array<std::unique_ptr<NES>, 2> consoles {std::make_unique<NES>(), std::make_unique<NES>()};
+    std::array<std::array<uint8_t, 0x2000>, 2> chr {};
+    consoles[1]->ppu->setIncrementalRedraw(false);
+
+    std::mt19937 random(1234);
+    auto randomByte = [&random]() {
+        return static_cast<uint8_t>(random() & 0xff);
+    };
+
+    // Start from random CHR-RAM, nametables, palettes, and sprites
+    std::array<uint8_t, 0x2000> initialCHR;
+    std::generate(initialCHR.begin(), initialCHR.end(), randomByte);
+    std::vector<std::pair<addr_t, uint8_t>> writes;
+    for (int address = 0x2000; address < 0x3f20; address++) {
+        if (address < 0x3000 || address >= 0x3f00) {
+            writes.emplace_back(address, randomByte());
+        }
+    }
+
+    auto writeMemory = [&consoles](addr_t address, uint8_t data) {
+        for (auto& nes : consoles) {
+            nes->ppu->writeRegister(0x6, static_cast<uint8_t>(address >> 8));
+            nes->ppu->writeRegister(0x6, static_cast<uint8_t>(address & 0xff));
+            nes->ppu->writeRegister(0x7, data);
+        }
+    };
+    auto writeRegister = [&consoles](addr_t address, uint8_t data) {
+        for (auto& nes : consoles) {
+            nes->ppu->writeRegister(address, data);
+        }
+    };
+    auto runUntil = [&consoles](int scanline) {
+        while (consoles[0]->ppu->timing().scanline != scanline) {
+            for (auto& nes : consoles) {
+                nes->ppu->cycles(1);
+            }
+        }
+    };
+
+    for (int i = 0; i < 2; i++) {
+        chr[i] = initialCHR;
+        for (int slot = 0; slot < 8; slot++) {
+            consoles[i]->ppu->mapCHR(slot, &chr[i][slot * 0x400], true);
+        }
+    }
+    for (auto [address, data] : writes) {
+        writeMemory(address, data);
+    }
+    writeRegister(0x3, 0);
+    for (int i = 0; i < 0x100; i++) {
+        writeRegister(0x4, randomByte());
+    }
+
+    uint8_t scrollX = 0, scrollY = 0, mask = 0x1e;
+    int mismatches = 0;
+    for (int frame = 0; frame < 120; frame++) {
+        runUntil(241);
+
+        // A few tile, attribute, pattern, and palette changes each frame
+        for (int i = 0; i < 4; i++) {
+            writeMemory(static_cast<addr_t>(0x2000 + (random() & 0xfff)), randomByte());
+        }
+        if (frame % 3 == 0) {
+            writeMemory(static_cast<addr_t>(random() & 0x1fff), randomByte());
+        }
+        if (frame % 10 == 0) {
+            writeMemory(static_cast<addr_t>(0x3f00 + (random() & 0x1f)), randomByte());
+        }
+
+        // Move one sprite every other frame
+        if (frame % 2 == 0) {
+            writeRegister(0x3, static_cast<uint8_t>((random() & 0x3f) * 4));
+            for (int i = 0; i < 4; i++) {
+                writeRegister(0x4, randomByte());
+            }
+        }
+
+        if (frame % 15 == 0) {
+            scrollX = randomByte();
+            scrollY = static_cast<uint8_t>(random() % 240);
+        }
+        if (frame % 25 == 0) {
+            static const uint8_t masks[] = {0x1e, 0x18, 0x0a, 0x14, 0x1f, 0x00};
+            mask = masks[random() % std::size(masks)];
+        }
+        writeRegister(0x0, static_cast<uint8_t>(random() & 0x38));
+        writeRegister(0x1, mask);
+        writeRegister(0x5, scrollX);
+        writeRegister(0x5, scrollY);
+        bool skipped = frame % 11 == 5 || frame % 11 == 6;
+        consoles[0]->ppu->setPixelOutput(!skipped);
+
+        runUntil(0);
+        if (frame % 7 == 0) {
+            // Split the screen partway down
+            runUntil(static_cast<int>(random() % 240));
+            writeRegister(0x5, randomByte());
+            writeMemory(static_cast<addr_t>(0x2000 + (random() & 0xfff)), randomByte());
+        }
+
+        runUntil(240);
+        if (skipped) {
+            continue;
+        }
+        const uint8_t* incremental = consoles[0]->ppu->frame();
+        const uint8_t* full = consoles[1]->ppu->frame();
+        if (!std::equal(incremental, incremental + NES_FRAME_WIDTH * NES_FRAME_HEIGHT, full)) {
+            std::println("Frame {} does not match the full redraw.", frame);
+            mismatches++;
+        }
+    }
+
+    // Time a still screen both ways to show what is saved
+    writeRegister(0x1, 0x1e);
+    std::array<double, 3> seconds;
+    for (int i = 0; i < 3; i++) {
+        // The last run skips drawing altogether
+        PPU& ppu = *consoles[i % 2]->ppu;
+        ppu.setPixelOutput(i < 2);
+        auto start = ppuTestNow();
+        for (int cycle = 0; cycle < 341 * 262 * 60; cycle++) {
+            ppu.cycles(1);
+        }
+        seconds[i] = std::chrono::duration<double>(ppuTestNow() - start).count();
+    }
+    std::println("60 still frames took {} seconds incrementally, {} seconds in full, and {} seconds without pixels.",
+        seconds[0], seconds[1], seconds[2]);
+
+    std::println("{} of 120 frames did not match.", mismatches);
+    return mismatches == 0;
+}
+
+bool runPpuTest(std::string testName) {
+    if (testName == "parallel_render") {
+        return runParallelRenderTest(8);
+    } else if (testName == "sprite_flags") {
+        return runSpriteFlagTest();
+    } else if (testName == "oam_dma") {
+        return runOamDmaTest();
+    } else if (testName == "incremental_redraw") {
+        return runIncrementalRedrawTest();
+    }
+    std::println(stderr, "Unknown PPU test {}.", testName);
+    return false;
+}
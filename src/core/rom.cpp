@@ -1,35 +1,206 @@
 #include "rom.h"
 #include "core_memory.h"
 #include "memory_factory.h"
+#include "rom_database.h"
 #include <fstream>
 #include <print>
+#include <algorithm>
 #include <array>
+#include <filesystem>
+#include <stdexcept>
+
+ROMImage::ROMImage(std::unique_ptr<const MappedFile> newFile) {
+    file = std::move(newFile);
+    crc = crc32(contents());
+}
+
+/*
+    Opens a ROM file, mapping it into memory if it is a regular file.
+    Returns nullptr if the file cannot be read.
+*/
+std::shared_ptr<const ROMImage> ROMImage::open(const std::string& path) {
+    std::unique_ptr<const MappedFile> file = MappedFile::open(path);
+    if (!file) {
+        std::println(stderr, "Could not open ROM file {}.", path);
+        return nullptr;
+    }
+    return std::shared_ptr<const ROMImage>(new ROMImage(std::move(file)));
+}
+
+/*
+    Wraps bytes that are already in memory, such as a ROM taken out of an archive.
+*/
+std::shared_ptr<const ROMImage> ROMImage::fromBuffer(std::vector<uint8_t> buffer) {
+    return std::shared_ptr<const ROMImage>(new ROMImage(MappedFile::fromBuffer(std::move(buffer))));
+}
+
+std::span<const uint8_t> ROMImage::bytes() const {
+    return file->bytes();
+}
+
+/*
+    Returns everything after the iNES header and trainer, which is the PRG-ROM and CHR-ROM.
+    A file without an iNES header is all contents.
+*/
+std::span<const uint8_t> ROMImage::contents() const {
+    std::span<const uint8_t> all = bytes();
+    if (all.size() < 16 || !std::equal(all.begin(), all.begin() + 4, "NES\x1A")) {
+        return all;
+    }
+    size_t start = (all[6] & 0b00000100) ? 528 : 16;
+    return all.subspan(std::min(start, all.size()));
+}
+
+/*
+    Returns true if the bytes are mapped straight from the file rather than copied into a buffer.
+*/
+bool ROMImage::isMapped() const {
+    return file->isMapped();
+}
+
+/*
+    Returns the CRC32 of the contents, which leaves out the header so that the ROM database
+    can be searched with it whatever the header says.
+*/
+uint32_t ROMImage::checksum() const {
+    return crc;
+}
+
+/*
+    Computes the standard CRC32 (as used by zip and most ROM databases) of some bytes.
+*/
+uint32_t crc32(std::span<const uint8_t> bytes) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> entries;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? (value >> 1) ^ 0xedb88320 : value >> 1;
+            }
+            entries[i] = value;
+        }
+        return entries;
+    }();
+
+    uint32_t crc = 0xffffffff;
+    for (uint8_t byte : bytes) {
+        crc = table[(crc ^ byte) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+std::mutex ROMCache::mutex;
+std::unordered_multimap<uint32_t, std::weak_ptr<const ROMImage>> ROMCache::images;
+
+/*
+    Returns the cached image with the same contents as the given one, or adds the given one
+    to the cache if there is none. Consoles loading the same game then share one copy of its banks.
+*/
+std::shared_ptr<const ROMImage> ROMCache::share(std::shared_ptr<const ROMImage> image) {
+    if (!image) {
+        return image;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [first, last] = images.equal_range(image->checksum());
+    for (auto entry = first; entry != last;) {
+        std::shared_ptr<const ROMImage> cached = entry->second.lock();
+        if (!cached) {
+            entry = images.erase(entry); // Every console using it is gone
+            continue;
+        }
+        // Different files can share a CRC, so compare the contents too
+        if (std::ranges::equal(cached->bytes(), image->bytes())) {
+            return cached;
+        }
+        ++entry;
+    }
+    images.emplace(image->checksum(), image);
+    return image;
+}
+
+/*
+    Returns the number of images that are still in use.
+*/
+size_t ROMCache::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::ranges::count_if(images, [](const auto& entry) { return !entry.second.expired(); });
+}
 
 ROM::ROM() {
     persistentMemory = trainer = fourScreenVRAM = nes2 =
-        playchoice10 = VS_unisystem = false;
+        playchoice10 = VS_unisystem = serialPPU = knownROM = false;
     mapper = PRG_ROM_size = CHR_ROM_size = PRG_RAM_size =
         flags6 = flags7 = flags9 = flags10 = 0;
 }
 
 void ROM::setPath(std::string newPath) {
     path = newPath;
+    image = nullptr;
+}
+
+/*
+    Returns where battery-backed PRG-RAM is saved: the ROM's path with a .sav extension,
+    or an empty string if the ROM did not come from a file.
+*/
+std::string ROM::savePath() const {
+    if (path.empty()) {
+        return "";
+    }
+    return std::filesystem::path(path).replace_extension(".sav").string();
+}
+
+/*
+    Uses ROM bytes that are already loaded instead of reading them from the path.
+*/
+void ROM::setImage(std::shared_ptr<const ROMImage> newImage) {
+    image = ROMCache::share(newImage);
+}
+
+/*
+    Looks ROMs up in a database when their headers are parsed, and trusts it over the header.
+*/
+void ROM::setDatabase(std::shared_ptr<const ROMDatabase> newDatabase) {
+    database = newDatabase;
+}
+
+/*
+    Replaces what the header says with the database's entry for the ROM's contents, if there is one.
+*/
+void ROM::applyDatabase() {
+    std::optional<ROMDatabase::Entry> entry = database->find(image->checksum());
+    knownROM = entry.has_value();
+    if (!entry) {
+        return;
+    }
+
+    PRG_ROM_size = entry->PRG_ROM_size;
+    CHR_ROM_size = entry->CHR_ROM_size;
+    mapper = entry->mapper;
+    mirroring = entry->mirroring == VERTICAL ? "vertical" : "horizontal";
+    fourScreenVRAM = entry->mirroring == FOUR_SCREEN;
+    PRG_RAM_size = entry->PRG_RAM_size;
+    persistentMemory = (entry->flags & ROMDatabase::BATTERY) > 0;
+    serialPPU = (entry->flags & ROMDatabase::SERIAL_PPU) > 0;
+    std::println("Found in the ROM database: {} PRGROM, {} PRGRAM, {} CHRROM, {} Mapper",
+        PRG_ROM_size, PRG_RAM_size, CHR_ROM_size, mapper);
 }
 
 void ROM::parseHeader() {
-    // Open the file and go straight to the end
-    std::ifstream romFile(path, std::ios::ate | std::ios::binary);
-    std::streamoff romSize = romFile.tellg(); // Find file length
-    std::println("The file size is {} bytes.", romSize);
-    
-    std::array<uint8_t, 16> header;
-    romFile.seekg(0); // Reset to start of file
-    for (int x = 0; x < 16; x++) {
-        romFile >> std::hex >> header[x];
+    if (!image) {
+        image = ROMCache::share(ROMImage::open(path));
+        if (!image) {
+            throw std::runtime_error("Could not read ROM file " + path + ".");
+        }
     }
+    std::span<const uint8_t> bytes = image->bytes();
+    std::println("The file size is {} bytes.", bytes.size());
+
+    std::array<uint8_t, 16> header {};
+    std::copy_n(bytes.begin(), std::min<size_t>(bytes.size(), header.size()), header.begin());
 
     // Check that the first 4 characters are "NES\n"
-    if (!std::equal(header.begin(), header.begin() + 4, "NES\x1A")) {
+    bool validHeader = std::equal(header.begin(), header.begin() + 4, "NES\x1A");
+    if (!validHeader) {
         std::println(stderr, "The NES file header is invalid.");
     } else {
         /*
@@ -63,41 +234,52 @@ void ROM::parseHeader() {
         nes2                = (flags7 & 0b00001100) == 0b1000; // NES 2.0 not fully supported
         playchoice10        = (flags7 & 0b00000010) > 0;
         VS_unisystem        = (flags7 & 0b00000001) > 0;
+    }
+
+    // PRG-ROM follows the header and the trainer, if there is one, and CHR-ROM directly follows PRG-ROM
+    size_t PRG_ROM_start = trainer ? 528 : 16;
+    knownROM = false;
+    if (database && bytes.size() > PRG_ROM_start) {
+        applyDatabase();
+    }
+    if (validHeader && !knownROM) {
+        // A database entry replaces the header, so it is only shown when there is none
         std::println("{} PRGROM\n{} PRGRAM\n{} CHRROM\n{} Mapper", PRG_ROM_size, PRG_RAM_size, CHR_ROM_size, mapper);
     }
+    size_t PRG_ROM_size_bytes = PRG_ROM_size * 0x4000, CHR_ROM_size_bytes = CHR_ROM_size * 0x2000;
+    if (bytes.size() < PRG_ROM_start + PRG_ROM_size_bytes + CHR_ROM_size_bytes) {
+        throw std::runtime_error("The ROM file is shorter than its header says.");
+    }
+    prg = bytes.subspan(PRG_ROM_start, PRG_ROM_size_bytes);
+    chr = bytes.subspan(PRG_ROM_start + PRG_ROM_size_bytes, CHR_ROM_size_bytes);
+}
+
+/*
+    Returns the PRG-ROM banks inside the ROM image. Valid once the header has been parsed.
+*/
+std::span<const uint8_t> ROM::PRG_ROM() const {
+    return prg;
+}
 
-    romFile.close();
+/*
+    Returns the CHR-ROM banks inside the ROM image, which are empty if the board uses CHR-RAM.
+*/
+std::span<const uint8_t> ROM::CHR_ROM() const {
+    return chr;
 }
 
 /*
-    Loads PRG-ROM from a file into memory and returns the object created.
+    Creates the memory for the ROM's mapper and points it at PRG-ROM and CHR-ROM in place.
+    The memory object keeps the ROM image alive.
 */
 std::unique_ptr<CoreMemory> ROM::loadIntoMemory() {
     this->parseHeader();
 
     std::unique_ptr<CoreMemory> memory = MemoryFactory::create(mapper);
 
-    memory->set_PRG_ROM_size(PRG_ROM_size);
-
-    std::ifstream romFile;
-    romFile.open(path, std::ios::binary);
-    romFile >> std::noskipws;
-
-    romFile.seekg(16); // Skip to the end of the header
-
-    if (trainer) {
-        romFile.seekg(528); // If there is a trainer section, skip it
-    }
-
-    // Load PRG-ROM into memory
-    int PRG_ROM_size_bytes = PRG_ROM_size * 0x4000;
-    uint8_t byte;
-    for (int i = 0; i < PRG_ROM_size_bytes; i++) {
-        romFile >> byte;
-        memory->writeDirect(0x8000 + i, byte);
-    }
-
-    romFile.close();
+    memory->setMirroring(fourScreenVRAM ? FOUR_SCREEN : mirroring == "vertical" ? VERTICAL : HORIZONTAL);
+    // A PRG-RAM size of 0 means 8 KB, for compatibility with older headers
+    memory->attachROM(image, prg, chr, (PRG_RAM_size ? PRG_RAM_size : 1) * 0x2000);
 
     return memory;
 }
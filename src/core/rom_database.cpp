@@ -0,0 +1,112 @@
+#include "rom_database.h"
+#include "rom.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <print>
+
+namespace {
+    const uint8_t VERSION = 1;
+    const char MAGIC[] = "NESDB\x1A";
+
+    uint32_t readLittleEndian(const uint8_t* bytes) {
+        return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+    }
+
+    void writeLittleEndian(uint8_t* bytes, uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            bytes[i] = static_cast<uint8_t>(value >> (i * 8));
+        }
+    }
+}
+
+/*
+    Maps a database file into memory. Returns nullptr if there is no such file or it is not a database.
+*/
+std::shared_ptr<const ROMDatabase> ROMDatabase::open(const std::string& path) {
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(path, error)) {
+        return nullptr;
+    }
+    std::shared_ptr<ROMDatabase> database(new ROMDatabase());
+    database->image = ROMImage::open(path);
+    if (!database->image) {
+        return nullptr;
+    }
+
+    std::span<const uint8_t> bytes = database->image->bytes();
+    if (bytes.size() < HEADER_SIZE || !std::equal(MAGIC, MAGIC + 6, bytes.begin()) || bytes[6] != VERSION) {
+        std::println(stderr, "{} is not a ROM database.", path);
+        return nullptr;
+    }
+    database->count = readLittleEndian(&bytes[8]);
+    if (bytes.size() < HEADER_SIZE + database->count * ENTRY_SIZE) {
+        std::println(stderr, "The ROM database {} is shorter than its header says.", path);
+        return nullptr;
+    }
+    return database;
+}
+
+/*
+    Writes a database file with the given entries, sorting them first.
+    Returns false if the file cannot be written.
+*/
+bool ROMDatabase::write(const std::string& path, std::vector<Entry> entries) {
+    std::ranges::sort(entries, {}, &Entry::crc);
+
+    std::vector<uint8_t> bytes(HEADER_SIZE + entries.size() * ENTRY_SIZE);
+    std::copy_n(MAGIC, 6, bytes.begin());
+    bytes[6] = VERSION;
+    writeLittleEndian(&bytes[8], static_cast<uint32_t>(entries.size()));
+    for (size_t i = 0; i < entries.size(); i++) {
+        const Entry& entry = entries[i];
+        uint8_t* record = &bytes[HEADER_SIZE + i * ENTRY_SIZE];
+        writeLittleEndian(record, entry.crc);
+        record[4] = entry.PRG_ROM_size;
+        record[5] = entry.CHR_ROM_size;
+        record[6] = entry.mapper;
+        record[7] = static_cast<uint8_t>(entry.mirroring);
+        record[8] = entry.PRG_RAM_size;
+        record[9] = entry.flags;
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    return static_cast<bool>(file);
+}
+
+/*
+    Returns the entry for a CRC32 of PRG-ROM and CHR-ROM, or nothing if the ROM is not known.
+*/
+std::optional<ROMDatabase::Entry> ROMDatabase::find(uint32_t crc) const {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (readLittleEndian(&image->bytes()[HEADER_SIZE + middle * ENTRY_SIZE]) < crc) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < count && entry(low).crc == crc) {
+        return entry(low);
+    }
+    return std::nullopt;
+}
+
+size_t ROMDatabase::size() const {
+    return count;
+}
+
+ROMDatabase::Entry ROMDatabase::entry(size_t index) const {
+    const uint8_t* record = &image->bytes()[HEADER_SIZE + index * ENTRY_SIZE];
+    Entry result;
+    result.crc = readLittleEndian(record);
+    result.PRG_ROM_size = record[4];
+    result.CHR_ROM_size = record[5];
+    result.mapper = record[6];
+    result.mirroring = static_cast<mirroringMode>(std::min<uint8_t>(record[7], FOUR_SCREEN));
+    result.PRG_RAM_size = record[8];
+    result.flags = record[9];
+    return result;
+}
@@ -1,4 +1,9 @@
 #include "cpu.h"
+#include "mapper000.h"
+#include "mapper001.h"
+#include "mapper004.h"
+#include "discrete_mapper.h"
+#include <array>
 #include <bit>
 #include <stdexcept>
 #include <print>
@@ -6,8 +11,11 @@
 
 CPU::CPU() : logger(*this) {
     running = false;
+    trace = NO_TRACE;
     memory = nullptr;
     ppu = nullptr;
+    nextFrameDot = 0;
+    specialize<CoreMemory>();
     reset();
 }
 
@@ -41,33 +49,17 @@ void CPU::setPC(addr_t newPc) {
 }
 
 /*
-    Reads the next byte at the program counter.
+    Reads the next byte at the program counter, without side effects.
 */
 uint8_t CPU::peek() {
-    return memory->read(pc);
+    return memory->peek(pc);
 }
 
 /*
-    Reads the next word at the program counter.
+    Reads the next word at the program counter, without side effects.
 */
 uint16_t CPU::peekWord() {
-    return memory->readWord(pc);
-}
-
-/*
-    Reads the next byte at the program counter and increments the PC.
-*/
-uint8_t CPU::read() {
-    return memory->read(pc++);
-}
-
-/*
-    Reads the next word at the program counter and increments the PC twice.
-*/
-uint16_t CPU::readWord() {
-    uint16_t word = memory->readWord(pc);
-    pc += 2;
-    return word;
+    return memory->peekWord(pc);
 }
 
 /*
@@ -75,39 +67,40 @@ uint16_t CPU::readWord() {
     Assumes the program counter is at the start of the arguments list.
     Moves the program counter to the end of the arguments list.
 */
+template <class Memory>
 addr_t CPU::getAddress(addressingMode mode) {
     switch (mode) {
         case IMM:
             return pc++;
         case ZPG:
-            return read();
+            return read<Memory>();
         case ZPX:
-            cache = read();
+            cache = read<Memory>();
             return (cache + x) % 0x100;
         case ZPY:
-            cache = read();
+            cache = read<Memory>();
             return (cache + y) % 0x100;
         case IZX:
-            precache = read();
+            precache = read<Memory>();
             cache = (precache + x) % 0x100;
-            return (memory->read((cache + 1) % 0x100) << 8) | memory->read(cache);
+            return (memory->read<Memory>((cache + 1) % 0x100) << 8) | memory->read<Memory>(cache);
         case IZY:
-            precache = read();
-            cache = (memory->read((precache + 1) % 0x100) << 8) | memory->read(precache);
+            precache = read<Memory>();
+            cache = (memory->read<Memory>((precache + 1) % 0x100) << 8) | memory->read<Memory>(precache);
             return cache + y;
         case ABS:
-            return readWord();
+            return readWord<Memory>();
         case ABX:
-            cache = readWord();
+            cache = readWord<Memory>();
             return cache + x;
         case ABY:
-            cache = readWord();
+            cache = readWord<Memory>();
             return cache + y;
         case IND:
-            cache = readWord();
-            return memory->readWord(cache, true);
+            cache = readWord<Memory>();
+            return memory->readWord<Memory>(cache, true);
         case REL:
-            return std::bit_cast<int8_t>(read()) + pc;
+            return std::bit_cast<int8_t>(read<Memory>()) + pc;
         default:
             throw std::runtime_error("Unsupported opcode in getAddress.");
     }
@@ -118,14 +111,6 @@ void CPU::setNZ(uint8_t val) {
     p.z = val == 0;
 }
 
-void CPU::stackPush(uint8_t val) {
-    memory->write(0x100 + (sp--), val);
-}
-
-uint8_t CPU::stackPop() {
-    return memory->read(0x100 + (++sp));
-}
-
 uint8_t CPU::processorStatus() {
     return std::bit_cast<uint8_t>(p);
 }
@@ -139,6 +124,11 @@ void CPU::setProcessorStatus(uint8_t status) {
     ignoreCycles - true if the PPU should ignore the CPU cycles being run
 */
 void CPU::runOpcode(uint8_t opcode, bool ignoreCycles /* = false */) {
+    (this->*executeOpcode[trace])(opcode, ignoreCycles);
+}
+
+template <class Memory, CPU::traceLevel Trace>
+void CPU::execute(uint8_t opcode, bool ignoreCycles) {
     // std::thread ppuThread(&PPU::cycles, ppu, 3);
 
     // This slows things down a lot:
@@ -147,20 +137,22 @@ void CPU::runOpcode(uint8_t opcode, bool ignoreCycles /* = false */) {
     addressingMode mode = getAddressingMode(opcode);
     instruction inst = getInstruction(opcode);
 
-    if (logger.logging) {
-        // Write PC and opcode to log
-        logger.logOpcode(opcode, mode, inst);
+    if constexpr (Trace != NO_TRACE) {
+        logger.recordOpcode(opcode, mode);
     }
     
     addr_t addr = 0;
     if (mode != NUL) {
-        addr = getAddress(mode);
+        addr = getAddress<Memory>(mode);
     }
 
     int cycleOffset = getCycleCountOffset(inst, addr, extraCycleCounts[opcode]);
     int cycleCount = getCycleCount(opcode, cycleOffset);
 
-    std::string ppuString = logger.logPPUstring(ppu->scanline, ppu->cyclesOnLine);
+    if constexpr (Trace != NO_TRACE) {
+        // The log shows where the PPU was before the instruction ran
+        logger.recordPPU(ppu->timing().scanline, ppu->timing().cyclesOnLine);
+    }
 
     if (!ignoreCycles) {
         // PPU does 3 cycles for every CPU cycle
@@ -171,23 +163,30 @@ void CPU::runOpcode(uint8_t opcode, bool ignoreCycles /* = false */) {
     if (mode != NUL) {
         // Read up to two bytes at the given address
         // TODO: Optimize by only reading argument if specific instruction requires it
-        argument = memory->read(addr);
+        argument = memory->read<Memory>(addr);
     }
     else {
         // If an opcode normally takes arguments, then the no-arg instruction uses the accumulator
         argument = a;
     }
 
-    if (logger.logging) {
-        // Write stylized opcode arguments to log and trailing spaces
-        logger.logArgsAndRegisters(mode, inst, addr, argument);
+    if constexpr (Trace != NO_TRACE) {
+        logger.recordArgsAndRegisters(mode, inst, addr, argument);
     }
 
-    runInstruction(mode, inst, addr, argument);
+    runInstruction<Memory>(mode, inst, addr, argument);
 
-    logger.logStr(ppuString);
-
-    logger.logCycles(cyclesExecuted);
+    if constexpr (Trace == BINARY_TRACE) {
+        logger.writeRecord(cyclesExecuted);
+    } else if constexpr (Trace != NO_TRACE) {
+        logger.logRecord();
+        if constexpr (Trace == BUS_TRACE) {
+            if (mode != NUL) {
+                logger.logBusAccess(inst, addr, argument);
+            }
+        }
+        logger.logCycles(cyclesExecuted);
+    }
 
     if (!ignoreCycles) {
         // TODO: Get actual cycle count
@@ -195,6 +194,72 @@ void CPU::runOpcode(uint8_t opcode, bool ignoreCycles /* = false */) {
 
         waitForCycles(cycleCount);
     }
+
+    int dmaPage = memory->takeOAMDMARequest();
+    if (dmaPage >= 0) {
+        oamDMA<Memory>(static_cast<uint8_t>(dmaPage), ignoreCycles);
+    }
+
+    // The cartridge's IRQ line is polled between instructions
+    uint64_t irqDot = memory->irqDot();
+    if (irqDot != CoreMemory::NO_IRQ && !p.i && irqDot <= ppu->timing().cyclesExecuted) {
+        interrupt<Memory>(0xfffe, ignoreCycles);
+    }
+
+    if constexpr (MemoryHeatmap::ENABLED) {
+        memory->accessHeatmap()->startFrame(ppu->timing().statusFrame());
+    }
+}
+
+/*
+    Pushes the return address and status, then jumps through an interrupt vector.
+    Unlike BRK, the B flag is clear in the copy on the stack. This takes 7 cycles.
+*/
+template <class Memory>
+void CPU::interrupt(addr_t vector, bool ignoreCycles) {
+    stackPush<Memory>((pc & 0xff00) >> 8);
+    stackPush<Memory>(pc & 0xff);
+    stackPush<Memory>((processorStatus() & ~0x10) | 0x20);
+    p.i = 1;
+    pc = memory->readWord<Memory>(vector);
+
+    if (!ignoreCycles) {
+        ppu->cycles(7 * 3);
+        cyclesExecuted += 7;
+        waitForCycle();
+    }
+}
+
+/*
+    Copies a page of CPU memory into OAM after a write to $4014.
+    The CPU is stalled for 513 cycles, plus one more if the transfer starts on an odd cycle.
+*/
+template <class Memory>
+void CPU::oamDMA(uint8_t page, bool ignoreCycles) {
+    if (const uint8_t* source = memory->directPage(page)) {
+        if constexpr (MemoryHeatmap::ENABLED) {
+            for (int i = 0; i < 0x100; i++) {
+                memory->accessHeatmap()->count(MemoryHeatmap::READ, static_cast<uint16_t>((page << 8) | i));
+            }
+        }
+        ppu->writeOAM(source);
+    } else {
+        // Reading registers can have side effects, so go through them one byte at a time
+        std::array<uint8_t, 0x100> data;
+        for (int i = 0; i < 0x100; i++) {
+            data[i] = memory->read<Memory>(static_cast<addr_t>((page << 8) | i));
+        }
+        ppu->writeOAM(data.data());
+    }
+
+    if (!ignoreCycles) {
+        int stall = 513 + (cyclesExecuted & 1);
+        ppu->cycles(stall * 3);
+        cyclesExecuted += stall;
+
+        // The whole stall is on the timeline now, so a single wait covers it
+        waitForCycle();
+    }
 }
 
 /*
@@ -253,8 +318,37 @@ void CPU::start() {
     running = true;
     lck.unlock();
 
+    (this->*runLoop[trace])();
+}
+
+template <class Memory, CPU::traceLevel Trace>
+void CPU::run() {
     while (running && notDone) {
-        runOpcode(read());
+        execute<Memory, Trace>(read<Memory>(), false);
+        if (ppu->timing().cyclesExecuted >= nextFrameDot) {
+            startFrame();
+        }
+    }
+}
+
+/*
+    Sets a function for the CPU thread to call once per frame, between instructions
+    at the start of the pre-render line. Work that must not race the emulation, such as
+    handing off battery-backed RAM, goes here.
+*/
+void CPU::setFrameHandler(std::function<void()> handler) {
+    frameHandler = std::move(handler);
+}
+
+/*
+    Runs the frame handler and works out the dot at which the next frame starts,
+    counted the same way as PPUClock::statusFrame().
+*/
+void CPU::startFrame() {
+    const uint64_t DOTS_PER_FRAME = 341 * 262;
+    nextFrameDot = (static_cast<uint64_t>(ppu->timing().statusFrame()) + 1) * DOTS_PER_FRAME - 340;
+    if (frameHandler) {
+        frameHandler();
     }
 }
 
@@ -306,3 +400,26 @@ void CPU::cycle() {
     cyclesRequested++;
     cycleStatusCV.notify_all();
 }
+
+/*
+    Compiles the instruction path for each mapper at every trace level.
+*/
+#define INSTANTIATE_CPU(Memory) \
+    template void CPU::execute<Memory, CPU::NO_TRACE>(uint8_t, bool); \
+    template void CPU::execute<Memory, CPU::INSTRUCTION_TRACE>(uint8_t, bool); \
+    template void CPU::execute<Memory, CPU::BUS_TRACE>(uint8_t, bool); \
+    template void CPU::execute<Memory, CPU::BINARY_TRACE>(uint8_t, bool); \
+    template void CPU::run<Memory, CPU::NO_TRACE>(); \
+    template void CPU::run<Memory, CPU::INSTRUCTION_TRACE>(); \
+    template void CPU::run<Memory, CPU::BUS_TRACE>(); \
+    template void CPU::run<Memory, CPU::BINARY_TRACE>();
+
+INSTANTIATE_CPU(CoreMemory)
+INSTANTIATE_CPU(Mapper000)
+INSTANTIATE_CPU(Mapper001)
+INSTANTIATE_CPU(Mapper004)
+INSTANTIATE_CPU(Mapper002)
+INSTANTIATE_CPU(Mapper003)
+INSTANTIATE_CPU(Mapper007)
+INSTANTIATE_CPU(Mapper011)
+INSTANTIATE_CPU(Mapper066)
@@ -1,6 +1,16 @@
 #include "nes.h"
+#include "mapper001.h"
+#include "cheats.h"
+#include "discrete_mapper.h"
+#include "rom_database.h"
+#include "trace.h"
 #include <print>
 #include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <thread>
 
 struct TestCases {
     static const int NINTENDULATOR_OFFSET = 14; // This is how many cycles get added to the CPU in Nintendulator
@@ -17,6 +27,45 @@ auto awake_time() {
     return now() + 50us;
 }
 
+/*
+    Builds an iNES image from the header bytes after "NES\x1A", with as much PRG-ROM and CHR-ROM as they declare.
+    If bankSize is given, every byte of each PRG-ROM bank of that size holds the bank number.
+*/
+std::vector<uint8_t> makeTestROM(std::initializer_list<uint8_t> header, size_t bankSize = 0) {
+    std::vector<uint8_t> bytes(16);
+    std::copy_n("NES\x1A", 4, bytes.begin());
+    std::ranges::copy(header, bytes.begin() + 4);
+    size_t PRGSize = bytes[4] * 0x4000;
+    bytes.resize(16 + PRGSize + bytes[5] * 0x2000);
+    for (size_t bank = 0; bankSize && bank < PRGSize / bankSize; bank++) {
+        std::fill_n(bytes.begin() + 16 + bank * bankSize, bankSize, static_cast<uint8_t>(bank));
+    }
+    return bytes;
+}
+
+/*
+    Loads an image into a new console. The ROM is the caller's, so it can be set up first or checked afterwards.
+*/
+std::unique_ptr<NES> makeTestNES(ROM& rom, std::vector<uint8_t> image) {
+    rom.setImage(ROMImage::fromBuffer(std::move(image)));
+    std::unique_ptr<NES> nes = std::make_unique<NES>();
+    nes->loadROM(rom);
+    return nes;
+}
+
+std::unique_ptr<NES> makeTestNES(std::initializer_list<uint8_t> header, size_t bankSize = 0) {
+    ROM rom;
+    return makeTestNES(rom, makeTestROM(header, bankSize));
+}
+
+void reportChecks(std::string_view name, int failures) {
+    if (failures) {
+        std::println("{} {} checks failed.", failures, name);
+    } else {
+        std::println("All {} checks passed.", name);
+    }
+}
+
 void runNesTest(int testCases) {
     std::println("Running nestest...");
     if (!testCases) {
@@ -29,8 +78,8 @@ void runNesTest(int testCases) {
     std::unique_ptr<NES> nes = std::make_unique<NES>();
     nes->loadROM(rom);
     
-    for (int i = 0; i < 0x20; i++) { // Set APU registers to 0xff
-        nes->memory->write(static_cast<addr_t>(0x4000 | i), 0xff);
+    for (int i = 0; i < 0x20; i++) { // Set APU registers to 0xff, without starting an OAM DMA through $4014
+        nes->memory->writeDirect(static_cast<addr_t>(0x4000 | i), 0xff);
     }
 
     #ifdef DEBUG
@@ -43,7 +92,7 @@ void runNesTest(int testCases) {
 
     nes->cpu->setPC((addr_t)0xc000); // Override initial program counter
 
-    nes->cpu->logger.start("../test/nestestLog.txt");
+    nes->cpu->logger.start("../test/nestestTrace.bin", false, CPU::BINARY_TRACE);
 
     std::thread cpuThread(&CPU::start, nes->cpu.get());
     
@@ -72,7 +121,11 @@ void runNesTest(int testCases) {
     nes->cpu->logger.stop();
 }
 
-void runBlarggCpuTest5Official() {
+/*
+    Runs blargg's CPU test 5 and logs the result.
+    With pipelinedPPU set, the PPU runs on its own thread, and the log must match the normal run exactly.
+*/
+void runBlarggCpuTest5Official(bool pipelinedPPU) {
     std::println("Running blargg CPU test 5 (official opcodes only)...");
 
     ROM rom;
@@ -91,12 +144,23 @@ void runBlarggCpuTest5Official() {
         The reference logs to compare against were generated via Nintendulator's
         CPU logging feature.
     */
-    nes->cpu->logger.start("../test/blargg5Log.txt", true);
+    nes->cpu->logger.start(pipelinedPPU ? "../test/blargg5PipelinedTrace.bin" : "../test/blargg5Trace.bin", true, CPU::BINARY_TRACE);
 
     #ifdef DEBUG
     auto start = now();
     #endif
 
+    std::thread ppuThread;
+    if (pipelinedPPU) {
+        nes->ppu->setPipelined(true);
+        ppuThread = std::thread(&PPU::start, nes->ppu.get());
+
+        // Wait until the PPU starts up.
+        while (!nes->ppu->checkRunning()) {
+            std::this_thread::yield();
+        }
+    }
+
     std::thread cpuThread(&CPU::start, nes->cpu.get());
     
     // Wait until the CPU starts up.
@@ -109,6 +173,7 @@ void runBlarggCpuTest5Official() {
     }
 
     nes->cpu->stop(cpuThread);
+    nes->ppu->stop(ppuThread);
 
     nes->cpu->logger.stop();
 
@@ -127,6 +192,757 @@ void runBlarggCpuTest5Official() {
     std::println("");
 }
 
+/*
+    Loads the same ROM into many consoles and checks that they all point at one shared copy of it,
+    which is released once the last console is gone.
+*/
+void runSharedRomTest() {
+    const int consoles = 64;
+    std::vector<std::unique_ptr<NES>> nesList;
+    for (int i = 0; i < consoles; i++) {
+        ROM rom;
+        rom.setPath("../test/blargg_cpu_test5_official.nes");
+        nesList.push_back(std::make_unique<NES>());
+        nesList.back()->loadROM(rom);
+    }
+
+    size_t images = ROMCache::size();
+    bool samePages = true;
+    for (std::unique_ptr<NES>& nes : nesList) {
+        samePages &= nes->memory->directPage(0xc0) == nesList[0]->memory->directPage(0xc0);
+    }
+    nesList.clear();
+
+    std::println("{} consoles shared {} ROM image{}, with a {}-byte mapper object each.",
+        consoles, images, images == 1 ? "" : "s", sizeof(Mapper001));
+    if (!samePages || ROMCache::size()) {
+        std::println("The ROM image was not shared or not released.");
+    }
+}
+
+/*
+    Loads a value into one of the MMC1 registers through its serial port, one bit per write.
+*/
+void writeMMC1(CoreMemory& memory, addr_t address, uint8_t value) {
+    for (int bit = 0; bit < 5; bit++) {
+        memory.write(address, static_cast<uint8_t>((value >> bit) & 1));
+    }
+}
+
+/*
+    Builds an MMC1 ROM where every byte of each 16 KB PRG-ROM bank holds the bank number,
+    then checks which banks each PRG mode maps, and that PRG-RAM can be disabled.
+*/
+void runMMC1BankTest() {
+    std::unique_ptr<NES> nes = makeTestNES({0x08, 0x01, 0x10}, 0x4000);
+    CoreMemory& memory = *nes->memory;
+
+    struct Case { uint8_t control, prg, low, high; };
+    const Case cases[] = {
+        {0x0c, 0x05, 5, 7}, // Switchable 16 KB bank at $8000, last bank fixed
+        {0x08, 0x05, 0, 5}, // First bank fixed, switchable 16 KB bank at $C000
+        {0x00, 0x05, 4, 5}, // 32 KB bank, ignoring the low bit
+        {0x04, 0x0a, 2, 3}, // Bank numbers wrap around the size of the ROM
+    };
+    int failures = 0;
+    for (const Case& test : cases) {
+        writeMMC1(memory, 0x8000, test.control);
+        writeMMC1(memory, 0xe000, test.prg);
+        if (memory.read(0x8000) != test.low || memory.read(0xbfff) != test.low
+            || memory.read(0xc000) != test.high || memory.read(0xffff) != test.high) {
+            std::println("Mode {:02x} bank {:02x} mapped {} and {}, expected {} and {}.", test.control, test.prg,
+                memory.read(0x8000), memory.read(0xc000), test.low, test.high);
+            failures++;
+        }
+    }
+
+    // Setting bit 7 resets the PRG mode to fixing the last bank
+    memory.write(0x8000, 0x80);
+    if (memory.read(0xc000) != 7) {
+        std::println("Resetting the shift register did not fix the last bank.");
+        failures++;
+    }
+
+    memory.write(0x6000, 0x42);
+    writeMMC1(memory, 0xe000, 0x10);
+    bool disabled = memory.read(0x6000) == 0;
+    memory.write(0x6001, 0x42);
+    writeMMC1(memory, 0xe000, 0x00);
+    if (!disabled || memory.read(0x6000) != 0x42 || memory.read(0x6001) != 0) {
+        std::println("PRG-RAM was not disabled by bit 4 of the PRG register.");
+        failures++;
+    }
+
+    reportChecks("MMC1 banking", failures);
+}
+
+/*
+    Builds an MMC3 ROM where every byte of each 8 KB PRG-ROM bank holds the bank number,
+    then checks the PRG banking modes and the timing of the scanline IRQ, including the CPU taking it
+    and a snapshot bringing it back.
+*/
+void runMMC3Test() {
+    std::vector<uint8_t> bytes = makeTestROM({0x04, 0x01, 0x40}, 0x2000);
+    // The IRQ handler is at $E000
+    bytes[16 + 8 * 0x2000 - 2] = 0x00;
+    bytes[16 + 8 * 0x2000 - 1] = 0xe0;
+
+    ROM rom;
+    std::unique_ptr<NES> nes = makeTestNES(rom, std::move(bytes));
+    CoreMemory& memory = *nes->memory;
+    int failures = 0;
+
+    memory.write(0x8000, 0x06);
+    memory.write(0x8001, 0x03);
+    memory.write(0x8000, 0x07);
+    memory.write(0x8001, 0x04);
+    if (memory.read(0x8000) != 3 || memory.read(0xa000) != 4 || memory.read(0xc000) != 6 || memory.read(0xe000) != 7) {
+        std::println("PRG mode 0 mapped {} {} {} {}.", memory.read(0x8000), memory.read(0xa000), memory.read(0xc000), memory.read(0xe000));
+        failures++;
+    }
+    memory.write(0x8000, 0x46);
+    if (memory.read(0x8000) != 6 || memory.read(0xc000) != 3) {
+        std::println("PRG mode 1 mapped {} at $8000 and {} at $C000.", memory.read(0x8000), memory.read(0xc000));
+        failures++;
+    }
+
+    // With sprites at $1000, the counter is clocked at dot 260 of each line, so it reloads on line 0
+    // and reaches zero on line 10
+    memory.write(0x2000, 0x08);
+    memory.write(0x2001, 0x18);
+    memory.write(0xc000, 10);
+    memory.write(0xc001, 0);
+    memory.write(0xe001, 0);
+    uint64_t expected = 10 * 341 + 261;
+    if (memory.irqDot() != expected) {
+        std::println("The first IRQ is at dot {}, expected {}.", memory.irqDot(), expected);
+        failures++;
+    }
+
+    nes->cpu->runOpcode(0x58, true); // CLI
+    nes->ppu->cycles(static_cast<int>(expected) - 1);
+    nes->cpu->runOpcode(0xea, true); // NOP
+    bool early = nes->cpu->peek() == 7;
+    nes->ppu->cycles(1);
+    nes->cpu->runOpcode(0xea, true);
+    if (early || nes->cpu->peek() != 7 || (memory.read(0x01fb) & 0x30) != 0x20) {
+        std::println("The CPU did not take the IRQ on time.");
+        failures++;
+    }
+
+    // Acknowledging clears the IRQ, and the counter carries on from zero
+    memory.write(0xe000, 0);
+    memory.write(0xe001, 0);
+    expected = 21 * 341 + 261;
+    if (memory.irqDot() != expected) {
+        std::println("The second IRQ is at dot {}, expected {}.", memory.irqDot(), expected);
+        failures++;
+    }
+
+    // With the background at $1000, edges come at dot 324 of the line before, so the
+    // pre-render line is counted as well
+    memory.write(0x2000, 0x10);
+    memory.write(0xc000, 230);
+    memory.write(0xc001, 0);
+    expected = 341 * 262 + 0 * 341 + 325;
+    if (memory.irqDot() != expected) {
+        std::println("The IRQ after the pre-render line is at dot {}, expected {}.", memory.irqDot(), expected);
+        failures++;
+    }
+
+    // The IRQ is kept with the registers, so restoring brings back one that was acknowledged since
+    MemorySnapshot snapshot;
+    nes->saveSnapshot(snapshot);
+    memory.write(0xe000, 0);
+    nes->restoreSnapshot(snapshot);
+    if (memory.irqDot() != expected) {
+        std::println("After restoring, the IRQ is at dot {}, expected {}.", memory.irqDot(), expected);
+        failures++;
+    }
+
+    // Restoring only reads the registers to map the banks, so there is nothing new to save afterwards
+    nes->saveSnapshot(snapshot);
+    if (snapshot.pagesCopied != 0) {
+        std::println("Saving right after restoring copied {} pages.", snapshot.pagesCopied);
+        failures++;
+    }
+
+    reportChecks("MMC3", failures);
+}
+
+/*
+    Builds a ROM for each discrete-logic mapper where every byte of each 16 KB PRG-ROM bank holds
+    the bank number, then checks which banks a write to the latch maps.
+*/
+void runDiscreteMapperTest() {
+    struct Case { uint8_t flags6, flags7, latch, low, high; };
+    const Case cases[] = {
+        {0x20, 0x00, 0x03, 3, 7}, // UxROM: switchable 16 KB bank at $8000, last bank fixed
+        {0x30, 0x00, 0x03, 0, 1}, // CNROM: the latch only selects CHR
+        {0x70, 0x00, 0x12, 4, 5}, // AxROM: 32 KB bank from the low bits, nametable from bit 4
+        {0xb0, 0x00, 0xf1, 2, 3}, // Color Dreams: 32 KB bank from the low bits, CHR from the high bits
+        {0x20, 0x40, 0x31, 6, 7}, // GxROM: 32 KB bank from bits 4-5, CHR from the low bits
+    };
+    int failures = 0;
+    for (const Case& test : cases) {
+        ROM rom;
+        std::unique_ptr<NES> nes = makeTestNES(rom, makeTestROM({0x08, 0x04, test.flags6, test.flags7}, 0x4000));
+        CoreMemory& memory = *nes->memory;
+
+        memory.write(0x8000, test.latch);
+        if (memory.read(0x8000) != test.low || memory.read(0xbfff) != test.low
+            || memory.read(0xc000) != test.high || memory.read(0xffff) != test.high) {
+            std::println("Mapper {} with latch {:02x} mapped {} and {}, expected {} and {}.", rom.mapper, test.latch,
+                memory.read(0x8000), memory.read(0xc000), test.low, test.high);
+            failures++;
+        }
+    }
+
+    reportChecks("discrete mapper", failures);
+}
+
+/*
+    Checks that saving a snapshot again copies only the pages written since,
+    and that restoring it brings back RAM, PRG-RAM, and VRAM, also while the PPU is pipelined.
+*/
+void runMemorySnapshotTest() {
+    std::unique_ptr<NES> nes = makeTestNES({0x01, 0x00});
+    CoreMemory& memory = *nes->memory;
+    int failures = 0;
+
+    auto writeVRAM = [&memory] (uint8_t data) {
+        memory.write(0x2006, 0x20);
+        memory.write(0x2006, 0x00);
+        memory.write(0x2007, data);
+    };
+
+    MemorySnapshot snapshot;
+    nes->saveSnapshot(snapshot);
+    size_t allPages = snapshot.pagesCopied;
+
+    memory.write(0x0010, 1);
+    memory.write(0x6000, 2);
+    writeVRAM(3);
+    nes->saveSnapshot(snapshot);
+    if (snapshot.pagesCopied != 3) {
+        std::println("Saving after three writes copied {} of {} pages.", snapshot.pagesCopied, allPages);
+        failures++;
+    }
+    nes->saveSnapshot(snapshot);
+    if (snapshot.pagesCopied != 0) {
+        std::println("Saving again without writes copied {} pages.", snapshot.pagesCopied);
+        failures++;
+    }
+
+    memory.write(0x0810, 4); // Mirror of $0010
+    memory.write(0x6000, 5);
+    writeVRAM(6);
+    nes->restoreSnapshot(snapshot);
+    memory.write(0x2006, 0x20);
+    memory.write(0x2006, 0x00);
+    memory.read(0x2007); // Reads of VRAM are buffered
+    if (memory.read(0x0010) != 1 || memory.read(0x6000) != 2 || memory.read(0x2007) != 3) {
+        std::println("Restoring the snapshot did not bring back the written values.");
+        failures++;
+    }
+
+    // A new snapshot does not know what was written before, so it gets everything
+    MemorySnapshot other;
+    nes->saveSnapshot(other);
+    if (other.pagesCopied != allPages || other.cartridge != snapshot.cartridge || other.video != snapshot.video) {
+        std::println("A new snapshot copied {} of {} pages.", other.pagesCopied, allPages);
+        failures++;
+    }
+
+    // While pipelined, writes to CHR-RAM wait in the log for the PPU thread,
+    // so saving must not miss them and restoring must not let them land afterwards
+    auto writeCHR = [&memory] (uint8_t first) {
+        memory.write(0x2006, 0x00);
+        memory.write(0x2006, 0x00);
+        for (int i = 0; i < 0x800; i++) {
+            memory.write(0x2007, static_cast<uint8_t>(first + i));
+        }
+    };
+    std::vector<uint8_t> written(0x800);
+    std::ranges::generate(written, [n = 0x40] () mutable { return static_cast<uint8_t>(n++); });
+
+    nes->ppu->setPipelined(true);
+    std::thread ppuThread(&PPU::start, nes->ppu.get());
+    while (!nes->ppu->checkRunning()) {
+        std::this_thread::yield();
+    }
+    writeCHR(0x40);
+    nes->saveSnapshot(snapshot);
+    bool saved = !std::ranges::search(snapshot.cartridge, written).empty();
+    writeCHR(0x80);
+    nes->restoreSnapshot(snapshot);
+    nes->ppu->stop(ppuThread);
+    nes->ppu->setPipelined(false);
+
+    memory.write(0x2006, 0x00);
+    memory.write(0x2006, 0x00);
+    memory.read(0x2007);
+    std::vector<uint8_t> restored(0x800);
+    std::ranges::generate(restored, [&memory] () { return memory.read(0x2007); });
+    if (!saved || restored != written) {
+        std::println("While pipelined, the snapshot {} the CHR-RAM writes.", saved ? "did not restore" : "missed");
+        failures++;
+    }
+
+    reportChecks("memory snapshot", failures);
+}
+
+/*
+    Checks that peeking at $2002 and $2007 leaves vblank, the read buffer, and the VRAM address alone.
+*/
+void runPeekTest() {
+    std::unique_ptr<NES> nes = makeTestNES({0x01, 0x00});
+    CoreMemory& memory = *nes->memory;
+    int failures = 0;
+
+    nes->ppu->cycles(341 * 241 + 5);
+    bool peeked = (memory.peek(0x2002) & 0x80) && (memory.peek(0x2002) & 0x80);
+    bool read = memory.read(0x2002) & 0x80;
+    if (!peeked || !read || (memory.peek(0x2002) & 0x80)) {
+        std::println("Peeking at $2002 changed the vblank flag.");
+        failures++;
+    }
+
+    memory.write(0x2006, 0x20);
+    memory.write(0x2006, 0x00);
+    memory.write(0x2007, 0x33);
+    memory.write(0x2007, 0x44);
+    memory.write(0x2006, 0x20);
+    memory.write(0x2006, 0x00);
+    memory.read(0x2007); // Loads $2000 into the read buffer
+    if (memory.peek(0x2007) != 0x33 || memory.peek(0x2007) != 0x33
+        || memory.read(0x2007) != 0x33 || memory.read(0x2007) != 0x44) {
+        std::println("Peeking at $2007 changed the read buffer or the VRAM address.");
+        failures++;
+    }
+
+    reportChecks("peek", failures);
+}
+
+/*
+    Checks that battery-backed PRG-RAM is written to a .sav file by the background writer,
+    both when handed off directly and while the console runs, follows snapshots being restored,
+    and comes back when the game is loaded again.
+*/
+void runBatterySaveTest() {
+    const std::string romPath = "battery_test.nes", savePath = "battery_test.sav";
+    std::remove(savePath.c_str());
+    {
+        std::vector<uint8_t> bytes = makeTestROM({0x01, 0x00, 0x02}); // Battery-backed PRG-RAM
+        std::ofstream romFile(romPath, std::ios::binary);
+        romFile.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    }
+    int failures = 0;
+
+    auto readSaveFile = [&savePath]() {
+        std::ifstream saveFile(savePath, std::ios::binary);
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(saveFile), {});
+    };
+
+    // The writer is in the background, so give it a moment to get the first byte of PRG-RAM there
+    auto waitForSave = [&readSaveFile] (uint8_t value) {
+        std::vector<uint8_t> saved;
+        for (int attempt = 0; attempt < 200 && (saved.size() != 0x2000 || saved[0] != value); attempt++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            saved = readSaveFile();
+        }
+        return saved.size() == 0x2000 && saved[0] == value;
+    };
+
+    // Pages marked as written reach the file after an interval, without anything waiting for the disk
+    {
+        MemoryArena arena;
+        arena.reserve(0x2000);
+        arena.allocate();
+        std::span<uint8_t> ram(arena.data(), 0x2000);
+        BatteryBackup battery(savePath, ram, arena, std::chrono::milliseconds(0));
+        ram[0x1234] = 0x56;
+        arena.markDirty(&ram[0x1234]);
+        ram[0x0100] = 0x78; // Not marked, so it is not staged
+        std::vector<uint8_t> saved;
+        for (int attempt = 0; attempt < 200 && (saved.size() != ram.size() || saved[0x1234] != 0x56); attempt++) {
+            battery.update();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            saved = readSaveFile();
+        }
+        ram[0x0100] = 0;
+        if (!std::ranges::equal(saved, ram)) {
+            std::println("The background writer did not save just the written page.");
+            failures++;
+        }
+    }
+    std::remove(savePath.c_str());
+
+    // Running the console hands written PRG-RAM to the writer at the start of a frame, once the interval is up
+    {
+        ROM rom;
+        rom.setPath(romPath);
+        std::unique_ptr<NES> nes = std::make_unique<NES>();
+        nes->loadROM(rom);
+        nes->memory->write(0x6000, 0x42);
+        std::this_thread::sleep_for(BatteryBackup::DEFAULT_INTERVAL);
+
+        std::thread cpuThread(&CPU::start, nes->cpu.get());
+        while (!nes->cpu->checkRunning()) {
+            std::this_thread::yield();
+        }
+        for (int i = 0; i < 2 * 29781; i++) {
+            nes->cpu->cycle(); // Two frames
+        }
+        nes->cpu->stop(cpuThread);
+
+        if (!waitForSave(0x42)) {
+            std::println("Running the console did not hand written PRG-RAM to the background writer.");
+            failures++;
+        }
+    }
+    std::remove(savePath.c_str());
+
+    // Restoring a snapshot changes PRG-RAM under the writer, so the restored bytes are saved too
+    {
+        ROM rom;
+        rom.setPath(romPath);
+        std::unique_ptr<NES> nes = std::make_unique<NES>();
+        nes->loadROM(rom);
+        nes->memory->write(0x6000, 0x11);
+        MemorySnapshot snapshot;
+        nes->saveSnapshot(snapshot);
+        nes->memory->write(0x6000, 0x22);
+        std::this_thread::sleep_for(BatteryBackup::DEFAULT_INTERVAL);
+        nes->saveBattery();
+        bool written = waitForSave(0x22);
+
+        nes->restoreSnapshot(snapshot);
+        std::this_thread::sleep_for(BatteryBackup::DEFAULT_INTERVAL);
+        nes->saveBattery();
+        if (!written || !waitForSave(0x11)) {
+            std::println("The save file did not follow PRG-RAM {} a snapshot was restored.", written ? "after" : "before");
+            failures++;
+        }
+    }
+    std::remove(savePath.c_str());
+
+    // Closing the game saves everything, and loading it again brings it back
+    {
+        ROM rom;
+        rom.setPath(romPath);
+        std::unique_ptr<NES> nes = std::make_unique<NES>();
+        nes->loadROM(rom);
+        nes->memory->write(0x6000, 0x42);
+        nes->memory->write(0x7fff, 0x24);
+    }
+    {
+        ROM rom;
+        rom.setPath(romPath);
+        std::unique_ptr<NES> nes = std::make_unique<NES>();
+        nes->loadROM(rom);
+        if (nes->memory->read(0x6000) != 0x42 || nes->memory->read(0x7fff) != 0x24) {
+            std::println("Saved PRG-RAM did not come back when the game was loaded again.");
+            failures++;
+        }
+    }
+    std::remove(savePath.c_str());
+    std::remove(romPath.c_str());
+
+    reportChecks("battery save", failures);
+}
+
+/*
+    Builds a UxROM ROM where every byte of each 16 KB PRG-ROM bank holds the bank number,
+    then checks that cheats patch reads, that compare values follow bank switches,
+    and that pages without cheats keep their direct read pointers.
+*/
+void runCheatTest() {
+    std::unique_ptr<NES> nes = makeTestNES({0x04, 0x00, 0x20}, 0x4000);
+    CoreMemory& memory = *nes->memory;
+    int failures = 0;
+
+    // SXIOPO is the well-known infinite lives code for Super Mario Bros., which patches $91D9 with $AD
+    std::optional<Cheat> six = decodeGameGenie("sxiopo"), eight = decodeGameGenie("AAAAAAAA");
+    if (!six || six->address != 0x91d9 || six->value != 0xad || six->compare != -1
+        || !eight || eight->address != 0x8000 || eight->value != 0 || eight->compare != 0
+        || decodeGameGenie("PAAAA") || decodeGameGenie("PAAAAB") || parseCheat("80000=01") || parseCheat("8000?1=0G")) {
+        std::println("Cheat codes were not decoded as expected.");
+        failures++;
+    }
+
+    if (!nes->addCheat("8000?00=77") || !nes->addCheat("0010=05") || !nes->addCheat("PAAAAZ") /* $8200=01 */ || nes->addCheat("2002=80")) {
+        std::println("Cheats were not added as expected.");
+        failures++;
+    }
+    memory.write(0x0010, 0x09);
+    memory.write(0x0011, 0x09);
+    if (memory.read(0x8000) != 0x77 || memory.read(0x8001) != 0 || memory.read(0x8200) != 1
+        || memory.read(0x0010) != 5 || memory.read(0x0011) != 9 || memory.peek(0x8000) != 0x77) {
+        std::println("Cheats did not patch reads.");
+        failures++;
+    }
+    if (memory.directPage(0x80) || !memory.directPage(0x81) || !memory.directPage(0xc0)) {
+        std::println("Pages without cheats lost their direct read pointers.");
+        failures++;
+    }
+
+    // The compare value no longer matches once another bank is switched in
+    memory.write(0x8000, 1);
+    if (memory.read(0x8000) != 1 || memory.read(0x8200) != 1) {
+        std::println("After switching banks, $8000 read {}.", memory.read(0x8000));
+        failures++;
+    }
+    memory.write(0x8000, 0);
+    nes->memory->clearCheats();
+    if (memory.read(0x8000) != 0 || memory.read(0x0010) != 9 || !memory.directPage(0x80)) {
+        std::println("Clearing cheats did not restore the pages.");
+        failures++;
+    }
+
+    reportChecks("cheat", failures);
+}
+
+/*
+    Writes a ROM database, then checks its lookups and that it corrects a ROM with a wrong header.
+*/
+void runROMDatabaseTest() {
+    const std::string databasePath = "rom_database_test.nesdb";
+    int failures = 0;
+
+    // A 32 KB UxROM game with battery-backed PRG-RAM, whose header claims to be a 16 KB NROM game
+    std::vector<uint8_t> bytes = makeTestROM({0x01, 0x00});
+    bytes.resize(16 + 0x8000);
+    for (size_t i = 16; i < bytes.size(); i++) {
+        bytes[i] = static_cast<uint8_t>(i * 7);
+    }
+    uint32_t crc = crc32(std::span<const uint8_t>(bytes).subspan(16));
+
+    std::vector<ROMDatabase::Entry> entries;
+    std::mt19937 random(1234);
+    for (int i = 0; i < 1000; i++) {
+        entries.push_back({static_cast<uint32_t>(random()), 1, 1, 0, HORIZONTAL, 0, 0});
+    }
+    entries.push_back({crc, 2, 0, 2, VERTICAL, 1, ROMDatabase::BATTERY | ROMDatabase::SERIAL_PPU});
+    ROMDatabase::write(databasePath, entries);
+
+    std::shared_ptr<const ROMDatabase> database = ROMDatabase::open(databasePath);
+    if (!database || database->size() != entries.size()) {
+        std::println("The ROM database could not be opened.");
+        std::remove(databasePath.c_str());
+        return;
+    }
+    for (const ROMDatabase::Entry& entry : entries) {
+        std::optional<ROMDatabase::Entry> found = database->find(entry.crc);
+        if (!found || found->crc != entry.crc) {
+            std::println("CRC {:08x} was not found.", entry.crc);
+            failures++;
+            break;
+        }
+    }
+    uint32_t missing = crc + 1;
+    while (std::ranges::any_of(entries, [missing](const ROMDatabase::Entry& entry) { return entry.crc == missing; })) {
+        missing++;
+    }
+    if (database->find(missing)) {
+        std::println("A missing CRC was found.");
+        failures++;
+    }
+
+    ROM rom;
+    rom.setDatabase(database);
+    std::unique_ptr<NES> nes = makeTestNES(rom, std::move(bytes));
+    if (!rom.knownROM || rom.mapper != 2 || rom.mirroring != "vertical" || !rom.persistentMemory || !rom.serialPPU
+        || rom.PRG_ROM().size() != 0x8000 || !dynamic_cast<Mapper002*>(nes->memory.get())) {
+        std::println("The ROM database did not correct the header.");
+        failures++;
+    }
+
+    // The entry asks for a serial PPU, which keeps pipelining off where other games get it
+    std::unique_ptr<NES> other = makeTestNES({0x02, 0x00});
+    nes->ppu->setPipelined(true);
+    other->ppu->setPipelined(true);
+    if (nes->ppu->checkPipelined()) {
+        std::println("Pipelining was turned on for a game that needs a serial PPU.");
+        failures++;
+    }
+    if (!other->ppu->checkPipelined()) {
+        std::println("Pipelining could not be turned on for a game without a database entry.");
+        failures++;
+    }
+    other->ppu->setPipelined(false);
+    std::remove(databasePath.c_str());
+
+    reportChecks("ROM database", failures);
+}
+
+/*
+    Runs a small loop and checks the heatmap's counts and exports.
+    Only registered when the MEMORY_HEATMAP build option is on, since there is nothing to count otherwise.
+*/
+void runMemoryHeatmapTest() {
+    if constexpr (!MemoryHeatmap::ENABLED) {
+        std::println("Memory access counting was not built in.");
+        return;
+    }
+
+    // LDA $0200, STA $0300, JMP $8000. STA and JMP also read their targets, and loading the ROM reads the reset vector
+    std::vector<uint8_t> bytes = makeTestROM({0x01, 0x00});
+    const uint8_t program[] = {0xad, 0x00, 0x02, 0x8d, 0x00, 0x03, 0x4c, 0x00, 0x80};
+    std::copy(std::begin(program), std::end(program), bytes.begin() + 16);
+    ROM rom;
+    std::unique_ptr<NES> nes = makeTestNES(rom, std::move(bytes));
+    MemoryHeatmap& heatmap = *nes->memory->accessHeatmap();
+    int failures = 0;
+
+    nes->cpu->setPC(static_cast<addr_t>(0x8000));
+    for (int i = 0; i < 30; i++) {
+        nes->cpu->runOpcode(nes->cpu->read(), true);
+    }
+    if (heatmap.total(MemoryHeatmap::FETCH, 0x8000) != 10 || heatmap.total(MemoryHeatmap::FETCH, 0x8002) != 10
+        || heatmap.total(MemoryHeatmap::READ, 0x0200) != 10 || heatmap.total(MemoryHeatmap::WRITE, 0x0300) != 10
+        || heatmap.total(MemoryHeatmap::FETCH, 0x8009) || heatmap.total(MemoryHeatmap::WRITE, 0x8000)) {
+        std::println("The loop was counted as {} fetches, {} reads, and {} writes.", heatmap.total(MemoryHeatmap::FETCH, 0x8000),
+            heatmap.total(MemoryHeatmap::READ, 0x0200), heatmap.total(MemoryHeatmap::WRITE, 0x0300));
+        failures++;
+    }
+
+    // Whatever is counted in the instruction that runs into the next frame still belongs to the last one
+    nes->ppu->cycles(341 * 262);
+    nes->cpu->runOpcode(nes->cpu->read(), true);
+    if (heatmap.lastFrame(MemoryHeatmap::FETCH, 0x8000) != 11 || heatmap.total(MemoryHeatmap::FETCH, 0x8000) != 11) {
+        std::println("The last frame had {} fetches.", heatmap.lastFrame(MemoryHeatmap::FETCH, 0x8000));
+        failures++;
+    }
+
+    const std::string csvPath = "memory_heatmap_test.csv", binaryPath = "memory_heatmap_test.bin";
+    heatmap.exportCSV(csvPath, true, true);
+    heatmap.exportBinary(binaryPath, true, false);
+    std::ifstream csv(csvPath);
+    std::vector<std::string> rows;
+    for (std::string row; std::getline(csv, row);) {
+        rows.push_back(row);
+    }
+    std::ifstream binary(binaryPath, std::ios::binary | std::ios::ate);
+    if (rows != std::vector<std::string>{"page,reads,writes,fetches", "02,11,0,0", "03,10,10,0", "80,10,0,93", "FF,2,0,0"}
+        || binary.tellg() != 8 + 3 * 0x10000 * 8) {
+        std::println("The heatmap was not exported as expected.");
+        failures++;
+    }
+    csv.close();
+    binary.close();
+    std::remove(csvPath.c_str());
+    std::remove(binaryPath.c_str());
+
+    reportChecks("memory heatmap", failures);
+}
+
+/*
+    Runs the same instructions at each trace level and checks what reaches the log.
+*/
+void runTraceLevelTest() {
+    // LDA #$05, STA $0300, INC $0300
+    std::vector<uint8_t> bytes = makeTestROM({0x01, 0x00});
+    const uint8_t program[] = {0xa9, 0x05, 0x8d, 0x00, 0x03, 0xee, 0x00, 0x03};
+    std::copy(std::begin(program), std::end(program), bytes.begin() + 16);
+    ROM rom;
+    std::unique_ptr<NES> nes = makeTestNES(rom, std::move(bytes));
+    const std::string logPath = "trace_level_test.txt";
+    int failures = 0;
+
+    const CPU::traceLevel levels[] = {CPU::NO_TRACE, CPU::INSTRUCTION_TRACE, CPU::BUS_TRACE};
+    std::vector<std::string> logs[3];
+    for (int level = 0; level < 3; level++) {
+        nes->cpu->logger.start(logPath, false, levels[level]);
+        nes->cpu->setPC(static_cast<addr_t>(0x8000));
+        for (int i = 0; i < 3; i++) {
+            nes->cpu->runOpcode(nes->cpu->read(), true);
+        }
+        nes->cpu->logger.stop();
+        std::ifstream log(logPath);
+        for (std::string line; std::getline(log, line);) {
+            logs[level].push_back(line);
+        }
+    }
+    std::remove(logPath.c_str());
+
+    if (!logs[0].empty() || logs[1].size() != 3 || logs[2].size() != 3) {
+        std::println("The logs had {}, {}, and {} lines.", logs[0].size(), logs[1].size(), logs[2].size());
+        failures++;
+    } else {
+        if (!logs[1][1].starts_with("8002  8D 00 03  STA $0300 = ") || logs[1][1].contains("BUS:")) {
+            std::println("The instruction trace logged \"{}\".", logs[1][1]);
+            failures++;
+        }
+        if (!logs[2][1].contains(" BUS:0300 R:") || !logs[2][2].contains(" BUS:0300 R:05 W:06 CYC:")) {
+            std::println("The bus trace logged \"{}\" and \"{}\".", logs[2][1], logs[2][2]);
+            failures++;
+        }
+    }
+
+    reportChecks("trace level", failures);
+}
+
+/*
+    Converts the nestest log to a binary trace and back, which must give the same text,
+    and checks that the comparison finds a changed field and fails on malformed traces.
+*/
+void runTraceConvertTest() {
+    const std::string binaryPath = "trace_convert_test.bin", textPath = "trace_convert_test.txt";
+    int failures = 0;
+
+    if (!convertTrace("../test/nestest.log", binaryPath, false) || !convertTrace(binaryPath, textPath, false)) {
+        std::println("The nestest log could not be converted.");
+        failures++;
+    } else {
+        std::ifstream original("../test/nestest.log"), converted(textPath);
+        std::string expected, actual;
+        int line = 1;
+        while (std::getline(original, expected)) {
+            if (expected.ends_with('\r')) {
+                expected.pop_back();
+            }
+            if (!std::getline(converted, actual) || actual != expected) {
+                std::println("Line {} came back as \"{}\".", line, actual);
+                failures++;
+                break;
+            }
+            line++;
+        }
+        if (!failures && std::getline(converted, actual)) {
+            std::println("The converted log is longer than the original.");
+            failures++;
+        }
+        original.close();
+        converted.close();
+
+        // Change the Y register of the fourth record
+        std::fstream binary(binaryPath, std::ios::in | std::ios::out | std::ios::binary);
+        binary.seekp(TRACE_HEADER_SIZE + 3 * TRACE_RECORD_SIZE + 22);
+        binary.put(0x7f);
+        binary.close();
+        if (compareTraces("../test/nestest.log", binaryPath, false, false) || !compareTraces(textPath, "../test/nestest.log", false, false)) {
+            std::println("The traces were not compared as expected.");
+            failures++;
+        }
+
+        // A line that cannot be read fails, even where a shorter trace would be allowed
+        std::ofstream(textPath, std::ios::app) << "Not a CPU log line\n";
+        binary.open(binaryPath, std::ios::out | std::ios::binary | std::ios::app);
+        binary.put(0);
+        binary.close();
+        if (compareTraces("../test/nestest.log", textPath, false, true) || compareTraces(textPath, textPath, false, false)
+            || compareTraces(binaryPath, binaryPath, false, false) || convertTrace(textPath, binaryPath, false)) {
+            std::println("Malformed traces were not reported.");
+            failures++;
+        }
+    }
+    std::remove(binaryPath.c_str());
+    std::remove(textPath.c_str());
+
+    reportChecks("trace conversion", failures);
+}
+
 void printOpcodeProperties(std::string mapping(int)) {
     for (int i = 0; i < 16; i++) {
         for (int j = 0; j < 16; j++) {
@@ -140,7 +956,33 @@ void runCpuTest(std::string testName) {
     if (testName == "nestest") {
         runNesTest(0);
     } else if (testName == "blargg5official") {
-        runBlarggCpuTest5Official();
+        runBlarggCpuTest5Official(false);
+    } else if (testName == "blargg5official_pipelined") {
+        runBlarggCpuTest5Official(true);
+    } else if (testName == "shared_rom") {
+        runSharedRomTest();
+    } else if (testName == "mmc1_banks") {
+        runMMC1BankTest();
+    } else if (testName == "mmc3") {
+        runMMC3Test();
+    } else if (testName == "discrete_mappers") {
+        runDiscreteMapperTest();
+    } else if (testName == "memory_snapshot") {
+        runMemorySnapshotTest();
+    } else if (testName == "peek") {
+        runPeekTest();
+    } else if (testName == "battery_save") {
+        runBatterySaveTest();
+    } else if (testName == "cheats") {
+        runCheatTest();
+    } else if (testName == "rom_database") {
+        runROMDatabaseTest();
+    } else if (testName == "memory_heatmap") {
+        runMemoryHeatmapTest();
+    } else if (testName == "trace_levels") {
+        runTraceLevelTest();
+    } else if (testName == "trace_convert") {
+        runTraceConvertTest();
     } else if (testName == "addressing_modes") {
         printOpcodeProperties([] (int x) { return addressingModeNames[addressingModesByOpcode[x]]; });
     } else if (testName == "instructions") {
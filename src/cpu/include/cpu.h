@@ -2,12 +2,14 @@
 #include "core_memory.h"
 #include "ppu.h"
 #include "opcodes.h"
+#include "trace.h"
 #include <cstdint>
 #include <fstream>
 #include <thread>
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <semaphore>
 
 class CPU {
@@ -15,30 +17,40 @@ class CPU {
     friend class PPU;
 
     public:
+        /*
+            How much the CPU writes to the log for each instruction.
+            INSTRUCTION_TRACE writes a line in the format of Nintendulator's CPU log, and BUS_TRACE
+            adds the operand's bus access: its address, the byte read, and the byte left there by a write.
+            BINARY_TRACE writes the same as INSTRUCTION_TRACE as fixed-size records (see trace.h),
+            which skips formatting and is a fraction of the size.
+        */
+        enum traceLevel {
+            NO_TRACE, INSTRUCTION_TRACE, BUS_TRACE, BINARY_TRACE, TRACE_LEVELS
+        };
+
         class Logger {
             friend CPU;
 
             public:
-                void start(std::string path, bool reversePPU=false);
+                void start(std::string path, bool reversePPU=false, traceLevel level=INSTRUCTION_TRACE);
                 void stop();
 
             private:
                 Logger(CPU& cpu);
-                void logOpcode(
-                    uint8_t opcode,
-                    addressingMode mode, 
-                    instruction inst
-                );
-                void logArgsAndRegisters(
+                void recordOpcode(uint8_t opcode, addressingMode mode);
+                void recordPPU(int scanline, int cyclesOnLine);
+                void recordArgsAndRegisters(
                     addressingMode mode,
                     instruction inst,
                     addr_t addr,
                     uint8_t argument
                 );
-                void logStr(std::string_view str);
-                std::string logPPUstring(int scanline, int cyclesOnLine);
+                void logRecord();
+                void logBusAccess(instruction inst, addr_t addr, uint8_t argument);
                 void logCycles(int cyclesExecuted);
-                bool logging, reversePPU;
+                void writeRecord(int cyclesExecuted);
+                bool reversePPU;
+                TraceRecord record; // The instruction being traced
                 std::ofstream logFile;
                 CPU& cpu;
         };
@@ -56,10 +68,15 @@ class CPU {
         void cycle();
         uint8_t peek();
         uint16_t peekWord();
+        template <class Memory = CoreMemory>
         uint8_t read();
+        template <class Memory = CoreMemory>
         uint16_t readWord();
         bool checkRunning();
+        void setFrameHandler(std::function<void()> handler);
         void runOpcode(uint8_t opcode, bool ignoreCycles=false);
+        template <class Memory>
+        void specialize();
 
         static addressingMode getAddressingMode(uint8_t opcode);
         static instruction getInstruction(uint8_t opcode);
@@ -87,17 +104,43 @@ class CPU {
             uint8_t c : 1, z : 1, i : 1, d : 1, b2 : 1, b1 : 1, v : 1, n : 1;
         } p;
         
+        /*
+            The instruction path is compiled once for each mapper type, so that memory accesses
+            inline all the way into the mapper's handlers. The version for the attached
+            mapper is picked once in specialize(), and only runOpcode() and start() call through it.
+            The CoreMemory version works with any mapper through virtual calls.
+
+            Each of those is compiled again for every trace level, so the untraced versions have
+            no logging in them at all. The logger picks the level when it starts and stops,
+            and start() uses whichever level was picked when the CPU thread began.
+        */
+        void (CPU::*executeOpcode[TRACE_LEVELS])(uint8_t opcode, bool ignoreCycles);
+        void (CPU::*runLoop[TRACE_LEVELS])();
+        traceLevel trace;
+
+        template <class Memory, traceLevel Trace>
+        void execute(uint8_t opcode, bool ignoreCycles);
+        template <class Memory, traceLevel Trace>
+        void run();
+        template <class Memory>
         addr_t getAddress(addressingMode mode);
         uint8_t processorStatus();
         void setProcessorStatus(uint8_t status);
         void setNZ(uint8_t val);
+        template <class Memory>
+        void oamDMA(uint8_t page, bool ignoreCycles);
+        template <class Memory>
+        void interrupt(addr_t vector, bool ignoreCycles);
+        template <class Memory>
         void stackPush(uint8_t val);
+        template <class Memory>
         uint8_t stackPop();
         int getCycleCountOffset(
             instruction inst,
             addr_t addr,
             bool extraCycles
         );
+        template <class Memory>
         void runInstruction(
             addressingMode mode,
             instruction inst,
@@ -106,6 +149,7 @@ class CPU {
         );
         bool waitForCycles(int n);
         bool waitForCycle();
+        void startFrame();
         std::atomic<bool> running;
         std::atomic<bool> notDone;
 
@@ -115,10 +159,54 @@ class CPU {
         std::mutex cycleStatusMutex;
         std::condition_variable cycleStatusCV;
 
-        // For synchronizing with PPU clock
-        std::condition_variable ppuToCpuCV;
-        std::mutex ppuToCpuMutex;
+        // Called by the CPU thread between instructions once the PPU reaches nextFrameDot
+        std::function<void()> frameHandler;
+        uint64_t nextFrameDot;
 
         CPU(const CPU&) = delete;
         CPU& operator=(const CPU&) = delete;
 };
+
+/*
+    Reads the next byte at the program counter and increments the PC.
+*/
+template <class Memory /* = CoreMemory */>
+uint8_t CPU::read() {
+    return memory->read<Memory, MemoryHeatmap::FETCH>(pc++);
+}
+
+/*
+    Reads the next word at the program counter and increments the PC twice.
+*/
+template <class Memory /* = CoreMemory */>
+uint16_t CPU::readWord() {
+    uint16_t word = memory->readWord<Memory, MemoryHeatmap::FETCH>(pc);
+    pc += 2;
+    return word;
+}
+
+template <class Memory>
+void CPU::stackPush(uint8_t val) {
+    memory->write<Memory>(0x100 + (sp--), val);
+}
+
+template <class Memory>
+uint8_t CPU::stackPop() {
+    return memory->read<Memory>(0x100 + (++sp));
+}
+
+/*
+    Runs instructions with the version compiled for the given mapper type.
+    The mapper calls this when it is attached.
+*/
+template <class Memory>
+void CPU::specialize() {
+    executeOpcode[NO_TRACE] = &CPU::execute<Memory, NO_TRACE>;
+    executeOpcode[INSTRUCTION_TRACE] = &CPU::execute<Memory, INSTRUCTION_TRACE>;
+    executeOpcode[BUS_TRACE] = &CPU::execute<Memory, BUS_TRACE>;
+    executeOpcode[BINARY_TRACE] = &CPU::execute<Memory, BINARY_TRACE>;
+    runLoop[NO_TRACE] = &CPU::run<Memory, NO_TRACE>;
+    runLoop[INSTRUCTION_TRACE] = &CPU::run<Memory, INSTRUCTION_TRACE>;
+    runLoop[BUS_TRACE] = &CPU::run<Memory, BUS_TRACE>;
+    runLoop[BINARY_TRACE] = &CPU::run<Memory, BINARY_TRACE>;
+}
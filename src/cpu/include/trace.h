@@ -0,0 +1,71 @@
+#pragma once
+#include "core_memory.h"
+#include "mapped_file.h"
+#include "opcodes.h"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+/*
+    One instruction of a CPU trace, holding exactly what a line of Nintendulator's CPU log shows.
+    The operand's address and the byte read from it are kept only where the log shows them,
+    and are zero otherwise. Like the log, the byte reads as FF for PPU and APU registers.
+    Everything else on the line, such as the index of an indexed address, is worked out
+    from the operand bytes and the registers.
+*/
+struct TraceRecord {
+    uint64_t cycle;
+    addr_t pc, address;
+    uint16_t scanline, dot; // The PPU's position before the instruction ran
+    uint8_t opcode;
+    std::array<uint8_t, 2> operands; // Zero past the end of the instruction
+    uint8_t argument;
+    uint8_t a, x, y, p, sp; // Before the instruction ran
+
+    bool operator==(const TraceRecord&) const = default;
+};
+
+/*
+    Binary trace files hold fixed-size records, so they can be compared and searched
+    without parsing anything. Every number is stored little-endian:
+    0-6: "NESTRC" followed by MS-DOS EOF
+    7: Format version
+    8-: Records of 32 bytes each, in the order of TraceRecord's fields, with the rest zero
+*/
+const size_t TRACE_HEADER_SIZE = 8, TRACE_RECORD_SIZE = 32;
+
+void setTraceOperand(TraceRecord& record, addressingMode mode, instruction inst, addr_t addr, uint8_t argument);
+void writeTraceHeader(std::ostream& out);
+void writeTraceRecord(std::ostream& out, const TraceRecord& record);
+void printTraceRecord(std::ostream& out, const TraceRecord& record, bool reversePPU);
+std::optional<TraceRecord> parseTraceLine(std::string_view line, bool reversePPU);
+
+/*
+    Reads the records of a trace file, which may be binary or Nintendulator's text format.
+    The file is memory-mapped where the platform allows it and read through in place.
+    For text files, reversePPU says which order the PPU position is written in.
+*/
+class TraceReader {
+    public:
+        static std::unique_ptr<TraceReader> open(const std::string& path, bool reversePPU);
+
+        std::optional<TraceRecord> next();
+        bool isBinary() const;
+        bool failed() const;
+        size_t position() const;
+
+    private:
+        TraceReader() = default;
+
+        std::unique_ptr<const MappedFile> file;
+        std::string path;
+        bool binary = false, reversePPU = false, error = false;
+        size_t offset = 0, records = 0;
+};
+
+bool convertTrace(const std::string& inputPath, const std::string& outputPath, bool reversePPU);
+bool compareTraces(const std::string& expectedPath, const std::string& actualPath, bool reversePPU, bool allowPrefix);
@@ -1,11 +1,21 @@
 #include "cpu.h"
 #include <print>
 
-CPU::Logger::Logger(CPU& cpu) : logging(false), reversePPU(false), cpu(cpu) { }
+CPU::Logger::Logger(CPU& cpu) : reversePPU(false), record(), cpu(cpu) { }
 
-void CPU::Logger::start(std::string path, bool newReversePPU /* = false */) {
-    logFile.open(path, std::ios::out);
-    logging = true;
+/*
+    Starts logging each instruction at the given level.
+    A CPU thread that is already running keeps the level it started with, so this should be
+    called before CPU::start().
+*/
+void CPU::Logger::start(std::string path, bool newReversePPU /* = false */, traceLevel level /* = INSTRUCTION_TRACE */) {
+    if (level == BINARY_TRACE) {
+        logFile.open(path, std::ios::out | std::ios::binary);
+        writeTraceHeader(logFile);
+    } else {
+        logFile.open(path, std::ios::out);
+    }
+    cpu.trace = level;
     // Nintendulator and nestest seem to use reversed PPU cycle notations
     // Setting this to true will make it Nintendulator-compatible
     reversePPU = newReversePPU;
@@ -13,111 +23,69 @@ void CPU::Logger::start(std::string path, bool newReversePPU /* = false */) {
 }
 
 void CPU::Logger::stop() {
+    cpu.trace = NO_TRACE;
     logFile.close();
     std::println("Stopped CPU logging.");
 }
 
-void CPU::Logger::logOpcode(uint8_t opcode, addressingMode mode, instruction inst) {
-    std::print(logFile, "{:04X}  {:02X}", cpu.pc - 1, opcode);
-        
-    // Write opcode arguments to log
-    int count = addressingModeReadCount[mode];
-    if (count) {
-        std::print(logFile, " {:02X}", cpu.memory->read(cpu.pc));
-        if (count > 1) {
-            std::print(logFile, " {:02X}", cpu.memory->read(cpu.pc + 1));
-        } else {
-            std::print(logFile, "   ");
-        }
-    } else {
-        std::print(logFile, "      ");
-    }
-
-    // Write opcode name to log
-    std::string opcodeName = opcodeNames[inst];
-    std::print(logFile, "{}", (isLegalOpcode(opcode) ? "  " : " *") + opcodeName + " ");
+/*
+    Starts the record of an instruction with its address and the bytes that encode it.
+    The CPU has already read the opcode, so the operands are next.
+*/
+void CPU::Logger::recordOpcode(uint8_t opcode, addressingMode mode) {
+    record.pc = static_cast<addr_t>(cpu.pc - 1);
+    record.opcode = opcode;
+    int count = mode < NUL ? addressingModeReadCount[mode] : 0;
+    record.operands[0] = count ? cpu.memory->peek(cpu.pc) : 0;
+    record.operands[1] = count > 1 ? cpu.memory->peek(static_cast<addr_t>(cpu.pc + 1)) : 0;
 }
 
-void CPU::Logger::logArgsAndRegisters(addressingMode mode, instruction inst, addr_t addr, uint8_t argument) {
-    // Nintendulator prints out FF for all PPU registers, no matter their true value
-    if (addr >= 0x2000 && addr < 0x4000) {
-        argument = 0xff;
-    }
-    // Nintendulator also prints out FF for all APU registers, regardless of true value
-    else if (addr >= 0x4000 && addr < 0x4020) {
-        argument = 0xff;
-    }
-    switch (mode) {
-        case IMM:
-            std::print(logFile, "#${:02X}                        ", argument);
-            break;
-        case ZPG:
-            std::print(logFile, "${:02X} = {:02X}                    ", addr, argument);
-            break;
-        case ZPX:
-            std::print(logFile, "${:02X},X @ {:02X} = {:02X}             ", cpu.cache, addr, argument);
-            break;
-        case ZPY:
-            std::print(logFile, "${:02X},Y @ {:02X} = {:02X}             ", cpu.cache, addr, argument);
-            break;
-        case IZX:
-            std::print(logFile, "(${:02X},X) @ {:02X} = {:04X} = {:02X}    ", cpu.precache, cpu.cache, addr, argument);
-            break;
-        case IZY:
-            std::print(logFile, "(${:02X}),Y = {:04X} @ {:04X} = {:02X}  ", cpu.precache, cpu.cache, addr, argument);
-            break;
-        case ABS:
-            std::print(logFile, "${:04X}", addr);
-            if (inst == JMP || inst == JSR) {
-                std::print(logFile, "                       ");
-            } else {
-                std::print(logFile, " = {:02X}                  ", argument);
-            }
-            break;
-        case ABX:
-            std::print(logFile, "${:04X},X @ {:04X} = {:02X}         ", cpu.cache, addr, argument);
-            break;
-        case ABY:
-            std::print(logFile, "${:04X},Y @ {:04X} = {:02X}         ", cpu.cache, addr, argument);
-            break;
-        case IND:
-            std::print(logFile, "(${:04X}) = {:04X}              ", cpu.cache, addr);
-            break;
-        case REL:
-            std::print(logFile, "${:04X}                       ", addr);
-            break;
-        case NUL:
-            if (inst == ASL || inst == LSR || inst == ROL || inst == ROR) {
-                std::print(logFile, "A                           ");
-            } else {
-                std::print(logFile, "                            ");
-            }
-            break;
-        default:
-            std::print(logFile, "ERROR                           ");
-            break;
-    }
+void CPU::Logger::recordPPU(int scanline, int cyclesOnLine) {
+    record.scanline = static_cast<uint16_t>(scanline);
+    record.dot = static_cast<uint16_t>(cyclesOnLine);
+}
 
-    std::print(logFile, "A:{:02X} X:{:02X} Y:{:02X} P:{:02X} SP:{:02X}", cpu.a, cpu.x, cpu.y, cpu.processorStatus(), cpu.sp);
+void CPU::Logger::recordArgsAndRegisters(addressingMode mode, instruction inst, addr_t addr, uint8_t argument) {
+    setTraceOperand(record, mode, inst, addr, argument);
+    record.a = cpu.a;
+    record.x = cpu.x;
+    record.y = cpu.y;
+    record.p = cpu.processorStatus();
+    record.sp = cpu.sp;
 }
 
 /*
-    Generates string for logging PPU cycle information.
+    Writes the instruction's line, up to the cycle count.
 */
-std::string CPU::Logger::logPPUstring(int scanline, int cyclesOnLine) {
-    int first = reversePPU ? cyclesOnLine : scanline;
-    int second = reversePPU ? scanline : cyclesOnLine;
-
-    return std::format(" PPU:{:3},{:3}", first, second);
+void CPU::Logger::logRecord() {
+    printTraceRecord(logFile, record, reversePPU);
 }
 
 /*
-    Writes an arbitrary string to the current log file.
+    Writes the operand's address and the byte read from it, after the instruction has run.
+    For instructions that write the operand, the byte at the address afterwards is shown too.
+    It is peeked, so a register shows its read side rather than what was written to it.
 */
-void CPU::Logger::logStr(std::string_view str) {
-    std::print(logFile, "{}", str);
+void CPU::Logger::logBusAccess(instruction inst, addr_t addr, uint8_t argument) {
+    std::print(logFile, " BUS:{:04X} R:{:02X}", addr, argument);
+    switch (inst) {
+        case ASL: case DEC: case INC: case LSR: case ROL: case ROR: case STA: case STX: case STY:
+        case DCP: case ISB: case RLA: case RRA: case SAX: case SLO: case SRE:
+            std::print(logFile, " W:{:02X}", cpu.memory->peek(addr));
+            break;
+        default:
+            break;
+    }
 }
 
 void CPU::Logger::logCycles(int cyclesExecuted) {
     std::println(logFile, " CYC:{}", cyclesExecuted);
 }
+
+/*
+    Writes the instruction as a binary record.
+*/
+void CPU::Logger::writeRecord(int cyclesExecuted) {
+    record.cycle = static_cast<uint64_t>(cyclesExecuted);
+    writeTraceRecord(logFile, record);
+}
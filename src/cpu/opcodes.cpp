@@ -1,5 +1,9 @@
 #include "opcodes.h"
 #include "cpu.h"
+#include "mapper000.h"
+#include "mapper001.h"
+#include "mapper004.h"
+#include "discrete_mapper.h"
 
 const std::string addressingModeNames[] = {
     "IMM", "ZPG", "ZPX", "ZPY", "IZX", "IZY", "ABS", "ABX", "ABY", "IND", "REL", "NUL", "XXX"
@@ -218,6 +222,7 @@ int CPU::getCycleCountOffset(instruction inst, addr_t addr, bool extraCycles) {
     return ret;
 }
 
+template <class Memory>
 void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uint8_t argument) {
     switch (inst) {
         case ADC: {
@@ -240,7 +245,7 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             if (mode == NUL) {
                 a = result;
             } else {
-                memory->write(addr, result);
+                memory->write<Memory>(addr, result);
             }
             }
             break;
@@ -282,12 +287,12 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
         case BRK:
             // TODO: Make sure this all works as intended
             pc += 2;
-            stackPush((pc & 0xff00) >> 8);
-            stackPush(pc & 0xff);
+            stackPush<Memory>((pc & 0xff00) >> 8);
+            stackPush<Memory>(pc & 0xff);
             p.b1 = p.b2 = 1;
-            stackPush(processorStatus());
+            stackPush<Memory>(processorStatus());
             p.i = 1;
-            pc = memory->readWord(0xfffe);
+            pc = memory->readWord<Memory>(0xfffe);
             break;
         case BVC:
             if (!p.v) {
@@ -334,11 +339,11 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             break;
         case DCP: // DEC + CMP
             // TODO: Fix cycle accuracy by mixing both
-            runInstruction(mode, DEC, addr, argument);
-            runInstruction(mode, CMP, addr, argument - 1);
+            runInstruction<Memory>(mode, DEC, addr, argument);
+            runInstruction<Memory>(mode, CMP, addr, argument - 1);
             break;
         case DEC:
-            memory->write(addr, argument - 1);
+            memory->write<Memory>(addr, argument - 1);
             setNZ(argument - 1);
             break;
         case DEX:
@@ -354,7 +359,7 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             setNZ(a);
             break;
         case INC:
-            memory->write(addr, argument + 1);
+            memory->write<Memory>(addr, argument + 1);
             setNZ(argument + 1);
             break;
         case INX:
@@ -367,21 +372,21 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             break;
         case ISB: // INC + SBC
             // TODO: Fix cycle accuracy by mixing both
-            runInstruction(mode, INC, addr, argument);
-            runInstruction(mode, SBC, addr, argument + 1);
+            runInstruction<Memory>(mode, INC, addr, argument);
+            runInstruction<Memory>(mode, SBC, addr, argument + 1);
             break;
         case JMP:
             pc = addr;
             break;
         case JSR:
-            stackPush(((--pc) & 0xff00) >> 8);
-            stackPush(pc & 0xff);
+            stackPush<Memory>(((--pc) & 0xff00) >> 8);
+            stackPush<Memory>(pc & 0xff);
             pc = addr;
             break;
         case LAX: // LDA + LDX
             // TODO: Fix cycle accuracy by mixing both
-            runInstruction(mode, LDA, addr, argument);
-            runInstruction(mode, LDX, addr, argument);
+            runInstruction<Memory>(mode, LDA, addr, argument);
+            runInstruction<Memory>(mode, LDX, addr, argument);
             break;
         case LDA:
             a = argument;
@@ -402,7 +407,7 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             if (mode == NUL) {
                 a = result;
             } else {
-                memory->write(addr, result);
+                memory->write<Memory>(addr, result);
             }
             }
             break;
@@ -413,22 +418,22 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             setNZ(a);
             break;
         case PHA:
-            stackPush(a);
+            stackPush<Memory>(a);
             break;
         case PHP:
             // Bits 5 and 6 be set to 1 in the copy on the stack
             // See https://www.masswerk.at/6502/6502_instruction_set.html#PHP
-            stackPush(processorStatus() | 0x30);
+            stackPush<Memory>(processorStatus() | 0x30);
             break;
         case PLA:
-            a = stackPop();
+            a = stackPop<Memory>();
             setNZ(a);
             break;
         case PLP: {
             // We ignore changes to bits 5 and 6
             // See https://www.masswerk.at/6502/6502_instruction_set.html#PLP
             processorFlags oldP = p;
-            setProcessorStatus(stackPop());
+            setProcessorStatus(stackPop<Memory>());
             p.b1 = oldP.b1;
             p.b2 = oldP.b2;
             }
@@ -440,7 +445,7 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             if (mode == NUL) {
                 a = result;
             } else {
-                memory->write(addr, result);
+                memory->write<Memory>(addr, result);
             }
             a &= result;
             setNZ(a);
@@ -454,7 +459,7 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             if (mode == NUL) {
                 a = result;
             } else {
-                memory->write(addr, result);
+                memory->write<Memory>(addr, result);
             }
             }
             break;
@@ -465,7 +470,7 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             if (mode == NUL) {
                 a = result;
             } else {
-                memory->write(addr, result);
+                memory->write<Memory>(addr, result);
             }
             }
             break;
@@ -476,7 +481,7 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             if (mode == NUL) {
                 a = result;
             } else {
-                memory->write(addr, result);
+                memory->write<Memory>(addr, result);
             }
             // Use a type large enough to detect carry
             uint16_t result2 = a + p.c + result;
@@ -487,24 +492,23 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             }
             break;
         case RTI: {
-            // We ignore changes to the B and I flags
+            // We ignore changes to the B flag, but I is restored so that interrupts can be taken again
             // See https://www.masswerk.at/6502/6502_instruction_set.html#PLP
             processorFlags oldP = p;
-            setProcessorStatus(stackPop());
+            setProcessorStatus(stackPop<Memory>());
             p.b1 = oldP.b1;
             p.b2 = oldP.b2;
-            p.i = oldP.i;
-            uint8_t first = stackPop();
-            pc = first | (stackPop() << 8);
+            uint8_t first = stackPop<Memory>();
+            pc = first | (stackPop<Memory>() << 8);
             }
             break;
         case RTS: {
-            uint8_t first = stackPop();
-            pc = (first | (stackPop() << 8)) + 1;
+            uint8_t first = stackPop<Memory>();
+            pc = (first | (stackPop<Memory>() << 8)) + 1;
             }
             break;
         case SAX:
-            memory->write(addr, a & x);
+            memory->write<Memory>(addr, a & x);
             break;
         case SBC: {
             // Like ADC but with inverted argument
@@ -528,22 +532,22 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             break;
         case SLO: // ASL + ORA
             // TODO: Fix cycle accuracy by mixing both
-            runInstruction(mode, ASL, addr, argument);
-            runInstruction(mode, ORA, addr, argument << 1);
+            runInstruction<Memory>(mode, ASL, addr, argument);
+            runInstruction<Memory>(mode, ORA, addr, argument << 1);
             break;
         case SRE: // LSR + EOR
             // TODO: Fix cycle accuracy by mixing both
-            runInstruction(mode, LSR, addr, argument);
-            runInstruction(mode, EOR, addr, argument >> 1);
+            runInstruction<Memory>(mode, LSR, addr, argument);
+            runInstruction<Memory>(mode, EOR, addr, argument >> 1);
             break;
         case STA:
-            memory->write(addr, a);
+            memory->write<Memory>(addr, a);
             break;
         case STX:
-            memory->write(addr, x);
+            memory->write<Memory>(addr, x);
             break;
         case STY:
-            memory->write(addr, y);
+            memory->write<Memory>(addr, y);
             break;
         case TAX:
             x = a;
@@ -573,3 +577,13 @@ void CPU::runInstruction(addressingMode mode, instruction inst, addr_t addr, uin
             break;
     }
 }
+
+template void CPU::runInstruction<CoreMemory>(addressingMode, instruction, addr_t, uint8_t);
+template void CPU::runInstruction<Mapper000>(addressingMode, instruction, addr_t, uint8_t);
+template void CPU::runInstruction<Mapper001>(addressingMode, instruction, addr_t, uint8_t);
+template void CPU::runInstruction<Mapper004>(addressingMode, instruction, addr_t, uint8_t);
+template void CPU::runInstruction<Mapper002>(addressingMode, instruction, addr_t, uint8_t);
+template void CPU::runInstruction<Mapper003>(addressingMode, instruction, addr_t, uint8_t);
+template void CPU::runInstruction<Mapper007>(addressingMode, instruction, addr_t, uint8_t);
+template void CPU::runInstruction<Mapper011>(addressingMode, instruction, addr_t, uint8_t);
+template void CPU::runInstruction<Mapper066>(addressingMode, instruction, addr_t, uint8_t);
@@ -0,0 +1,461 @@
+#include "trace.h"
+#include "cpu.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <format>
+#include <fstream>
+#include <print>
+#include <sstream>
+#include <vector>
+
+namespace {
+    const uint8_t VERSION = 1;
+    const char MAGIC[] = "NESTRC\x1A";
+
+    int operandCount(addressingMode mode) {
+        return mode < NUL ? addressingModeReadCount[mode] : 0;
+    }
+
+    // The log leaves out the address of immediate operands and the byte read by jumps and branches
+    bool showsAddress(addressingMode mode) {
+        return mode != IMM && mode != NUL && mode != XXX;
+    }
+
+    bool showsArgument(addressingMode mode, instruction inst) {
+        switch (mode) {
+            case ABS:
+                return inst != JMP && inst != JSR;
+            case IND: case REL: case NUL: case XXX:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    template <class T>
+    bool parseNumber(std::string_view text, T& value, int base) {
+        while (!text.empty() && text.front() == ' ') {
+            text.remove_prefix(1);
+        }
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+        return error == std::errc() && end == text.data() + text.size();
+    }
+
+    // Finds a field such as "SP:" and parses the number after it, up to the next space
+    template <class T>
+    bool parseField(std::string_view line, std::string_view name, T& value, int base) {
+        size_t start = line.find(name);
+        if (start == std::string_view::npos) {
+            return false;
+        }
+        start += name.size();
+        while (start < line.size() && line[start] == ' ') {
+            start++;
+        }
+        size_t end = std::min(line.find(' ', start), line.size());
+        return parseNumber(line.substr(start, end - start), value, base);
+    }
+
+    void writeLittleEndian(uint8_t* bytes, uint64_t value, int size) {
+        for (int i = 0; i < size; i++) {
+            bytes[i] = static_cast<uint8_t>(value >> (i * 8));
+        }
+    }
+
+    uint64_t readLittleEndian(const uint8_t* bytes, int size) {
+        uint64_t value = 0;
+        for (int i = size - 1; i >= 0; i--) {
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+
+    std::string formatRecord(const TraceRecord& record, bool reversePPU) {
+        std::ostringstream line;
+        printTraceRecord(line, record, reversePPU);
+        std::print(line, " CYC:{}", record.cycle);
+        return line.str();
+    }
+}
+
+/*
+    Fills in the operand's address and the byte read from it, as the log shows them.
+*/
+void setTraceOperand(TraceRecord& record, addressingMode mode, instruction inst, addr_t addr, uint8_t argument) {
+    // Nintendulator prints out FF for all PPU and APU registers, no matter their true value
+    if (addr >= 0x2000 && addr < 0x4020) {
+        argument = 0xff;
+    }
+    record.address = showsAddress(mode) ? addr : 0;
+    record.argument = showsArgument(mode, inst) ? argument : 0;
+}
+
+void writeTraceHeader(std::ostream& out) {
+    out.write(MAGIC, 7);
+    out.put(static_cast<char>(VERSION));
+}
+
+void writeTraceRecord(std::ostream& out, const TraceRecord& record) {
+    uint8_t bytes[TRACE_RECORD_SIZE] {};
+    writeLittleEndian(&bytes[0], record.cycle, 8);
+    writeLittleEndian(&bytes[8], record.pc, 2);
+    writeLittleEndian(&bytes[10], record.address, 2);
+    writeLittleEndian(&bytes[12], record.scanline, 2);
+    writeLittleEndian(&bytes[14], record.dot, 2);
+    const uint8_t fields[] = {record.opcode, record.operands[0], record.operands[1], record.argument,
+        record.a, record.x, record.y, record.p, record.sp};
+    std::copy(std::begin(fields), std::end(fields), &bytes[16]);
+    out.write(reinterpret_cast<const char*>(bytes), TRACE_RECORD_SIZE);
+}
+
+/*
+    Writes a record as a line of Nintendulator's CPU log, up to but not including the cycle count,
+    so that a bus trace can add to the line before it.
+    Nintendulator and nestest seem to use reversed PPU cycle notations,
+    so reversePPU writes the dot before the scanline.
+*/
+void printTraceRecord(std::ostream& out, const TraceRecord& record, bool reversePPU) {
+    addressingMode mode = CPU::getAddressingMode(record.opcode);
+    instruction inst = CPU::getInstruction(record.opcode);
+
+    std::print(out, "{:04X}  {:02X}", record.pc, record.opcode);
+    int count = operandCount(mode);
+    if (count) {
+        std::print(out, " {:02X}", record.operands[0]);
+        if (count > 1) {
+            std::print(out, " {:02X}", record.operands[1]);
+        } else {
+            std::print(out, "   ");
+        }
+    } else {
+        std::print(out, "      ");
+    }
+    std::print(out, "{}{} ", CPU::isLegalOpcode(record.opcode) ? "  " : " *", opcodeNames[inst]);
+
+    // The indexes and pointers of indexed and indirect operands follow from the operands and registers
+    uint16_t word = static_cast<uint16_t>(record.operands[0] | (record.operands[1] << 8));
+    addr_t addr = record.address;
+    uint8_t argument = record.argument;
+    switch (mode) {
+        case IMM:
+            std::print(out, "#${:02X}                        ", argument);
+            break;
+        case ZPG:
+            std::print(out, "${:02X} = {:02X}                    ", addr, argument);
+            break;
+        case ZPX:
+            std::print(out, "${:02X},X @ {:02X} = {:02X}             ", record.operands[0], addr, argument);
+            break;
+        case ZPY:
+            std::print(out, "${:02X},Y @ {:02X} = {:02X}             ", record.operands[0], addr, argument);
+            break;
+        case IZX:
+            std::print(out, "(${:02X},X) @ {:02X} = {:04X} = {:02X}    ", record.operands[0],
+                (record.operands[0] + record.x) % 0x100, addr, argument);
+            break;
+        case IZY:
+            std::print(out, "(${:02X}),Y = {:04X} @ {:04X} = {:02X}  ", record.operands[0],
+                static_cast<uint16_t>(addr - record.y), addr, argument);
+            break;
+        case ABS:
+            std::print(out, "${:04X}", addr);
+            if (inst == JMP || inst == JSR) {
+                std::print(out, "                       ");
+            } else {
+                std::print(out, " = {:02X}                  ", argument);
+            }
+            break;
+        case ABX:
+            std::print(out, "${:04X},X @ {:04X} = {:02X}         ", word, addr, argument);
+            break;
+        case ABY:
+            std::print(out, "${:04X},Y @ {:04X} = {:02X}         ", word, addr, argument);
+            break;
+        case IND:
+            std::print(out, "(${:04X}) = {:04X}              ", word, addr);
+            break;
+        case REL:
+            std::print(out, "${:04X}                       ", addr);
+            break;
+        case NUL:
+            if (inst == ASL || inst == LSR || inst == ROL || inst == ROR) {
+                std::print(out, "A                           ");
+            } else {
+                std::print(out, "                            ");
+            }
+            break;
+        default:
+            std::print(out, "ERROR                           ");
+            break;
+    }
+
+    std::print(out, "A:{:02X} X:{:02X} Y:{:02X} P:{:02X} SP:{:02X}", record.a, record.x, record.y, record.p, record.sp);
+    std::print(out, " PPU:{:3},{:3}", reversePPU ? record.dot : record.scanline, reversePPU ? record.scanline : record.dot);
+}
+
+/*
+    Reads a line of Nintendulator's CPU log. The operand's address and the byte read from it
+    are the last numbers of the disassembly, where the log shows them.
+    Returns nothing if the line is not in the expected format.
+*/
+std::optional<TraceRecord> parseTraceLine(std::string_view line, bool reversePPU) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    size_t registers = line.find("A:", 20);
+    if (line.size() < 20 || registers == std::string_view::npos) {
+        return std::nullopt;
+    }
+
+    TraceRecord record {};
+    if (!parseNumber(line.substr(0, 4), record.pc, 16) || !parseNumber(line.substr(6, 2), record.opcode, 16)) {
+        return std::nullopt;
+    }
+    addressingMode mode = CPU::getAddressingMode(record.opcode);
+    instruction inst = CPU::getInstruction(record.opcode);
+    for (int i = 0; i < operandCount(mode); i++) {
+        if (!parseNumber(line.substr(9 + i * 3, 2), record.operands[i], 16)) {
+            return std::nullopt;
+        }
+    }
+
+    std::vector<std::string_view> numbers;
+    std::string_view disassembly = line.substr(20, registers - 20);
+    for (size_t i = 0; i < disassembly.size();) {
+        size_t end = i;
+        while (end < disassembly.size() && std::isxdigit(static_cast<unsigned char>(disassembly[end]))) {
+            end++;
+        }
+        if (end > i) {
+            numbers.push_back(disassembly.substr(i, end - i));
+        }
+        i = end + 1;
+    }
+    if (mode != NUL) {
+        bool argumentShown = showsArgument(mode, inst);
+        size_t needed = (argumentShown ? 1 : 0) + (showsAddress(mode) ? 1 : 0);
+        if (numbers.size() < needed
+            || (argumentShown && !parseNumber(numbers.back(), record.argument, 16))
+            || (showsAddress(mode) && !parseNumber(numbers[numbers.size() - needed], record.address, 16))) {
+            return std::nullopt;
+        }
+    }
+
+    std::string_view fields = line.substr(registers);
+    size_t ppu = fields.find("PPU:"), comma = fields.find(',', ppu), cycles = fields.find(" CYC:");
+    uint16_t first = 0, second = 0;
+    if (!parseField(fields, "A:", record.a, 16) || !parseField(fields, "X:", record.x, 16)
+        || !parseField(fields, "Y:", record.y, 16) || !parseField(fields, "P:", record.p, 16)
+        || !parseField(fields, "SP:", record.sp, 16) || ppu == std::string_view::npos
+        || comma == std::string_view::npos || cycles == std::string_view::npos
+        || !parseNumber(fields.substr(ppu + 4, comma - ppu - 4), first, 10)
+        || !parseNumber(fields.substr(comma + 1, cycles - comma - 1), second, 10)
+        || !parseField(fields, "CYC:", record.cycle, 10)) {
+        return std::nullopt;
+    }
+    record.scanline = reversePPU ? second : first;
+    record.dot = reversePPU ? first : second;
+    return record;
+}
+
+/*
+    Maps a trace file and works out whether it is binary or text.
+    Returns nullptr if the file cannot be read.
+*/
+std::unique_ptr<TraceReader> TraceReader::open(const std::string& path, bool reversePPU) {
+    std::unique_ptr<TraceReader> reader(new TraceReader());
+    reader->file = MappedFile::open(path);
+    if (!reader->file) {
+        std::println(stderr, "Could not open trace file {}.", path);
+        return nullptr;
+    }
+    std::span<const uint8_t> bytes = reader->file->bytes();
+    reader->binary = bytes.size() >= TRACE_HEADER_SIZE && std::equal(MAGIC, MAGIC + 7, bytes.begin());
+    if (reader->binary && bytes[7] != VERSION) {
+        std::println(stderr, "{} is a trace of version {}, but only version {} can be read.", path, bytes[7], VERSION);
+        return nullptr;
+    }
+    reader->path = path;
+    reader->reversePPU = reversePPU;
+    reader->offset = reader->binary ? TRACE_HEADER_SIZE : 0;
+    return reader;
+}
+
+/*
+    Returns the next record, or nothing at the end of the file.
+    A line of text that cannot be read, or a binary record cut short, also ends the file,
+    after saying where it is. failed() tells that apart from a normal end.
+*/
+std::optional<TraceRecord> TraceReader::next() {
+    std::span<const uint8_t> bytes = file->bytes();
+    if (binary) {
+        if (offset + TRACE_RECORD_SIZE > bytes.size()) {
+            if (offset < bytes.size()) {
+                std::println(stderr, "Record {} of {} is cut short.", records + 1, path);
+                error = true;
+                offset = bytes.size();
+            }
+            return std::nullopt;
+        }
+        const uint8_t* data = &bytes[offset];
+        offset += TRACE_RECORD_SIZE;
+        records++;
+
+        TraceRecord record;
+        record.cycle = readLittleEndian(&data[0], 8);
+        record.pc = static_cast<addr_t>(readLittleEndian(&data[8], 2));
+        record.address = static_cast<addr_t>(readLittleEndian(&data[10], 2));
+        record.scanline = static_cast<uint16_t>(readLittleEndian(&data[12], 2));
+        record.dot = static_cast<uint16_t>(readLittleEndian(&data[14], 2));
+        record.opcode = data[16];
+        record.operands = {data[17], data[18]};
+        record.argument = data[19];
+        record.a = data[20];
+        record.x = data[21];
+        record.y = data[22];
+        record.p = data[23];
+        record.sp = data[24];
+        return record;
+    }
+
+    std::string_view text(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    while (offset < text.size()) {
+        size_t end = std::min(text.find('\n', offset), text.size());
+        std::string_view line = text.substr(offset, end - offset);
+        offset = end + 1;
+        if (line.empty() || line == "\r") {
+            continue;
+        }
+        records++;
+        std::optional<TraceRecord> record = parseTraceLine(line, reversePPU);
+        if (!record) {
+            std::println(stderr, "Line {} of {} is not a CPU log line.", records, path);
+            error = true;
+            offset = text.size();
+        }
+        return record;
+    }
+    return std::nullopt;
+}
+
+bool TraceReader::isBinary() const {
+    return binary;
+}
+
+/*
+    Returns true if reading stopped at something that is not a record, rather than at the end of the file.
+*/
+bool TraceReader::failed() const {
+    return error;
+}
+
+/*
+    Returns how many records have been read so far.
+*/
+size_t TraceReader::position() const {
+    return records;
+}
+
+/*
+    Converts a binary trace into Nintendulator's text format, or the other way around.
+    Returns false if either file cannot be used.
+*/
+bool convertTrace(const std::string& inputPath, const std::string& outputPath, bool reversePPU) {
+    std::unique_ptr<TraceReader> reader = TraceReader::open(inputPath, reversePPU);
+    if (!reader) {
+        return false;
+    }
+    std::ofstream output(outputPath, reader->isBinary() ? std::ios::out : std::ios::out | std::ios::binary);
+    if (!output) {
+        std::println(stderr, "Could not open trace file {}.", outputPath);
+        return false;
+    }
+
+    if (!reader->isBinary()) {
+        writeTraceHeader(output);
+    }
+    while (std::optional<TraceRecord> record = reader->next()) {
+        if (reader->isBinary()) {
+            printTraceRecord(output, *record, reversePPU);
+            std::println(output, " CYC:{}", record->cycle);
+        } else {
+            writeTraceRecord(output, *record);
+        }
+    }
+    if (reader->failed()) {
+        return false;
+    }
+    std::println("Converted {} records from {} to {}.", reader->position(), inputPath, outputPath);
+    return static_cast<bool>(output);
+}
+
+/*
+    Reads two traces, in either format, and reports the first field that differs between them.
+    With allowPrefix set, the actual trace may stop before the expected one does.
+    Returns true if they match, and false if either cannot be read to its end.
+*/
+bool compareTraces(const std::string& expectedPath, const std::string& actualPath, bool reversePPU, bool allowPrefix) {
+    std::unique_ptr<TraceReader> expected = TraceReader::open(expectedPath, reversePPU);
+    std::unique_ptr<TraceReader> actual = TraceReader::open(actualPath, reversePPU);
+    if (!expected || !actual) {
+        return false;
+    }
+
+    struct Field {
+        const char* name;
+        uint64_t (*value)(const TraceRecord&);
+        bool hex;
+    };
+    static const Field fields[] = {
+        {"PC", [](const TraceRecord& r) -> uint64_t { return r.pc; }, true},
+        {"opcode", [](const TraceRecord& r) -> uint64_t { return r.opcode; }, true},
+        {"first operand", [](const TraceRecord& r) -> uint64_t { return r.operands[0]; }, true},
+        {"second operand", [](const TraceRecord& r) -> uint64_t { return r.operands[1]; }, true},
+        {"address", [](const TraceRecord& r) -> uint64_t { return r.address; }, true},
+        {"byte read", [](const TraceRecord& r) -> uint64_t { return r.argument; }, true},
+        {"A", [](const TraceRecord& r) -> uint64_t { return r.a; }, true},
+        {"X", [](const TraceRecord& r) -> uint64_t { return r.x; }, true},
+        {"Y", [](const TraceRecord& r) -> uint64_t { return r.y; }, true},
+        {"P", [](const TraceRecord& r) -> uint64_t { return r.p; }, true},
+        {"SP", [](const TraceRecord& r) -> uint64_t { return r.sp; }, true},
+        {"PPU scanline", [](const TraceRecord& r) -> uint64_t { return r.scanline; }, false},
+        {"PPU dot", [](const TraceRecord& r) -> uint64_t { return r.dot; }, false},
+        {"cycle", [](const TraceRecord& r) -> uint64_t { return r.cycle; }, false},
+    };
+
+    while (true) {
+        std::optional<TraceRecord> want = expected->next(), got = actual->next();
+        if (expected->failed() || actual->failed()) {
+            return false; // The reader has already said where
+        } else if (!want && !got) {
+            break;
+        } else if (!got) {
+            if (allowPrefix) {
+                break;
+            }
+            std::println("{} ended after {} records, but {} goes on.", actualPath, actual->position(), expectedPath);
+            return false;
+        } else if (!want) {
+            std::println("{} ended after {} records, but {} goes on.", expectedPath, expected->position(), actualPath);
+            return false;
+        }
+
+        if (*want != *got) {
+            for (const Field& field : fields) {
+                uint64_t wanted = field.value(*want), seen = field.value(*got);
+                if (wanted != seen) {
+                    std::println("Record {} differs in its {}: expected {}, but saw {}.", actual->position(), field.name,
+                        field.hex ? std::format("{:02X}", wanted) : std::to_string(wanted),
+                        field.hex ? std::format("{:02X}", seen) : std::to_string(seen));
+                    break;
+                }
+            }
+            std::println("Expected: {}", formatRecord(*want, reversePPU));
+            std::println("Saw:      {}", formatRecord(*got, reversePPU));
+            return false;
+        }
+    }
+    std::println("All {} records matched.", actual->position());
+    return true;
+}
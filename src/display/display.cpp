@@ -1,5 +1,8 @@
 #include "display.h"
+#include "frame_converter.h"
+#include "ppu_render.h"
 #include "SDL.h"
+#include <array>
 #include <string>
 #include <print>
 #include <cmath>
@@ -204,6 +207,128 @@ void rainbowTest() {
     SDL_DestroyWindow(window);
 }
 
+/*
+    Fills a frame of palette indices with four rows of sixteen color bars, covering all 64 NES colors.
+*/
+void fillColorBars(std::array<uint8_t, NES_DISPLAY_WIDTH * NES_DISPLAY_HEIGHT>& frame) {
+    for (int y = 0; y < NES_DISPLAY_HEIGHT; y++) {
+        for (int x = 0; x < NES_DISPLAY_WIDTH; x++) {
+            frame[y * NES_DISPLAY_WIDTH + x] = static_cast<uint8_t>((y / 60) * 16 + x / 16);
+        }
+    }
+}
+
+/*
+    Draws the color bars into a streaming texture every frame until the window is closed
+    or SDL fails, with the emphasis bits changing every 8 lines and cycling once per second.
+*/
+void showColorBars(SDL_Renderer* renderer, SDL_Texture* texture, const ColorTable& table) {
+    std::array<uint8_t, NES_DISPLAY_WIDTH * NES_DISPLAY_HEIGHT> frame;
+    std::array<uint8_t, NES_DISPLAY_HEIGHT> emphasis;
+    fillColorBars(frame);
+
+    SDL_Event event;
+
+    uint64_t a, b, delta, offset = 0;
+    a = SDL_GetTicks64();
+    while (1) {
+        offset++;
+
+        // Calculate the current framerate using ticks since the last frame
+        b = SDL_GetTicks64();
+        delta = b - a;
+        a = b;
+        std::println("FPS: {:>7.3f}", 1000. / delta);
+        std::fflush(stdout);
+
+        bool quit = false;
+        while (SDL_PollEvent(&event)) {
+            quit |= event.type == SDL_QUIT;
+        }
+        if (quit) {
+            break;
+        }
+
+        for (int y = 0; y < NES_DISPLAY_HEIGHT; y++) {
+            emphasis[y] = static_cast<uint8_t>((y / 8 + offset / 60) & 0x7);
+        }
+
+        void* pixelData;
+        int pitch;
+        if (SDL_LockTexture(texture, nullptr, &pixelData, &pitch) != 0) {
+            SDL_Log("Unable to lock the texture: %s", SDL_GetError());
+            break;
+        }
+        convertFrame(frame.data(), emphasis.data(), table, pixelData, pitch);
+        SDL_UnlockTexture(texture);
+
+        // Copy the texture to the rendering target
+        if (SDL_RenderCopy(renderer, texture, nullptr, nullptr) != 0) {
+            SDL_Log("Unable to draw the texture: %s", SDL_GetError());
+            break;
+        }
+        // Update the screen
+        SDL_RenderPresent(renderer);
+    }
+}
+
+/*
+    Shows all 64 NES colors as bars of palette indices, which are converted
+    straight into the texture memory without going through SDL_MapRGB.
+*/
+void paletteTest(uint32_t format) {
+    ColorTable table;
+    if (!buildColorTable(table, format)) {
+        SDL_Log("Unsupported texture format %s", SDL_GetPixelFormatName(format));
+        return;
+    }
+
+    SDL_Window* window = SDL_CreateWindow(
+        "Palette Test",
+        SDL_WINDOWPOS_CENTERED,
+        SDL_WINDOWPOS_CENTERED,
+        NES_DISPLAY_WIDTH * 2, NES_DISPLAY_HEIGHT * 2, SDL_WINDOW_RESIZABLE
+    );
+    SDL_Renderer* renderer = window ? SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC) : nullptr;
+    SDL_Texture* texture = renderer ? SDL_CreateTexture(renderer, format,
+        SDL_TEXTUREACCESS_STREAMING, NES_DISPLAY_WIDTH, NES_DISPLAY_HEIGHT) : nullptr;
+
+    if (!texture || SDL_RenderSetLogicalSize(renderer, NES_DISPLAY_WIDTH, NES_DISPLAY_HEIGHT) != 0) {
+        SDL_Log("Unable to set up the palette test: %s", SDL_GetError());
+    } else {
+        showColorBars(renderer, texture, table);
+    }
+
+    // Everything is destroyed on every path, in the reverse order it was created
+    if (texture) {
+        SDL_DestroyTexture(texture);
+    }
+    if (renderer) {
+        SDL_DestroyRenderer(renderer);
+    }
+    if (window) {
+        SDL_DestroyWindow(window);
+    }
+}
+
+/*
+    Saves the color bars as a screenshot, with each band of 30 lines using the next emphasis setting.
+    Nothing is converted to colors until the file is written.
+*/
+void screenshotTest() {
+    std::array<uint8_t, NES_DISPLAY_WIDTH * NES_DISPLAY_HEIGHT> frame;
+    std::array<uint8_t, NES_DISPLAY_HEIGHT> emphasis;
+    fillColorBars(frame);
+    for (int y = 0; y < NES_DISPLAY_HEIGHT; y++) {
+        emphasis[y] = static_cast<uint8_t>(y / 30);
+    }
+
+    std::println("Frame hash: {:016x}", hashFrame(frame.data(), emphasis.data()));
+    if (saveScreenshot("palette_test.bmp", frame.data(), emphasis.data())) {
+        std::println("Saved palette_test.bmp");
+    }
+}
+
 void runDisplayTest(std::string testType) {
     SDL_SetMainReady();
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0) {
@@ -217,6 +342,14 @@ void runDisplayTest(std::string testType) {
         noiseTest();
     }else if (testType == "rainbow") {
         rainbowTest();
+    } else if (testType == "palette") {
+        paletteTest(SDL_PIXELFORMAT_RGBA8888);
+    } else if (testType == "palette_argb") {
+        paletteTest(SDL_PIXELFORMAT_ARGB8888);
+    } else if (testType == "palette_rgb565") {
+        paletteTest(SDL_PIXELFORMAT_RGB565);
+    } else if (testType == "screenshot") {
+        screenshotTest();
     }
 
     SDL_Quit();
@@ -0,0 +1,200 @@
+#include "frame_converter.h"
+#include "ppu_render.h"
+#include "SDL.h"
+#include <fstream>
+#include <print>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FRAME_CONVERTER_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef __GNUC__
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+// RGB values of the 64 NES colors (see https://www.nesdev.org/wiki/PPU_palettes)
+const NESPalette DEFAULT_PALETTE = {{
+    { 84,  84,  84}, {  0,  30, 116}, {  8,  16, 144}, { 48,   0, 136}, { 68,   0, 100}, { 92,   0,  48}, { 84,   4,   0}, { 60,  24,   0},
+    { 32,  42,   0}, {  8,  58,   0}, {  0,  64,   0}, {  0,  60,   0}, {  0,  50,  60}, {  0,   0,   0}, {  0,   0,   0}, {  0,   0,   0},
+    {152, 150, 152}, {  8,  76, 196}, { 48,  50, 236}, { 92,  30, 228}, {136,  20, 176}, {160,  20, 100}, {152,  34,  32}, {120,  60,   0},
+    { 84,  90,   0}, { 40, 114,   0}, {  8, 124,   0}, {  0, 118,  40}, {  0, 102, 120}, {  0,   0,   0}, {  0,   0,   0}, {  0,   0,   0},
+    {236, 238, 236}, { 76, 154, 236}, {120, 124, 236}, {176,  98, 236}, {228,  84, 236}, {236,  88, 180}, {236, 106, 100}, {212, 136,  32},
+    {160, 170,   0}, {116, 196,   0}, { 76, 208,  32}, { 56, 204, 108}, { 56, 180, 204}, { 60,  60,  60}, {  0,   0,   0}, {  0,   0,   0},
+    {236, 238, 236}, {168, 204, 236}, {188, 188, 236}, {212, 178, 236}, {236, 174, 236}, {236, 174, 212}, {236, 180, 176}, {228, 196, 144},
+    {204, 210, 120}, {180, 222, 120}, {168, 226, 144}, {152, 226, 180}, {160, 214, 228}, {160, 162, 160}, {  0,   0,   0}, {  0,   0,   0},
+}};
+
+/*
+    Loads a .pal file of RGB triples. Files with 64 colors are used as they are.
+    Files with 512 colors also carry the emphasized versions, but only the first 64 are used,
+    since emphasis is always applied by dimming the other channels.
+    Returns false if the file cannot be read or has the wrong size.
+*/
+bool loadPalette(NESPalette& palette, const std::string& path) {
+    std::ifstream paletteFile(path, std::ios::ate | std::ios::binary);
+    if (!paletteFile) {
+        std::println(stderr, "Could not open palette file {}.", path);
+        return false;
+    }
+    std::streamoff size = paletteFile.tellg();
+    if (size != 64 * 3 && size != 512 * 3) {
+        std::println(stderr, "Palette file {} is {} bytes, expected 192 or 1536.", path, size);
+        return false;
+    }
+
+    paletteFile.seekg(0);
+    for (std::array<uint8_t, 3>& color : palette) {
+        paletteFile.read(reinterpret_cast<char*>(color.data()), 3);
+    }
+    return static_cast<bool>(paletteFile);
+}
+
+/*
+    Fills in a color table from a palette for one of the supported texture formats:
+    SDL_PIXELFORMAT_RGBA8888, SDL_PIXELFORMAT_ARGB8888, or SDL_PIXELFORMAT_RGB565.
+    Returns false if the format is not supported.
+*/
+bool buildColorTable(ColorTable& table, uint32_t format, const NESPalette& palette /* = DEFAULT_PALETTE */) {
+    if (format != SDL_PIXELFORMAT_RGBA8888 && format != SDL_PIXELFORMAT_ARGB8888 && format != SDL_PIXELFORMAT_RGB565) {
+        return false;
+    }
+    table.format = format;
+    table.bytesPerPixel = format == SDL_PIXELFORMAT_RGB565 ? 2 : 4;
+
+    for (int emphasis = 0; emphasis < 8; emphasis++) {
+        for (int index = 0; index < 64; index++) {
+            // Each emphasis bit (red, green, blue) darkens the other two channels
+            double rgb[3];
+            for (int channel = 0; channel < 3; channel++) {
+                rgb[channel] = palette[index][channel];
+                if (emphasis & ~(1 << channel) & 0x7) {
+                    rgb[channel] *= 0.816328;
+                }
+            }
+            uint32_t r = static_cast<uint32_t>(rgb[0]),
+                     g = static_cast<uint32_t>(rgb[1]),
+                     b = static_cast<uint32_t>(rgb[2]);
+
+            uint32_t color;
+            if (format == SDL_PIXELFORMAT_RGBA8888) {
+                color = (r << 24) | (g << 16) | (b << 8) | 0xff;
+            } else if (format == SDL_PIXELFORMAT_ARGB8888) {
+                color = (0xffu << 24) | (r << 16) | (g << 8) | b;
+            } else {
+                color = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            }
+            table.colors[(emphasis << 6) | index] = color;
+        }
+    }
+    return true;
+}
+
+void convertLine32(const uint8_t* line, const uint32_t* colors, uint32_t* out) {
+    for (int x = 0; x < NES_FRAME_WIDTH; x++) {
+        out[x] = colors[line[x]];
+    }
+}
+
+void convertLine16(const uint8_t* line, const uint32_t* colors, uint16_t* out) {
+    for (int x = 0; x < NES_FRAME_WIDTH; x++) {
+        out[x] = static_cast<uint16_t>(colors[line[x]]);
+    }
+}
+
+#ifdef FRAME_CONVERTER_AVX2
+/*
+    Looks up eight pixels at a time with a single gather from the color table.
+*/
+TARGET_AVX2 void convertLine32AVX2(const uint8_t* line, const uint32_t* colors, uint32_t* out) {
+    for (int x = 0; x < NES_FRAME_WIDTH; x += 8) {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(line + x)));
+        __m256i pixels = _mm256_i32gather_epi32(reinterpret_cast<const int*>(colors), indices, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), pixels);
+    }
+}
+
+TARGET_AVX2 void convertLine16AVX2(const uint8_t* line, const uint32_t* colors, uint16_t* out) {
+    for (int x = 0; x < NES_FRAME_WIDTH; x += 8) {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(line + x)));
+        __m256i pixels = _mm256_i32gather_epi32(reinterpret_cast<const int*>(colors), indices, 4);
+        // Narrow to 16 bits, then gather the low half of each 128-bit lane together
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(pixels, pixels), 0x08);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm256_castsi256_si128(packed));
+    }
+}
+
+bool hasAVX2() {
+    #ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = info[2] & (1 << 27), avx = info[2] & (1 << 28);
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return info[1] & (1 << 5);
+    #else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+    #endif
+}
+#endif
+
+/*
+    Converts a 256x240 frame of palette indices into texture pixels, one row per pitch bytes.
+    Emphasis holds the color emphasis bits of each line.
+    The pixels can be written straight into the buffer returned by SDL_LockTexture.
+*/
+void convertFrame(const uint8_t* frame, const uint8_t* emphasis,
+    const ColorTable& table, void* pixels, int pitch) {
+    auto convert32 = convertLine32;
+    auto convert16 = convertLine16;
+    #ifdef FRAME_CONVERTER_AVX2
+    static const bool avx2 = hasAVX2();
+    if (avx2) {
+        convert32 = convertLine32AVX2;
+        convert16 = convertLine16AVX2;
+    }
+    #endif
+
+    uint8_t* row = static_cast<uint8_t*>(pixels);
+    for (int y = 0; y < NES_FRAME_HEIGHT; y++, row += pitch) {
+        const uint8_t* line = frame + y * NES_FRAME_WIDTH;
+        const uint32_t* colors = &table.colors[(emphasis[y] & 0x7) << 6];
+        if (table.bytesPerPixel == 4) {
+            convert32(line, colors, reinterpret_cast<uint32_t*>(row));
+        } else {
+            convert16(line, colors, reinterpret_cast<uint16_t*>(row));
+        }
+    }
+}
+
+/*
+    Converts a frame of palette indices with the given palette and saves it as a BMP file.
+    This is the only time a screenshot pays for color conversion.
+*/
+bool saveScreenshot(const std::string& path, const uint8_t* frame, const uint8_t* emphasis,
+    const NESPalette& palette /* = DEFAULT_PALETTE */) {
+    ColorTable table;
+    buildColorTable(table, SDL_PIXELFORMAT_ARGB8888, palette);
+
+    SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, NES_FRAME_WIDTH, NES_FRAME_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!surface) {
+        SDL_Log("Unable to create screenshot surface: %s", SDL_GetError());
+        return false;
+    }
+    convertFrame(frame, emphasis, table, surface->pixels, surface->pitch);
+
+    bool saved = SDL_SaveBMP(surface, path.c_str()) == 0;
+    if (!saved) {
+        SDL_Log("Unable to save screenshot %s: %s", path.c_str(), SDL_GetError());
+    }
+    SDL_FreeSurface(surface);
+    return saved;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+
+/*
+    RGB values of the 64 NES colors. Frames stay as palette indices until they are shown or saved,
+    so a different palette can be picked at any time without touching the emulator.
+*/
+using NESPalette = std::array<std::array<uint8_t, 3>, 64>;
+
+extern const NESPalette DEFAULT_PALETTE;
+
+bool loadPalette(NESPalette& palette, const std::string& path);
+
+/*
+    Precomputed texture colors for every palette index under every color emphasis setting.
+    Index a table with (emphasis << 6) | paletteIndex.
+*/
+struct ColorTable {
+    uint32_t format; // SDL pixel format that the colors are packed for
+    int bytesPerPixel;
+    std::array<uint32_t, 8 * 64> colors;
+};
+
+bool buildColorTable(ColorTable& table, uint32_t format, const NESPalette& palette = DEFAULT_PALETTE);
+
+void convertFrame(const uint8_t* frame, const uint8_t* emphasis,
+    const ColorTable& table, void* pixels, int pitch);
+
+bool saveScreenshot(const std::string& path, const uint8_t* frame, const uint8_t* emphasis,
+    const NESPalette& palette = DEFAULT_PALETTE);
@@ -0,0 +1,80 @@
+#include "cheats.h"
+#include <charconv>
+
+namespace {
+    // Each Game Genie letter stands for four bits
+    const std::string_view GAME_GENIE_LETTERS = "APZLGITYEOXUKSVN";
+
+    bool parseHex(std::string_view text, size_t maxDigits, unsigned int& value) {
+        if (text.empty() || text.size() > maxDigits) {
+            return false;
+        }
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value, 16);
+        return error == std::errc() && end == text.data() + text.size();
+    }
+}
+
+/*
+    Decodes a 6 or 8 letter Game Genie code, which patches a byte of PRG-ROM.
+    Eight letter codes also carry a compare value.
+    See https://www.nesdev.org/wiki/Game_Genie for the layout of the bits.
+*/
+std::optional<Cheat> decodeGameGenie(std::string_view code) {
+    if (code.size() != 6 && code.size() != 8) {
+        return std::nullopt;
+    }
+    int n[8] = {};
+    for (size_t i = 0; i < code.size(); i++) {
+        char letter = code[i] >= 'a' && code[i] <= 'z' ? static_cast<char>(code[i] - 'a' + 'A') : code[i];
+        size_t index = GAME_GENIE_LETTERS.find(letter);
+        if (index == std::string_view::npos) {
+            return std::nullopt;
+        }
+        n[i] = static_cast<int>(index);
+    }
+
+    Cheat cheat;
+    cheat.address = static_cast<addr_t>(0x8000 | ((n[3] & 7) << 12) | ((n[5] & 7) << 8) | ((n[4] & 8) << 8)
+        | ((n[2] & 7) << 4) | ((n[1] & 8) << 4) | (n[4] & 7) | (n[3] & 8));
+    if (code.size() == 6) {
+        cheat.value = static_cast<uint8_t>(((n[1] & 7) << 4) | ((n[0] & 8) << 4) | (n[0] & 7) | (n[5] & 8));
+    } else {
+        cheat.value = static_cast<uint8_t>(((n[1] & 7) << 4) | ((n[0] & 8) << 4) | (n[0] & 7) | (n[7] & 8));
+        cheat.compare = ((n[7] & 7) << 4) | ((n[6] & 8) << 4) | (n[6] & 7) | (n[5] & 8);
+    }
+    return cheat;
+}
+
+/*
+    Parses a cheat code: either a Game Genie code, or a raw patch written in hex
+    as address=value, or address?compare=value to only patch over a given byte.
+    Returns nothing if the code is not valid.
+*/
+std::optional<Cheat> parseCheat(std::string_view code) {
+    size_t equals = code.find('=');
+    if (equals == std::string_view::npos) {
+        return decodeGameGenie(code);
+    }
+
+    std::string_view address = code.substr(0, equals), compare;
+    size_t question = address.find('?');
+    if (question != std::string_view::npos) {
+        compare = address.substr(question + 1);
+        address = address.substr(0, question);
+    }
+
+    unsigned int addressValue, value, compareValue;
+    if (!parseHex(address, 4, addressValue) || !parseHex(code.substr(equals + 1), 2, value)) {
+        return std::nullopt;
+    }
+    Cheat cheat;
+    cheat.address = static_cast<addr_t>(addressValue);
+    cheat.value = static_cast<uint8_t>(value);
+    if (question != std::string_view::npos) {
+        if (!parseHex(compare, 2, compareValue)) {
+            return std::nullopt;
+        }
+        cheat.compare = static_cast<int>(compareValue);
+    }
+    return cheat;
+}
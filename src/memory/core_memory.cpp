@@ -4,10 +4,40 @@
 
 /*
     Create a new generic memory object.
+    Mappers pass the size of their register state so that it can be kept in the arena.
+    Until a ROM is attached, there is 8 KB each of PRG-RAM and CHR-RAM.
 */
-CoreMemory::CoreMemory() {
+CoreMemory::CoreMemory(size_t newMapperStateBytes /* = 0 */) {
     ppu = nullptr;
-    PRG_ROM_size = 0;
+    PRG_ROM_size = CHR_ROM_size = 0;
+    mirroring = HORIZONTAL;
+    oamDMAPage = -1;
+    irqStart = NO_IRQ;
+    mapperStateBytes = newMapperStateBytes;
+    layoutMemory(0x2000, 0x2000);
+    #ifdef MEMORY_HEATMAP
+    heatmap = std::make_unique<MemoryHeatmap>();
+    #endif
+}
+
+/*
+    Allocates the arena with exactly the memory this board needs, zeroed.
+    Pages must be mapped again afterwards, since everything moves.
+*/
+void CoreMemory::layoutMemory(size_t PRG_RAM_bytes, size_t CHR_RAM_bytes) {
+    arena.reset();
+    size_t internalRAMOffset = arena.reserve(0x800);
+    size_t ioRegistersOffset = arena.reserve(0x100);
+    mapperStateOffset = arena.reserve(mapperStateBytes);
+    // The battery writer takes its marks on PRG-RAM from the emulation thread, so no other region may share its pages
+    size_t PRG_RAMOffset = arena.reserve(PRG_RAM_bytes, DirtyPages::PAGE_SIZE);
+    size_t CHR_RAMOffset = arena.reserve(CHR_RAM_bytes);
+    arena.allocate();
+
+    internalRAM = arena.data() + internalRAMOffset;
+    ioRegisters = arena.data() + ioRegistersOffset;
+    PRG_RAM = {arena.data() + PRG_RAMOffset, PRG_RAM_bytes};
+    CHR_RAM = {arena.data() + CHR_RAMOffset, CHR_RAM_bytes};
 }
 
 /*
@@ -16,18 +46,138 @@ CoreMemory::CoreMemory() {
 CoreMemory::~CoreMemory() {}
 
 /*
-    Reads two consecutive bytes of data from a given memory address.
-    If wrap is true, the second read wraps to the beginning of the page.
+    Returns the 256 bytes of a CPU memory page if they can be read
+    without side effects, or nullptr if the page holds any registers.
+*/
+const uint8_t* CoreMemory::directPage(uint8_t page) {
+    return (pageFlags[page] & PAGE_IO) ? nullptr : readPages[page];
+}
+
+/*
+    Points count pages starting at firstPage at consecutive 256-byte blocks of data.
+    Data is not used for I/O pages, and may be nullptr for them.
+*/
+void CoreMemory::mapPages(int firstPage, int count, uint8_t* data, uint8_t flags /* = 0 */) {
+    for (int i = 0; i < count; i++) {
+        int page = firstPage + i;
+        uint8_t* block = (flags & PAGE_IO) ? nullptr : data + i * 0x100;
+        pageFlags[page] = flags;
+        readPages[page] = block;
+        writePages[page] = (flags & PAGE_READ_ONLY) ? nullptr : block;
+        if (overlay && overlay->pages[page]) {
+            overlayPage(page);
+        }
+    }
+}
+
+/*
+    Points count pages starting at firstPage at consecutive 256-byte blocks of ROM.
+    Reads come straight from the ROM, while writes go to the mapper's handlers.
 */
-uint16_t CoreMemory::readWord(addr_t address, bool wrap /* =false */) {
-    addr_t addr2 = address + 1;
-    if (wrap) {
-        // Check if second address is on next page
-        if (!(addr2 % 0x100)) {
-            addr2 -= 0x100;
+void CoreMemory::mapROMPages(int firstPage, int count, const uint8_t* data) {
+    for (int i = 0; i < count; i++) {
+        int page = firstPage + i;
+        pageFlags[page] = PAGE_READ_ONLY;
+        readPages[page] = data + i * 0x100;
+        writePages[page] = nullptr;
+        if (overlay && overlay->pages[page]) {
+            overlayPage(page);
         }
     }
-    return (read(addr2) << 8) | read(address); 
+}
+
+/*
+    Maps the parts of CPU memory that are the same on every cartridge:
+    the 2 KB of internal RAM and its mirrors, then the PPU and I/O registers.
+    The expansion area from $4100 to $5FFF is left to the handlers too, since no board here uses it.
+*/
+void CoreMemory::mapInternalPages() {
+    for (int mirror = 0; mirror < 4; mirror++) {
+        mapPages(mirror * 8, 8, internalRAM);
+    }
+    mapPages(0x20, 0x40, nullptr, PAGE_IO);
+}
+
+/*
+    Maps $6000-$7FFF to the first 8 KB of PRG-RAM, or leaves it to the handlers
+    if PRG-RAM is disabled or the board has less than that.
+*/
+void CoreMemory::mapPRGRAM(bool enabled /* = true */) {
+    if (enabled && PRG_RAM.size() >= 0x2000) {
+        mapPages(0x60, 0x20, PRG_RAM.data());
+    } else {
+        mapPages(0x60, 0x20, nullptr, PAGE_IO);
+    }
+}
+
+/*
+    Points a 1 KB pattern table slot at an offset into CHR-ROM,
+    or into CHR-RAM if the board has no CHR-ROM. Offsets wrap around the available memory.
+*/
+void CoreMemory::mapCHRBank(int slot, size_t offset) {
+    if (CHR_ROM.empty()) {
+        ppu->mapCHR(slot, CHR_RAM.data() + offset % CHR_RAM.size(), true);
+    } else {
+        ppu->mapCHR(slot, CHR_ROM.data() + offset % CHR_ROM.size());
+    }
+}
+
+/*
+    Handles the registers every board has: the PPU registers, then the APU and I/O registers.
+    Reads from the unused expansion area return 0.
+*/
+uint8_t CoreMemory::readConsoleIO(addr_t address) {
+    if (address < 0x4000) {
+        return readPPU(mapPPU(address));
+    } else if (address < 0x4100) {
+        return ioRegisters[address & 0xff];
+    }
+    return 0;
+}
+
+/*
+    Returns what readConsoleIO() would, without side effects.
+*/
+uint8_t CoreMemory::peekConsoleIO(addr_t address) {
+    if (address < 0x4000) {
+        return ppu->peekRegister(mapPPU(address));
+    } else if (address < 0x4100) {
+        return ioRegisters[address & 0xff];
+    }
+    return 0;
+}
+
+void CoreMemory::writeConsoleIO(addr_t address, uint8_t data) {
+    if (address < 0x4000) {
+        writePPU(mapPPU(address), data);
+    } else if (address == 0x4014) {
+        requestOAMDMA(data);
+    } else if (address < 0x4100) {
+        ioRegisters[address & 0xff] = data;
+        arena.markDirty(ioRegisters + (address & 0xff));
+    }
+}
+
+/*
+    Clears every byte this console owns: RAM, the I/O and mapper registers, PRG-RAM, and CHR-RAM.
+*/
+void CoreMemory::clearMemory() {
+    arena.clear();
+}
+
+/*
+    Writes a byte of data directly to a memory address, ignoring pre-conditions.
+    This allows RAM and I/O registers to be set up without side effects, such as starting an OAM DMA.
+    Addresses that are not backed by RAM are ignored.
+*/
+void CoreMemory::writeDirect(addr_t address, uint8_t data) {
+    if (uint8_t* page = writePages[address >> 8]) {
+        page[address & 0xff] = data;
+        arena.markDirty(page + (address & 0xff));
+    } else if ((address >> 8) == 0x40) {
+        ioRegisters[address & 0xff] = data;
+        arena.markDirty(ioRegisters + (address & 0xff));
+    }
 }
 
 /*
@@ -55,9 +205,143 @@ void CoreMemory::writePPU(addr_t address, uint8_t data) {
 }
 
 /*
-    Sets the PRG-ROM size (in 16 KB units).
+    Records a write to $4014, which the CPU carries out as an OAM DMA after the current instruction.
 */
-void CoreMemory::set_PRG_ROM_size(uint8_t newPRG_ROM_size) {
-    PRG_ROM_size = newPRG_ROM_size;
+void CoreMemory::requestOAMDMA(uint8_t page) {
+    oamDMAPage = page;
 }
 
+/*
+    Returns the source page of a pending OAM DMA and clears it, or returns -1 if there is none.
+*/
+int CoreMemory::takeOAMDMARequest() {
+    int page = oamDMAPage;
+    oamDMAPage = -1;
+    return page;
+}
+
+/*
+    Points the cartridge at its PRG-ROM and CHR-ROM banks inside a ROM image, without copying them,
+    and sizes the console's memory to match. An empty CHR-ROM means the board uses CHR-RAM.
+    This resets the mapper.
+*/
+void CoreMemory::attachROM(std::shared_ptr<const ROMImage> image,
+    std::span<const uint8_t> newPRG_ROM, std::span<const uint8_t> newCHR_ROM, size_t PRG_RAM_bytes) {
+    romImage = image;
+    PRG_ROM = newPRG_ROM;
+    CHR_ROM = newCHR_ROM;
+    PRG_ROM_size = static_cast<uint8_t>(PRG_ROM.size() / 0x4000);
+    CHR_ROM_size = static_cast<uint8_t>(CHR_ROM.size() / 0x2000);
+    // CHR-RAM is only needed when there is no CHR-ROM
+    layoutMemory(PRG_RAM_bytes, CHR_ROM.empty() ? 0x2000 : 0);
+    // Banks depend on the size, such as a single 16 KB bank being mirrored
+    clear();
+    syncPages();
+}
+
+/*
+    Returns PRG-RAM, which is what a battery keeps when the board has one.
+*/
+std::span<uint8_t> CoreMemory::batteryRAM() {
+    return PRG_RAM;
+}
+
+/*
+    Adds a cheat, which takes effect on the next read. Cheats on the PPU and I/O registers are
+    refused, since reading them has side effects. Returns false if the cheat was refused.
+*/
+bool CoreMemory::addCheat(const Cheat& cheat) {
+    int page = cheat.address >> 8;
+    if (page >= 0x20 && page < 0x60) {
+        return false;
+    }
+    if (!overlay) {
+        overlay = std::make_unique<CheatOverlay>();
+    }
+    overlay->cheats.push_back(cheat);
+    if (!overlay->pages[page]) {
+        overlay->pages[page] = true;
+        overlayPage(page);
+    }
+    return true;
+}
+
+/*
+    Removes every cheat, giving the pages that held them their direct read pointers back.
+*/
+void CoreMemory::clearCheats() {
+    if (!overlay) {
+        return;
+    }
+    for (int page = 0; page < 0x100; page++) {
+        if (overlay->pages[page]) {
+            readPages[page] = overlay->overlaidPages[page];
+            pageFlags[page] &= static_cast<uint8_t>(~PAGE_OVERLAY);
+        }
+    }
+    overlay = nullptr;
+}
+
+/*
+    Moves a page's direct read pointer aside, so that its reads go through the cheats.
+*/
+void CoreMemory::overlayPage(int page) {
+    overlay->overlaidPages[page] = readPages[page];
+    readPages[page] = nullptr;
+    pageFlags[page] |= PAGE_OVERLAY;
+}
+
+/*
+    Returns the byte read at an address with the cheats applied to it.
+    Later cheats on the same address win.
+*/
+uint8_t CoreMemory::applyCheats(addr_t address, uint8_t data) {
+    uint8_t result = data;
+    for (const Cheat& cheat : overlay->cheats) {
+        if (cheat.address == address && (cheat.compare < 0 || cheat.compare == data)) {
+            result = cheat.value;
+        }
+    }
+    return result;
+}
+
+/*
+    Sets the nametable mirroring wired on the cartridge board.
+*/
+void CoreMemory::setMirroring(mirroringMode newMirroring) {
+    mirroring = newMirroring;
+}
+
+/*
+    Copies this console's memory into a snapshot. If the snapshot is current, meaning this
+    console last saved into or restored from it, only the pages written since then are copied.
+    Returns the number of pages copied.
+*/
+size_t CoreMemory::saveSnapshot(MemorySnapshot& snapshot, bool current) {
+    DirtyPages& dirty = arena.dirtyPages();
+    if (!current || snapshot.cartridge.size() != arena.size()) {
+        snapshot.cartridge.resize(arena.size());
+        dirty.markAll();
+    }
+    return dirty.copyMarked(arena.data(), snapshot.cartridge.data(), arena.size());
+}
+
+/*
+    Copies a snapshot back into this console's memory, then maps the banks its registers select
+    and brings the IRQ line in line with them.
+    If the snapshot is current, only the pages written since it was saved are copied back.
+*/
+void CoreMemory::restoreSnapshot(const MemorySnapshot& snapshot, bool current) {
+    if (snapshot.cartridge.size() != arena.size()) {
+        throw std::runtime_error("Snapshot does not match the memory layout of this cartridge!");
+    }
+
+    DirtyPages& dirty = arena.dirtyPages();
+    if (!current) {
+        dirty.markAll();
+    }
+    dirty.copyMarked(snapshot.cartridge.data(), arena.data(), arena.size(), true);
+    syncPages();
+    syncPPU();
+    syncIRQ();
+}
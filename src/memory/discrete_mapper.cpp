@@ -0,0 +1,124 @@
+#include "discrete_mapper.h"
+#include "core_memory.h"
+#include "ppu.h"
+#include "cpu.h"
+#include <algorithm>
+
+template <DiscreteLayout Layout>
+DiscreteMapper<Layout>::DiscreteMapper() : CoreMemory(sizeof(uint8_t)) {
+    clear();
+}
+
+/*
+    Returns the latch, which is kept in the arena with the rest of the console's memory.
+*/
+template <DiscreteLayout Layout>
+uint8_t& DiscreteMapper<Layout>::latch() {
+    return mapperState<uint8_t>();
+}
+
+template <DiscreteLayout Layout>
+uint8_t DiscreteMapper<Layout>::peekLatch() const {
+    return peekMapperState<uint8_t>();
+}
+
+template <DiscreteLayout Layout>
+int DiscreteMapper<Layout>::field(uint8_t value, int shift, int bits) {
+    return (value >> shift) & ((1 << bits) - 1);
+}
+
+template <DiscreteLayout Layout>
+uint8_t DiscreteMapper<Layout>::readIO(addr_t address) {
+    return readConsoleIO(address);
+}
+
+template <DiscreteLayout Layout>
+uint8_t DiscreteMapper<Layout>::peekIO(addr_t address) {
+    return peekConsoleIO(address);
+}
+
+template <DiscreteLayout Layout>
+void DiscreteMapper<Layout>::writeIO(addr_t address, uint8_t data) {
+    if (address < 0x8000) {
+        writeConsoleIO(address, data);
+        return;
+    }
+
+    latch() = data;
+    if constexpr (Layout.prgBits > 0) {
+        syncPRGBanks();
+    }
+    if constexpr (Layout.chrBits > 0 || Layout.nametableBits > 0) {
+        syncPPU();
+    }
+}
+
+/*
+    Points the PPU at the selected 8 KB CHR bank, and sets single-screen mirroring if the board has it.
+*/
+template <DiscreteLayout Layout>
+void DiscreteMapper<Layout>::syncPPU() {
+    int bank = field(peekLatch(), Layout.chrShift, Layout.chrBits);
+    for (int slot = 0; slot < 8; slot++) {
+        mapCHRBank(slot, bank * 0x2000 + slot * 0x400);
+    }
+
+    if constexpr (Layout.nametableBits > 0) {
+        ppu->setMirroring(field(peekLatch(), Layout.nametableShift, Layout.nametableBits) ? SINGLE_UPPER : SINGLE_LOWER);
+    } else {
+        ppu->setMirroring(mirroring);
+    }
+}
+
+template <DiscreteLayout Layout>
+void DiscreteMapper<Layout>::attachCPU(CPU& cpu) {
+    cpu.specialize<DiscreteMapper>();
+}
+
+/*
+    Maps RAM, then the banks selected by the latch.
+*/
+template <DiscreteLayout Layout>
+void DiscreteMapper<Layout>::syncPages() {
+    mapInternalPages();
+    mapPRGRAM();
+    syncPRGBanks();
+}
+
+/*
+    Points both 16 KB halves of $8000-$FFFF at their banks. Bank numbers wrap around the ROM,
+    so a 16 KB ROM on a board with 32 KB banks appears twice.
+*/
+template <DiscreteLayout Layout>
+void DiscreteMapper<Layout>::syncPRGBanks() {
+    if (PRG_ROM.empty()) {
+        // Writes still reach the latch
+        mapPages(0x80, 0x80, nullptr, PAGE_IO);
+        return;
+    }
+
+    int banks = std::max(static_cast<int>(PRG_ROM.size() / 0x4000), 1); // Counted in 16 KB units, and at least one
+    int bank = field(peekLatch(), Layout.prgShift, Layout.prgBits);
+    int lowBank, highBank;
+    if constexpr (Layout.prgBankSize == 0x4000) {
+        lowBank = bank;
+        highBank = banks - 1;
+    } else {
+        lowBank = bank * 2;
+        highBank = bank * 2 + 1;
+    }
+    mapROMPages(0x80, 0x40, PRG_ROM.data() + (lowBank % banks) * 0x4000);
+    mapROMPages(0xc0, 0x40, PRG_ROM.data() + (highBank % banks) * 0x4000);
+}
+
+template <DiscreteLayout Layout>
+void DiscreteMapper<Layout>::clear() {
+    clearMemory(); // Also clears the latch
+    syncPages();
+}
+
+template class DiscreteMapper<UXROM>;
+template class DiscreteMapper<CNROM>;
+template class DiscreteMapper<AXROM>;
+template class DiscreteMapper<GXROM>;
+template class DiscreteMapper<COLOR_DREAMS>;
@@ -0,0 +1,7 @@
+#pragma once
+#include "core_memory.h"
+#include <optional>
+#include <string_view>
+
+std::optional<Cheat> parseCheat(std::string_view code);
+std::optional<Cheat> decodeGameGenie(std::string_view code);
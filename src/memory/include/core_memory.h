@@ -1,6 +1,13 @@
 #pragma once
+#include "memory_arena.h"
+#include "memory_heatmap.h"
+#include <array>
 #include <cstdint>
 #include <memory>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <vector>
 
 using addr_t = uint16_t; // Allows addresses in the 64 KB range
 
@@ -9,10 +16,59 @@ using addr_t = uint16_t; // Allows addresses in the 64 KB range
 using exp_addr_t = uint32_t;
 
 class PPU;
+class CPU;
+class ROMImage;
+
+/*
+    Describes how the four logical nametables map onto the console's VRAM.
+*/
+enum mirroringMode {
+    HORIZONTAL, VERTICAL, SINGLE_LOWER, SINGLE_UPPER, FOUR_SCREEN
+};
+
+/*
+    Flags for a 256-byte page of CPU memory.
+    I/O pages send both reads and writes to the mapper's handlers, since accessing them has side effects.
+    Read-only pages are read directly, but writes go to the handlers, which may treat them as mapper registers.
+    Overlay pages hold at least one cheat, so their reads go through the cheats, whatever is mapped underneath.
+*/
+enum pageFlag : uint8_t {
+    PAGE_IO = 0x1, PAGE_READ_ONLY = 0x2, PAGE_OVERLAY = 0x4
+};
+
+/*
+    A patch to one byte of CPU memory. Reads of the address return the value instead,
+    or only do so while the byte underneath matches the compare value, if there is one.
+*/
+struct Cheat {
+    addr_t address;
+    uint8_t value;
+    int compare = -1; // Byte that must be underneath for the patch to apply, or -1 for any
+};
+
+/*
+    A copy of a console's writable memory: the cartridge's RAM, registers, PRG-RAM, and CHR-RAM,
+    then the PPU's VRAM, OAM, and palette RAM. CPU and PPU registers are not included.
+    Saving into the same snapshot again only copies the pages written since it was last saved
+    or restored, so keeping one per console makes frequent snapshots cheap.
+*/
+struct MemorySnapshot {
+    std::vector<uint8_t> cartridge, video;
+    const void* console = nullptr; // The console that last saved into or restored from it
+    uint64_t generation = 0; // That console's snapshot count at the time
+    size_t pagesCopied = 0; // Pages copied by the last save
+};
 
 /*
     This class is designed to encapsulate memory access to prevent
     simple mistakes with memory mirroring and other easy errors.
+
+    CPU memory is split into 256 pages of 256 bytes. Each page points straight at the bytes
+    behind it, so plain RAM and ROM accesses are a single indexed load. Mappers only
+    repoint pages when they switch banks.
+
+    Accesses can name the concrete mapper type, as in read<Mapper001>(address), so that the
+    I/O handlers are called without virtual dispatch. The default goes through CoreMemory.
 */
 class CoreMemory {
     friend class NES;
@@ -20,25 +76,37 @@ class CoreMemory {
     public:
         virtual ~CoreMemory();
 
-        /*
-            Reads a byte of data from a given memory address.
-        */
-        virtual uint8_t read(addr_t address) = 0;
+        template <class Mapper = CoreMemory, MemoryHeatmap::accessKind Kind = MemoryHeatmap::READ>
+        uint8_t read(addr_t address);
 
+        template <class Mapper = CoreMemory, MemoryHeatmap::accessKind Kind = MemoryHeatmap::READ>
         uint16_t readWord(addr_t address, bool wrap=false);
 
+        uint8_t peek(addr_t address);
+        uint16_t peekWord(addr_t address);
+
+        void writeDirect(addr_t address, uint8_t data);
+
+        template <class Mapper = CoreMemory>
+        void write(addr_t address, uint8_t data);
+
         /*
-            Writes a byte of data directly to a memory address, ignoring
-            pre-conditions. This allows initial writing of the ROM data.
-            The first argument needs to be large enough to address the full
-            range of the larger mappers.
+            Points the PPU at the currently selected CHR banks and nametable layout.
+            Mappers call this again whenever a register write changes either one.
         */
-        virtual void writeDirect(exp_addr_t address, uint8_t data) = 0;
+        virtual void syncPPU() = 0;
+
+        const uint8_t* directPage(uint8_t page);
 
         /*
-            Writes a byte of data to a given memory address.
+            Points the CPU at the instruction path compiled for this mapper type.
         */
-        virtual void write(addr_t address, uint8_t data) = 0;
+        virtual void attachCPU(CPU& cpu) = 0;
+
+        int takeOAMDMARequest();
+
+        static const uint64_t NO_IRQ = UINT64_MAX;
+        uint64_t irqDot() const;
 
         addr_t mapPPU(addr_t address);
 
@@ -51,12 +119,270 @@ class CoreMemory {
         */
         virtual void clear() = 0;
         
-        void set_PRG_ROM_size(uint8_t PRG_ROM_size);
+        void attachROM(std::shared_ptr<const ROMImage> image,
+            std::span<const uint8_t> PRG_ROM, std::span<const uint8_t> CHR_ROM, size_t PRG_RAM_bytes);
+
+        void setMirroring(mirroringMode mirroring);
+
+        std::span<uint8_t> batteryRAM();
+
+        bool addCheat(const Cheat& cheat);
+        void clearCheats();
+
+        MemoryHeatmap* accessHeatmap();
+
+        void markWritten(const uint8_t* byte);
+        size_t saveSnapshot(MemorySnapshot& snapshot, bool current);
+        void restoreSnapshot(const MemorySnapshot& snapshot, bool current);
 
     protected:
         std::shared_ptr<PPU> ppu;
 
-        CoreMemory();
-        
-        uint8_t PRG_ROM_size;
+        CoreMemory(size_t mapperStateBytes = 0);
+
+        /*
+            Handle reads from I/O pages, and writes to I/O and read-only pages.
+        */
+        virtual uint8_t readIO(addr_t address) = 0;
+        virtual void writeIO(addr_t address, uint8_t data) = 0;
+
+        /*
+            Returns what readIO() would, without any of its side effects.
+        */
+        virtual uint8_t peekIO(addr_t address) = 0;
+
+        /*
+            Points every page at the currently selected banks.
+            Mappers call this again whenever a register write switches PRG banks.
+        */
+        virtual void syncPages() = 0;
+
+        /*
+            Works out irqDot() again once a snapshot has brought back the registers it depends on.
+            Boards without an IRQ have nothing to do.
+        */
+        virtual void syncIRQ() {}
+
+        void mapPages(int firstPage, int count, uint8_t* data, uint8_t flags = 0);
+        void mapROMPages(int firstPage, int count, const uint8_t* data);
+        void mapInternalPages();
+        void mapPRGRAM(bool enabled = true);
+        void mapCHRBank(int slot, size_t offset);
+        uint8_t readConsoleIO(addr_t address);
+        uint8_t peekConsoleIO(addr_t address);
+        void writeConsoleIO(addr_t address, uint8_t data);
+        void clearMemory();
+        void requestOAMDMA(uint8_t page);
+
+        template <class State>
+        State& mapperState();
+        template <class State>
+        const State& peekMapperState() const;
+
+        /*
+            Memory owned by this console, which all lives in one arena. The ROM image is shared
+            with every other console running the same game, so only RAM and registers are kept per instance.
+        */
+        uint8_t* internalRAM;
+        uint8_t* ioRegisters; // Last values written to $4000-$40FF
+        std::span<uint8_t> PRG_RAM;
+        std::span<uint8_t> CHR_RAM; // Empty if the board has CHR-ROM
+
+        // Banks inside the ROM image, which mappers point at directly
+        std::span<const uint8_t> PRG_ROM, CHR_ROM;
+        uint8_t PRG_ROM_size, CHR_ROM_size;
+        mirroringMode mirroring;
+        int oamDMAPage; // Source page of a pending OAM DMA, or -1 if there is none
+        uint64_t irqStart; // See irqDot(). Mappers with an IRQ also keep it in their registers
+
+    private:
+        // Direct pointers to each page, or nullptr where the handlers must be used instead
+        std::array<const uint8_t*, 0x100> readPages {};
+        std::array<uint8_t*, 0x100> writePages {};
+        std::array<uint8_t, 0x100> pageFlags {};
+
+        std::shared_ptr<const ROMImage> romImage; // Keeps the banks valid
+
+        /*
+            Cheats only cost anything on the pages that hold them. Those pages have no direct read pointer,
+            so reads fall through to the overlay, which patches whatever byte is mapped underneath.
+            Mapping a bank over a cheat page keeps it overlaid, so compare values are checked against the new bank.
+            This is only allocated once a cheat is added.
+        */
+        struct CheatOverlay {
+            std::vector<Cheat> cheats;
+            std::array<bool, 0x100> pages {};
+            std::array<const uint8_t*, 0x100> overlaidPages {}; // What readPages would hold without the overlay
+        };
+        std::unique_ptr<CheatOverlay> overlay;
+
+        void overlayPage(int page);
+        uint8_t applyCheats(addr_t address, uint8_t data);
+        template <class Mapper>
+        uint8_t readOverlay(addr_t address);
+
+        MemoryArena arena;
+        size_t mapperStateOffset, mapperStateBytes;
+
+        #ifdef MEMORY_HEATMAP
+        std::unique_ptr<MemoryHeatmap> heatmap;
+        #endif
+
+        void layoutMemory(size_t PRG_RAM_bytes, size_t CHR_RAM_bytes);
 };
+
+/*
+    Returns the mapper's registers, which are kept in the arena with the rest of the console's memory.
+    The state must be a plain struct that is no bigger than the size passed to the constructor.
+*/
+template <class State>
+inline State& CoreMemory::mapperState() {
+    static_assert(std::is_trivially_copyable_v<State> && alignof(State) <= MemoryArena::ALIGNMENT);
+    // Mappers only ask for their registers to change them, or just before they do
+    arena.dirtyPages().mark(mapperStateOffset, sizeof(State));
+    return *std::launder(reinterpret_cast<State*>(arena.data() + mapperStateOffset));
+}
+
+/*
+    Returns the mapper's registers without marking them as changed, for code that only reads them.
+*/
+template <class State>
+inline const State& CoreMemory::peekMapperState() const {
+    static_assert(std::is_trivially_copyable_v<State> && alignof(State) <= MemoryArena::ALIGNMENT);
+    return *std::launder(reinterpret_cast<const State*>(arena.data() + mapperStateOffset));
+}
+
+/*
+    Returns the PPU dot (counted like PPUClock::cyclesExecuted) from which the cartridge holds
+    the IRQ line low, or NO_IRQ. Mappers work this out ahead of time from their counters,
+    so the CPU only has to compare it against the clock between instructions.
+*/
+inline uint64_t CoreMemory::irqDot() const {
+    return irqStart;
+}
+
+/*
+    Returns the counts of this console's memory accesses,
+    or nullptr unless the MEMORY_HEATMAP build option is on.
+*/
+inline MemoryHeatmap* CoreMemory::accessHeatmap() {
+    #ifdef MEMORY_HEATMAP
+    return heatmap.get();
+    #else
+    return nullptr;
+    #endif
+}
+
+/*
+    Reads a byte of data from a given memory address.
+    The CPU reads its instructions as FETCH accesses, which only matters to the heatmap.
+*/
+template <class Mapper /* = CoreMemory */, MemoryHeatmap::accessKind Kind /* = MemoryHeatmap::READ */>
+inline uint8_t CoreMemory::read(addr_t address) {
+    if constexpr (MemoryHeatmap::ENABLED) {
+        accessHeatmap()->count(Kind, address);
+    }
+    if (const uint8_t* page = readPages[address >> 8]) {
+        return page[address & 0xff];
+    }
+    if (pageFlags[address >> 8] & PAGE_OVERLAY) {
+        return readOverlay<Mapper>(address);
+    }
+    if constexpr (std::is_same_v<Mapper, CoreMemory>) {
+        return readIO(address);
+    } else {
+        // A qualified call skips the virtual dispatch
+        return static_cast<Mapper*>(this)->Mapper::readIO(address);
+    }
+}
+
+/*
+    Reads a byte from a page with cheats, patching the byte mapped underneath.
+*/
+template <class Mapper>
+uint8_t CoreMemory::readOverlay(addr_t address) {
+    uint8_t data;
+    if (const uint8_t* page = overlay->overlaidPages[address >> 8]) {
+        data = page[address & 0xff];
+    } else if constexpr (std::is_same_v<Mapper, CoreMemory>) {
+        data = readIO(address);
+    } else {
+        data = static_cast<Mapper*>(this)->Mapper::readIO(address);
+    }
+    return applyCheats(address, data);
+}
+
+/*
+    Reads a byte of data for a debugger or tracer. Unlike read(), this never has side effects,
+    such as clearing vblank, and never makes the PPU catch up, so observing the console
+    cannot change what it does.
+*/
+inline uint8_t CoreMemory::peek(addr_t address) {
+    if (const uint8_t* page = readPages[address >> 8]) {
+        return page[address & 0xff];
+    }
+    if (pageFlags[address >> 8] & PAGE_OVERLAY) {
+        const uint8_t* overlaid = overlay->overlaidPages[address >> 8];
+        return applyCheats(address, overlaid ? overlaid[address & 0xff] : peekIO(address));
+    }
+    return peekIO(address);
+}
+
+/*
+    Reads two consecutive bytes of data like peek().
+*/
+inline uint16_t CoreMemory::peekWord(addr_t address) {
+    return static_cast<uint16_t>((peek(static_cast<addr_t>(address + 1)) << 8) | peek(address));
+}
+
+/*
+    Reads two consecutive bytes of data from a given memory address.
+    If wrap is true, the second read wraps to the beginning of the page.
+*/
+template <class Mapper /* = CoreMemory */, MemoryHeatmap::accessKind Kind /* = MemoryHeatmap::READ */>
+inline uint16_t CoreMemory::readWord(addr_t address, bool wrap /* =false */) {
+    const uint8_t* page = readPages[address >> 8];
+    if (page && (address & 0xff) != 0xff) {
+        // Both bytes are on the same plain page
+        if constexpr (MemoryHeatmap::ENABLED) {
+            accessHeatmap()->count(Kind, address);
+            accessHeatmap()->count(Kind, static_cast<addr_t>(address + 1));
+        }
+        return (page[(address & 0xff) + 1] << 8) | page[address & 0xff];
+    }
+
+    addr_t addr2 = address + 1;
+    if (wrap) {
+        // Check if second address is on next page
+        if (!(addr2 % 0x100)) {
+            addr2 -= 0x100;
+        }
+    }
+    return (read<Mapper, Kind>(addr2) << 8) | read<Mapper, Kind>(address);
+}
+
+/*
+    Marks a byte of this console's memory as written since the last snapshot.
+    The PPU calls this for CHR-RAM, which it writes itself.
+*/
+inline void CoreMemory::markWritten(const uint8_t* byte) {
+    arena.markDirty(byte);
+}
+
+/*
+    Writes a byte of data to a given memory address.
+*/
+template <class Mapper /* = CoreMemory */>
+inline void CoreMemory::write(addr_t address, uint8_t data) {
+    if constexpr (MemoryHeatmap::ENABLED) {
+        accessHeatmap()->count(MemoryHeatmap::WRITE, address);
+    }
+    if (uint8_t* page = writePages[address >> 8]) {
+        page[address & 0xff] = data;
+        arena.markDirty(page + (address & 0xff));
+    } else if constexpr (std::is_same_v<Mapper, CoreMemory>) {
+        writeIO(address, data);
+    } else {
+        static_cast<Mapper*>(this)->Mapper::writeIO(address, data);
+    }
+}
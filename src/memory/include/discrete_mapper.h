@@ -0,0 +1,56 @@
+#pragma once
+#include "core_memory.h"
+
+/*
+    Describes a discrete-logic board, which has a single latch written anywhere in $8000-$FFFF.
+    Each field of the latch is given by its lowest bit and its width in bits, where a width of 0
+    means the board has no such field.
+*/
+struct DiscreteLayout {
+    // Switchable PRG-ROM bank. 16 KB banks are switched at $8000 with the last bank fixed at $C000,
+    // while 32 KB banks cover all of $8000-$FFFF
+    int prgShift, prgBits, prgBankSize;
+    // Switchable 8 KB CHR bank
+    int chrShift, chrBits;
+    // Selects a single-screen nametable, instead of the mirroring wired on the board
+    int nametableShift, nametableBits;
+};
+
+constexpr DiscreteLayout UXROM       {0, 4, 0x4000, 0, 0, 0, 0};
+constexpr DiscreteLayout CNROM       {0, 0, 0x8000, 0, 2, 0, 0};
+constexpr DiscreteLayout AXROM       {0, 3, 0x8000, 0, 0, 4, 1};
+constexpr DiscreteLayout GXROM       {4, 2, 0x8000, 0, 2, 0, 0};
+constexpr DiscreteLayout COLOR_DREAMS{0, 2, 0x8000, 4, 4, 0, 0};
+
+/*
+    A mapper generated from a board layout. Writing the latch repoints the page table
+    and the CHR slots, so reads take the same direct path as every other mapper.
+*/
+template <DiscreteLayout Layout>
+class DiscreteMapper final : public CoreMemory {
+    friend class CoreMemory;
+
+    public:
+        DiscreteMapper();
+        void syncPPU();
+        void attachCPU(CPU& cpu);
+        void clear();
+
+    protected:
+        uint8_t readIO(addr_t address);
+        uint8_t peekIO(addr_t address);
+        void writeIO(addr_t address, uint8_t data);
+        void syncPages();
+
+    private:
+        uint8_t& latch();
+        uint8_t peekLatch() const;
+        void syncPRGBanks();
+        static int field(uint8_t value, int shift, int bits);
+};
+
+using Mapper002 = DiscreteMapper<UXROM>;
+using Mapper003 = DiscreteMapper<CNROM>;
+using Mapper007 = DiscreteMapper<AXROM>;
+using Mapper011 = DiscreteMapper<COLOR_DREAMS>;
+using Mapper066 = DiscreteMapper<GXROM>;
@@ -1,15 +1,21 @@
 #pragma once
 #include "core_memory.h"
 
-class Mapper000 : public CoreMemory {
+class Mapper000 final : public CoreMemory {
+    friend class CoreMemory;
+
     public:
         Mapper000();
-        uint8_t read(addr_t address);
-        void writeDirect(exp_addr_t address, uint8_t data);
-        void write(addr_t address, uint8_t data);
+        void syncPPU();
+        void attachCPU(CPU& cpu);
         void clear();
 
+    protected:
+        uint8_t readIO(addr_t address);
+        uint8_t peekIO(addr_t address);
+        void writeIO(addr_t address, uint8_t data);
+        void syncPages();
+
     private:
-        uint8_t memory[0x10000];
         addr_t mapAddress(addr_t address);
 };
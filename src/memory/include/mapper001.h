@@ -1,20 +1,30 @@
 #pragma once
 #include "core_memory.h"
-#include <array>
 
-class Mapper001 : public CoreMemory {
+class Mapper001 final : public CoreMemory {
+    friend class CoreMemory;
+
     public:
         Mapper001();
-        uint8_t read(addr_t address);
-        void writeDirect(exp_addr_t address, uint8_t data);
-        void write(addr_t address, uint8_t data);
+        void syncPPU();
+        void attachCPU(CPU& cpu);
         void clear();
 
+    protected:
+        uint8_t readIO(addr_t address);
+        uint8_t peekIO(addr_t address);
+        void writeIO(addr_t address, uint8_t data);
+        void syncPages();
+
     private:
-        std::array<uint8_t, 0x48000> memory;
-        uint8_t shiftReg, controlReg,
-            chrReg0, chrReg1, prgReg;
+        // Kept in the arena with the rest of the console's memory
+        struct Registers {
+            uint8_t shift, control, chr0, chr1, prg;
+        };
+
+        Registers& registers();
+        const Registers& peekRegisters() const;
 
-        exp_addr_t mapAddress(exp_addr_t address);
+        void syncPRGBanks();
         void resetShift();
 };
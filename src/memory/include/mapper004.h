@@ -0,0 +1,50 @@
+#pragma once
+#include "core_memory.h"
+
+/*
+    MMC3 (TxROM boards), with 8 KB PRG-ROM banks, 1 KB and 2 KB CHR banks, and a scanline IRQ counter.
+
+    The IRQ counter is clocked by rising edges of PPU address line A12, which happen at fixed dots
+    of each rendered line. Rather than watching the PPU fetch, the edges that have gone by are
+    counted from the clock whenever the counter matters, and the dot of the next IRQ is worked out
+    ahead of time. Nothing is done per scanline unless the game touches the mapper or PPUCTRL/PPUMASK.
+*/
+class Mapper004 final : public CoreMemory {
+    friend class CoreMemory;
+
+    public:
+        Mapper004();
+        void syncPPU();
+        void attachCPU(CPU& cpu);
+        void clear();
+
+    protected:
+        uint8_t readIO(addr_t address);
+        uint8_t peekIO(addr_t address);
+        void writeIO(addr_t address, uint8_t data);
+        void syncPages();
+        void syncIRQ();
+
+    private:
+        // Kept in the arena with the rest of the console's memory
+        struct Registers {
+            uint64_t countedDot; // Dot up to which A12 edges have been applied to the counter
+            uint64_t irqStart; // Copy of CoreMemory::irqStart, so a pending IRQ survives a snapshot
+            uint8_t bankSelect, mirroring, irqLatch, irqCounter;
+            uint8_t ppuCtrl, ppuMask; // Copies of the PPU registers that decide when A12 rises
+            bool irqReload, irqEnabled;
+            uint8_t banks[8];
+        };
+
+        Registers& registers();
+        const Registers& peekRegisters() const;
+        void syncPRGBanks();
+
+        int edgeDot();
+        int edgeLines();
+        uint64_t edgesBefore(uint64_t dot);
+        uint64_t edgeAt(uint64_t edge);
+        uint64_t currentDot();
+        void clockCounter();
+        void predictIRQ();
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+    Marks which 256-byte pages of a block of memory have been written since they were last copied,
+    so that a copy of the block can be brought up to date by copying only those pages.
+    Each page gets a byte rather than a bit, so that the CPU and PPU threads can mark
+    different pages of the same block without sharing a word.
+    The byte holds a mark for each reader of the map, so snapshots and the battery writer
+    each see every page written since they last took their marks.
+*/
+class DirtyPages {
+    public:
+        static const size_t PAGE_SIZE = 0x100;
+        enum reader : uint8_t { SNAPSHOT = 1, BATTERY = 2, ALL_READERS = SNAPSHOT | BATTERY };
+
+        void resize(size_t bytes);
+        void mark(size_t offset);
+        void mark(size_t offset, size_t bytes);
+        void markAll();
+        bool take(size_t offset, reader marker);
+        size_t copyMarked(const uint8_t* source, uint8_t* target, size_t bytes, bool restoring = false);
+
+    private:
+        std::vector<uint8_t> pages;
+};
+
+inline void DirtyPages::mark(size_t offset) {
+    pages[offset / PAGE_SIZE] = ALL_READERS;
+}
+
+/*
+    A single cache-aligned block holding all of a console's mutable memory.
+    Regions are reserved first and then allocated together, so creating, clearing,
+    copying, and freeing a console's state each touch one block.
+    Writes are marked in a page map, so that snapshots only copy what changed.
+*/
+class MemoryArena {
+    public:
+        static const size_t ALIGNMENT = 64; // Size of a cache line
+
+        MemoryArena();
+        ~MemoryArena();
+
+        void reset();
+        size_t reserve(size_t bytes, size_t alignment = ALIGNMENT);
+        void allocate();
+        void clear();
+        void markDirty(const uint8_t* byte);
+
+        uint8_t* data();
+        const uint8_t* data() const;
+        size_t size() const;
+        DirtyPages& dirtyPages();
+
+    private:
+        uint8_t* block;
+        size_t reserved, allocated;
+        DirtyPages dirty;
+
+        MemoryArena(const MemoryArena&) = delete;
+        MemoryArena& operator=(const MemoryArena&) = delete;
+};
+
+/*
+    Marks the page holding a byte of the block as written.
+    A byte outside the block is a caller's bug, and is ignored rather than marking past the page map.
+*/
+inline void MemoryArena::markDirty(const uint8_t* byte) {
+    size_t offset = reinterpret_cast<uintptr_t>(byte) - reinterpret_cast<uintptr_t>(block);
+    assert(offset < allocated);
+    if (offset < allocated) {
+        dirty.mark(offset);
+    }
+}
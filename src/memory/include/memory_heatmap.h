@@ -0,0 +1,48 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+
+/*
+    Counts the CPU's reads, writes, and instruction fetches at every address, for finding
+    which parts of a game's memory are hot and where it polls I/O.
+    Counting is only compiled in when the MEMORY_HEATMAP build option is on. Otherwise every
+    counting site is discarded by `if constexpr`, and consoles do not carry a heatmap at all.
+
+    Counts are kept for the frame in progress, the last whole frame, and every frame so far.
+    A new frame starts whenever the PPU does.
+*/
+class MemoryHeatmap {
+    public:
+        #ifdef MEMORY_HEATMAP
+        static constexpr bool ENABLED = true;
+        #else
+        static constexpr bool ENABLED = false;
+        #endif
+
+        enum accessKind {
+            READ, WRITE, FETCH, ACCESS_KINDS
+        };
+
+        MemoryHeatmap();
+
+        void count(accessKind kind, uint16_t address);
+        void startFrame(int frame);
+
+        uint64_t total(accessKind kind, uint16_t address) const;
+        uint32_t lastFrame(accessKind kind, uint16_t address) const;
+
+        bool exportCSV(const std::string& path, bool cumulative, bool perPage) const;
+        bool exportBinary(const std::string& path, bool cumulative, bool perPage) const;
+
+    private:
+        uint64_t countAt(accessKind kind, int index, bool cumulative, bool perPage) const;
+
+        std::array<std::array<uint32_t, 0x10000>, ACCESS_KINDS> currentCounts {}, lastFrameCounts {};
+        std::array<std::array<uint64_t, 0x10000>, ACCESS_KINDS> totalCounts {};
+        int frame;
+};
+
+inline void MemoryHeatmap::count(accessKind kind, uint16_t address) {
+    currentCounts[kind][address]++;
+}
@@ -1,36 +1,61 @@
 #include "mapper000.h"
 #include "core_memory.h"
-#include <cstring>
+#include "ppu.h"
+#include "cpu.h"
 
 Mapper000::Mapper000() {
     clear();
+    syncPages();
 }
 
-uint8_t Mapper000::read(addr_t address) {
-    if (0x2000 <= address && address < 0x4000) {
-        return readPPU(mapPPU(address));
+uint8_t Mapper000::readIO(addr_t address) {
+    return readConsoleIO(address);
+}
+
+uint8_t Mapper000::peekIO(addr_t address) {
+    return peekConsoleIO(address);
+}
+
+
+void Mapper000::writeIO(addr_t address, uint8_t data) {
+    writeConsoleIO(address, data);
+    // PRG-ROM cannot be written
+}
+
+
+void Mapper000::syncPPU() {
+    // There is a single fixed 8 KB CHR bank, which is CHR-RAM if the cartridge has no CHR-ROM
+    for (int slot = 0; slot < 8; slot++) {
+        mapCHRBank(slot, slot * 0x400);
     }
-    return memory[mapAddress(address)];
+    ppu->setMirroring(mirroring);
 }
 
 
-void Mapper000::writeDirect(exp_addr_t address, uint8_t data) {
-    memory[address] = data;
+void Mapper000::attachCPU(CPU& cpu) {
+    cpu.specialize<Mapper000>();
 }
 
 
-void Mapper000::write(addr_t address, uint8_t data) {
-    if (0x2000 <= address && address < 0x4000) {
-        writePPU(mapPPU(address), data);
-    } else {
-        // TODO: Prevent writing into ROM space?
-        memory[mapAddress(address)] = data;
+/*
+    Maps RAM and PRG-ROM, which never change on this board once the PRG-ROM size is known.
+*/
+void Mapper000::syncPages() {
+    mapInternalPages();
+    mapPRGRAM();
+    if (PRG_ROM.empty()) {
+        mapPages(0x80, 0x80, nullptr, PAGE_IO);
+        return;
+    }
+    // Mirroring never splits a page, so each page is contiguous
+    for (int page = 0x80; page < 0x100; page++) {
+        mapROMPages(page, 1, PRG_ROM.data() + mapAddress(static_cast<addr_t>(page << 8)) - 0x8000);
     }
 }
 
 
 void Mapper000::clear() {
-    memset(memory, 0, sizeof(memory)); // Set array elements to zero
+    clearMemory();
 }
 
 /*
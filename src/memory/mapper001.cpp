@@ -1,105 +1,155 @@
 #include "mapper001.h"
 #include "core_memory.h"
+#include "ppu.h"
+#include "cpu.h"
+#include <algorithm>
 
-Mapper001::Mapper001() {
+Mapper001::Mapper001() : CoreMemory(sizeof(Registers)) {
     clear();
 }
 
-uint8_t Mapper001::read(addr_t address) {
-    if (0x2000 <= address && address < 0x4000) {
-        return readPPU(mapPPU(address));
-    }
-    return memory[mapAddress(address)];
+Mapper001::Registers& Mapper001::registers() {
+    return mapperState<Registers>();
 }
 
+const Mapper001::Registers& Mapper001::peekRegisters() const {
+    return peekMapperState<Registers>();
+}
 
-void Mapper001::writeDirect(exp_addr_t address, uint8_t data) {
-    memory[address] = data;
+uint8_t Mapper001::readIO(addr_t address) {
+    return readConsoleIO(address);
 }
 
+uint8_t Mapper001::peekIO(addr_t address) {
+    return peekConsoleIO(address);
+}
 
-void Mapper001::write(addr_t address, uint8_t data) {
-    if (0x2000 <= address && address < 0x4000) {
-        writePPU(mapPPU(address), data);
-    } else if (address >= 0x8000) {
+
+void Mapper001::writeIO(addr_t address, uint8_t data) {
+    Registers& regs = registers();
+    if (address >= 0x8000) {
         // We are trying to write to PRG-ROM, so we intercept this
         // Instead, it modifies a shift register
         if (data & 0x80) {
             // Bit 7 is set, reset shift and control registers
             resetShift();
-            controlReg |= 0x0c;
+            regs.control |= 0x0c;
+            syncPRGBanks(); // Switches to fixing the last bank
         } else {
             // Bit 7 not set, we push to the shift register
-            bool lowBit = shiftReg & 1;
-            shiftReg = (shiftReg >> 1) | ((data & 1) << 4);
+            bool lowBit = regs.shift & 1;
+            regs.shift = (regs.shift >> 1) | ((data & 1) << 4);
             if (lowBit) {
                 // The low bit was set, so the shift register is full
                 int regId = (address & 0x6000) >> 13;
-                uint8_t* registers[] = {&controlReg, &chrReg0, &chrReg1, &prgReg};
-                *registers[regId] = shiftReg;
+                uint8_t* targets[] = {&regs.control, &regs.chr0, &regs.chr1, &regs.prg};
+                *targets[regId] = regs.shift;
                 resetShift();
+                if (regId < 3) {
+                    // Mirroring and CHR banks may have changed
+                    syncPPU();
+                }
+                if (regId == 0 || regId == 3) {
+                    // PRG banks or the PRG-RAM enable bit may have changed
+                    syncPRGBanks();
+                }
             }
         }
     } else {
-        // TODO: Prevent writing into ROM space?
-        memory[mapAddress(address)] = data;
+        writeConsoleIO(address, data);
     }
 }
 
-void Mapper001::resetShift() {
-    shiftReg = 0x10; // Reset shift register
+/*
+    Points the PPU at the selected CHR banks and sets the mirroring from the control register.
+*/
+void Mapper001::syncPPU() {
+    const Registers& regs = peekRegisters();
+    static const mirroringMode mirroringModes[] = {SINGLE_LOWER, SINGLE_UPPER, VERTICAL, HORIZONTAL};
+    ppu->setMirroring(mirroringModes[regs.control & 0x3]);
+
+    // Boards without CHR-ROM have a single 8 KB bank of CHR-RAM
+    int chrBanks = CHR_ROM_size ? CHR_ROM_size * 2 : 2; // Counted in 4 KB units
+    int lowBank, highBank;
+    if (regs.control & 0x10) {
+        // Two separately switchable 4 KB banks
+        lowBank = regs.chr0;
+        highBank = regs.chr1;
+    } else {
+        // One 8 KB bank, ignoring the low bit of the bank number
+        lowBank = regs.chr0 & 0x1e;
+        highBank = lowBank | 1;
+    }
+    lowBank %= chrBanks;
+    highBank %= chrBanks;
+
+    for (int slot = 0; slot < 4; slot++) {
+        mapCHRBank(slot, lowBank * 0x1000 + slot * 0x400);
+        mapCHRBank(slot + 4, highBank * 0x1000 + slot * 0x400);
+    }
 }
 
+void Mapper001::attachCPU(CPU& cpu) {
+    cpu.specialize<Mapper001>();
+}
 
-void Mapper001::clear() {
-    memory.fill(0); // Set array elements to zero
-    controlReg = 0x0c; // Reset control register
-    chrReg0 = chrReg1 = prgReg = 0; // Clear ROM registers
-    resetShift();
+/*
+    Maps RAM, then the banks selected by the registers.
+*/
+void Mapper001::syncPages() {
+    mapInternalPages();
+    syncPRGBanks();
 }
 
 /*
-    Maps an address in the 64 KB addressable range to the proper location in memory.
+    Works out the two 16 KB PRG-ROM banks from the control and PRG registers, and points
+    the PRG-ROM pages at them, so reads are just a page pointer plus an offset until the next switch.
+    Writes to PRG-ROM go to the shift register instead.
+
+    PRG banking modes (bits 2-3 of the control register):
+    0, 1: One switchable 32 KB bank, ignoring the low bit of the bank number
+    2: First bank fixed at $8000, 16 KB bank switchable at $C000
+    3: 16 KB bank switchable at $8000, last bank fixed at $C000
+
+    Bit 4 of the PRG register disables PRG-RAM, after which reads return 0 and writes are dropped.
 */
-exp_addr_t Mapper001::mapAddress(exp_addr_t address) {
-    // By implicitly promoting the argument, it can now address the full memory range
-    // addr_t orig = address;
-    if (address < 0x2000) {
-        address %= 0x800;
-    } else if (address < 0x4000) {
-        address = (address % 0x8) + 0x2000;
-    } else if (address >= 0x8000) {
-        // This is where we access PRG-ROM
-        // Figure out which PRG-ROM bank mode we are using
-        // 0, 1 are 32 KB switchable
-        // 2 is fixed at first and 16 KB switchable
-        // 3 is 16 KB switchable and fixed at last
-        int prgMode = (controlReg >> 2) & 3;
-        // Figure out the index of the switchable bank
-        int bankIndex = prgReg & 15;
-
-        if (prgMode < 2) {
-            // Switchable 32 KB bank
-            address += (bankIndex >> 1) * 0x8000;
-        } else if (address < 0xc000) {
-            // We are in 0x8000 to 0xbfff
-            // If prgMode == 2, we do nothing; the address is already correct
-            if (prgMode == 3) {
-                // Switchable 16 KB bank
-                address += bankIndex * 0x4000;
-            }
-        } else if (prgMode == 3) {
-            // We are in 0xc000 to 0xffff
-            // Fixed to last bank
-            // We subtract two from PRG_ROM_size to get the right index here - consider if it is one
-            address += (PRG_ROM_size - 2) * 0x4000;
-        } else {
-            // We are in 0xc000 to 0xffff
-            // Switchable 16 KB bank
-            address += (bankIndex - 1) * 0x4000;
-        }
+void Mapper001::syncPRGBanks() {
+    const Registers& regs = peekRegisters();
+    mapPRGRAM(!(regs.prg & 0x10));
+
+    if (PRG_ROM.empty()) {
+        // Writes still reach the shift register
+        mapPages(0x80, 0x80, nullptr, PAGE_IO);
+        return;
+    }
+
+    int prgMode = (regs.control >> 2) & 3;
+    int bank = regs.prg & 0xf;
+    int banks = std::max(static_cast<int>(PRG_ROM.size() / 0x4000), 1); // Never zero, since it divides the bank numbers
+    int lowBank, highBank;
+    if (prgMode < 2) {
+        lowBank = bank & 0xe;
+        highBank = lowBank | 1;
+    } else if (prgMode == 2) {
+        lowBank = 0;
+        highBank = bank;
+    } else {
+        lowBank = bank;
+        highBank = banks - 1;
+    }
 
-        // std::cout << "Mapped " << std::hex << orig << " to " << address << " with prgmd " << prgMode << " ctrlrg " << (int)controlReg << std::dec << " bankInd " << bankIndex << " prgromsize " << (int)PRG_ROM_size << std::endl;
-    } 
-    return address;
+    mapROMPages(0x80, 0x40, PRG_ROM.data() + (lowBank % banks) * 0x4000);
+    mapROMPages(0xc0, 0x40, PRG_ROM.data() + (highBank % banks) * 0x4000);
+}
+
+void Mapper001::resetShift() {
+    registers().shift = 0x10; // Reset shift register
+}
+
+
+void Mapper001::clear() {
+    clearMemory(); // Also clears the ROM registers
+    registers().control = 0x0c; // Reset control register
+    resetShift();
+    syncPages();
 }
@@ -0,0 +1,283 @@
+#include "mapper004.h"
+#include "core_memory.h"
+#include "ppu.h"
+#include "cpu.h"
+#include <algorithm>
+
+namespace {
+    const uint64_t DOTS_PER_LINE = 341, DOTS_PER_FRAME = 341 * 262;
+}
+
+Mapper004::Mapper004() : CoreMemory(sizeof(Registers)) {
+    clear();
+}
+
+Mapper004::Registers& Mapper004::registers() {
+    return mapperState<Registers>();
+}
+
+const Mapper004::Registers& Mapper004::peekRegisters() const {
+    return peekMapperState<Registers>();
+}
+
+uint8_t Mapper004::readIO(addr_t address) {
+    return readConsoleIO(address);
+}
+
+uint8_t Mapper004::peekIO(addr_t address) {
+    return peekConsoleIO(address);
+}
+
+/*
+    Registers are selected by the address range and whether the address is even or odd:
+    $8000/$8001: Bank select and bank data
+    $A000/$A001: Mirroring and PRG-RAM protect
+    $C000/$C001: IRQ latch and IRQ reload
+    $E000/$E001: IRQ disable (which also acknowledges a pending IRQ) and IRQ enable
+*/
+void Mapper004::writeIO(addr_t address, uint8_t data) {
+    Registers& regs = registers();
+    if (address < 0x4000) {
+        int ppuRegister = address & 0x7;
+        if (ppuRegister > 1) {
+            writeConsoleIO(address, data);
+            return;
+        }
+        // PPUCTRL and PPUMASK decide where A12 rises, so count the edges under the old settings first
+        clockCounter();
+        (ppuRegister ? regs.ppuMask : regs.ppuCtrl) = data;
+        writeConsoleIO(address, data);
+        predictIRQ();
+        return;
+    } else if (address < 0x8000) {
+        writeConsoleIO(address, data);
+        return;
+    }
+
+    bool odd = address & 1;
+    switch (address & 0xe000) {
+        case 0x8000:
+            if (odd) {
+                int target = regs.bankSelect & 0x7;
+                regs.banks[target] = data;
+                if (target < 6) {
+                    syncPPU();
+                } else {
+                    syncPRGBanks();
+                }
+            } else {
+                uint8_t changed = regs.bankSelect ^ data;
+                regs.bankSelect = data;
+                if (changed & 0x40) {
+                    syncPRGBanks();
+                }
+                if (changed & 0x80) {
+                    syncPPU();
+                }
+            }
+            break;
+        case 0xa000:
+            if (!odd) {
+                regs.mirroring = data & 1;
+                syncPPU();
+            }
+            // The PRG-RAM protect bits are ignored, as most emulators do, since MMC6 games
+            // that share this mapper number use the register differently
+            break;
+        case 0xc000:
+            clockCounter();
+            if (odd) {
+                regs.irqReload = true;
+            } else {
+                regs.irqLatch = data;
+            }
+            predictIRQ();
+            break;
+        case 0xe000:
+            clockCounter();
+            regs.irqEnabled = odd;
+            if (!odd) {
+                regs.irqStart = irqStart = NO_IRQ;
+            }
+            predictIRQ();
+            break;
+    }
+}
+
+/*
+    Points the PPU at the selected CHR banks and sets the mirroring.
+    Bit 7 of the bank select register swaps the 2 KB banks (R0, R1) and the 1 KB banks (R2-R5)
+    between the two pattern tables.
+*/
+void Mapper004::syncPPU() {
+    const Registers& regs = peekRegisters();
+    if (mirroring == FOUR_SCREEN) {
+        ppu->setMirroring(FOUR_SCREEN);
+    } else {
+        ppu->setMirroring(regs.mirroring ? HORIZONTAL : VERTICAL);
+    }
+
+    int inverted = (regs.bankSelect & 0x80) ? 4 : 0;
+    for (int slot = 0; slot < 4; slot++) {
+        // R0 and R1 select 2 KB banks, ignoring the low bit
+        int bank = (regs.banks[slot >> 1] & 0xfe) | (slot & 1);
+        mapCHRBank(slot ^ inverted, bank * 0x400);
+        mapCHRBank((slot + 4) ^ inverted, regs.banks[slot + 2] * 0x400);
+    }
+}
+
+void Mapper004::attachCPU(CPU& cpu) {
+    cpu.specialize<Mapper004>();
+}
+
+/*
+    Maps RAM, then the banks selected by the registers.
+*/
+void Mapper004::syncPages() {
+    mapInternalPages();
+    mapPRGRAM();
+    syncPRGBanks();
+}
+
+/*
+    Points the four 8 KB PRG-ROM windows at their banks.
+    Bit 6 of the bank select register swaps which of $8000 and $C000 holds R6,
+    while the other holds the second-last bank. $A000 is always R7 and $E000 the last bank.
+*/
+void Mapper004::syncPRGBanks() {
+    if (PRG_ROM.empty()) {
+        // Writes still reach the registers
+        mapPages(0x80, 0x80, nullptr, PAGE_IO);
+        return;
+    }
+
+    const Registers& regs = peekRegisters();
+    // Unsigned, so the second-last bank of a one-bank ROM wraps around instead of going negative
+    unsigned banks = std::max(static_cast<unsigned>(PRG_ROM.size() / 0x2000), 1u);
+    unsigned windows[4] = {regs.banks[6], regs.banks[7], banks - 2, banks - 1};
+    if (regs.bankSelect & 0x40) {
+        std::swap(windows[0], windows[2]);
+    }
+    for (int window = 0; window < 4; window++) {
+        mapROMPages(0x80 + window * 0x20, 0x20, PRG_ROM.data() + (windows[window] % banks) * 0x2000);
+    }
+}
+
+void Mapper004::clear() {
+    clearMemory(); // Also clears the registers
+    registers().irqStart = irqStart = NO_IRQ;
+    syncPages();
+}
+
+/*
+    Returns the dot of each rendered line at which A12 rises, or -1 if it never does.
+    With the background at $0000 and sprites at $1000, A12 rises when the sprite fetches start.
+    With the background at $1000, it rises when the next line's first tiles are fetched.
+    8x16 sprites are treated like sprites at $1000, which is how games nearly always arrange them.
+*/
+int Mapper004::edgeDot() {
+    const Registers& regs = peekRegisters();
+    if (!(regs.ppuMask & 0x18)) {
+        return -1; // Rendering is disabled
+    } else if (regs.ppuCtrl & 0x10) {
+        return 324;
+    } else if (regs.ppuCtrl & 0x28) {
+        return 260;
+    }
+    return -1;
+}
+
+/*
+    Returns how many lines at the top of each frame have an edge. The pre-render line always has one too.
+    Edges at dot 324 come from fetching the next line's tiles, so the last visible line has none.
+*/
+int Mapper004::edgeLines() {
+    return edgeDot() == 324 ? 239 : 240;
+}
+
+/*
+    Counts the edges before a dot, as if every frame up to it was rendered with the current settings.
+    Only differences between two counts are used, so the settings only need to hold between them.
+*/
+uint64_t Mapper004::edgesBefore(uint64_t dot) {
+    uint64_t lines = edgeLines();
+    uint64_t frame = dot / DOTS_PER_FRAME, line = (dot % DOTS_PER_FRAME) / DOTS_PER_LINE;
+    uint64_t edges = frame * (lines + 1) + std::min(line, lines);
+    bool lineHasEdge = line < lines || line == 261;
+    if (lineHasEdge && dot % DOTS_PER_LINE > static_cast<uint64_t>(edgeDot())) {
+        edges++;
+    }
+    return edges;
+}
+
+/*
+    Returns the dot after the given edge, counting from zero like edgesBefore().
+*/
+uint64_t Mapper004::edgeAt(uint64_t edge) {
+    uint64_t lines = edgeLines();
+    uint64_t frame = edge / (lines + 1), index = edge % (lines + 1);
+    uint64_t line = index < lines ? index : 261;
+    return frame * DOTS_PER_FRAME + line * DOTS_PER_LINE + edgeDot() + 1;
+}
+
+uint64_t Mapper004::currentDot() {
+    return ppu ? ppu->timing().cyclesExecuted : 0;
+}
+
+/*
+    Applies every A12 edge since the counter was last brought up to date.
+    Each edge reloads the counter from the latch if it is zero or a reload was requested,
+    and decrements it otherwise, so the counter cycles with a period of latch + 1 edges.
+*/
+void Mapper004::clockCounter() {
+    Registers& regs = registers();
+    uint64_t now = currentDot();
+    uint64_t edges = 0;
+    if (edgeDot() >= 0 && now > regs.countedDot) {
+        edges = edgesBefore(now) - edgesBefore(regs.countedDot);
+    }
+    regs.countedDot = now;
+    if (!edges) {
+        return;
+    }
+
+    uint64_t counter = regs.irqReload ? 0 : regs.irqCounter;
+    regs.irqReload = false;
+    if (edges <= counter) {
+        counter -= edges;
+    } else {
+        // The counter reaches zero, reloads on the next edge, then keeps cycling
+        counter = regs.irqLatch - (edges - counter - 1) % (regs.irqLatch + 1);
+    }
+    regs.irqCounter = static_cast<uint8_t>(counter);
+}
+
+/*
+    Works out the dot at which the counter next reaches zero, which raises an IRQ if enabled.
+    An IRQ that has already been raised stays pending until it is acknowledged.
+*/
+void Mapper004::predictIRQ() {
+    const Registers& regs = peekRegisters();
+    uint64_t start = regs.irqStart;
+    if (start == NO_IRQ || start > currentDot()) {
+        start = NO_IRQ;
+        if (regs.irqEnabled && edgeDot() >= 0) {
+            // Edges until the counter reaches zero, including one to reload it if needed
+            uint64_t edges = (regs.irqReload || !regs.irqCounter) ? regs.irqLatch + 1 : regs.irqCounter;
+            start = edgeAt(edgesBefore(regs.countedDot) + edges - 1);
+        }
+    }
+
+    // Only a change is written, so redoing the prediction after a restore leaves the registers clean
+    if (start != regs.irqStart) {
+        registers().irqStart = start;
+    }
+    irqStart = start;
+}
+
+/*
+    Picks up the IRQ kept in the restored registers, whether it is still to come or already pending.
+*/
+void Mapper004::syncIRQ() {
+    predictIRQ();
+}
@@ -0,0 +1,115 @@
+#include "memory_arena.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+/*
+    Covers a block of the given size, with every page marked, since nothing has been copied yet.
+*/
+void DirtyPages::resize(size_t bytes) {
+    pages.assign((bytes + PAGE_SIZE - 1) / PAGE_SIZE, ALL_READERS);
+}
+
+/*
+    Marks every page overlapping a range of bytes.
+*/
+void DirtyPages::mark(size_t offset, size_t bytes) {
+    if (bytes) {
+        std::fill(pages.begin() + offset / PAGE_SIZE, pages.begin() + (offset + bytes - 1) / PAGE_SIZE + 1, ALL_READERS);
+    }
+}
+
+void DirtyPages::markAll() {
+    std::fill(pages.begin(), pages.end(), ALL_READERS);
+}
+
+/*
+    Clears one reader's mark on the page holding a byte, and returns whether it was set.
+*/
+bool DirtyPages::take(size_t offset, reader marker) {
+    uint8_t& page = pages[offset / PAGE_SIZE];
+    if (!(page & marker)) {
+        return false;
+    }
+    page = static_cast<uint8_t>(page & ~marker);
+    return true;
+}
+
+/*
+    Copies each page of a block marked for snapshots to the same place in another block of the same size,
+    then clears those marks. Returns the number of pages copied.
+    When restoring, the copied pages are marked for the battery, since their contents changed under it.
+*/
+size_t DirtyPages::copyMarked(const uint8_t* source, uint8_t* target, size_t bytes, bool restoring /* = false */) {
+    size_t copied = 0;
+    for (size_t page = 0; page < pages.size(); page++) {
+        if (pages[page] & SNAPSHOT) {
+            size_t offset = page * PAGE_SIZE;
+            memcpy(target + offset, source + offset, std::min(PAGE_SIZE, bytes - offset));
+            pages[page] = static_cast<uint8_t>(restoring ? BATTERY : pages[page] & ~SNAPSHOT);
+            copied++;
+        }
+    }
+    return copied;
+}
+
+MemoryArena::MemoryArena() {
+    block = nullptr;
+    reserved = allocated = 0;
+}
+
+MemoryArena::~MemoryArena() {
+    ::operator delete(block, std::align_val_t(ALIGNMENT));
+}
+
+/*
+    Forgets every reserved region so that a new layout can be built.
+    The current block stays valid until the next call to allocate.
+*/
+void MemoryArena::reset() {
+    reserved = 0;
+}
+
+/*
+    Reserves a region and returns its offset from the start of the block.
+    Each region starts on its own cache line, and ends on one. A larger power of two alignment
+    gives the region whole dirty pages to itself.
+*/
+size_t MemoryArena::reserve(size_t bytes, size_t alignment /* = ALIGNMENT */) {
+    size_t offset = (reserved + alignment - 1) & ~(alignment - 1);
+    reserved = offset + ((bytes + alignment - 1) & ~(alignment - 1));
+    return offset;
+}
+
+/*
+    Replaces the block with a zeroed one that fits every reserved region.
+*/
+void MemoryArena::allocate() {
+    ::operator delete(block, std::align_val_t(ALIGNMENT));
+    block = nullptr; // In case the allocation throws
+    allocated = reserved;
+    block = static_cast<uint8_t*>(::operator new(allocated ? allocated : ALIGNMENT, std::align_val_t(ALIGNMENT)));
+    dirty.resize(allocated);
+    clear();
+}
+
+void MemoryArena::clear() {
+    memset(block, 0, allocated);
+    dirty.markAll();
+}
+
+uint8_t* MemoryArena::data() {
+    return block;
+}
+
+const uint8_t* MemoryArena::data() const {
+    return block;
+}
+
+size_t MemoryArena::size() const {
+    return allocated;
+}
+
+DirtyPages& MemoryArena::dirtyPages() {
+    return dirty;
+}
@@ -2,6 +2,8 @@
 #include "core_memory.h"
 #include "mapper000.h"
 #include "mapper001.h"
+#include "mapper004.h"
+#include "discrete_mapper.h"
 #include <stdexcept>
 #include <string>
 
@@ -11,6 +13,18 @@ std::unique_ptr<CoreMemory> MemoryFactory::create(int mapper) {
             return std::make_unique<Mapper000>();
         case 001:
             return std::make_unique<Mapper001>();
+        case 002:
+            return std::make_unique<Mapper002>();
+        case 003:
+            return std::make_unique<Mapper003>();
+        case 004:
+            return std::make_unique<Mapper004>();
+        case 007:
+            return std::make_unique<Mapper007>();
+        case 11:
+            return std::make_unique<Mapper011>();
+        case 66:
+            return std::make_unique<Mapper066>();
         default:
             throw std::runtime_error("Unsupported mapper " + std::to_string(mapper) + " encountered."); 
     }
@@ -0,0 +1,105 @@
+#include "memory_heatmap.h"
+#include <fstream>
+#include <print>
+
+MemoryHeatmap::MemoryHeatmap() {
+    frame = 0;
+}
+
+/*
+    Moves the counts of the frame in progress into the last frame and the totals once the PPU
+    starts another frame. The CPU calls this after every instruction, and it does nothing within a frame.
+*/
+void MemoryHeatmap::startFrame(int newFrame) {
+    if (newFrame == frame) {
+        return;
+    }
+    frame = newFrame;
+    for (int kind = 0; kind < ACCESS_KINDS; kind++) {
+        for (int address = 0; address < 0x10000; address++) {
+            totalCounts[kind][address] += currentCounts[kind][address];
+        }
+    }
+    lastFrameCounts = currentCounts;
+    for (std::array<uint32_t, 0x10000>& counts : currentCounts) {
+        counts.fill(0);
+    }
+}
+
+/*
+    Returns the number of accesses to an address in every frame so far, including the one in progress.
+*/
+uint64_t MemoryHeatmap::total(accessKind kind, uint16_t address) const {
+    return totalCounts[kind][address] + currentCounts[kind][address];
+}
+
+/*
+    Returns the number of accesses to an address in the last whole frame.
+*/
+uint32_t MemoryHeatmap::lastFrame(accessKind kind, uint16_t address) const {
+    return lastFrameCounts[kind][address];
+}
+
+/*
+    Returns the count at an address, or summed over a 256-byte page.
+*/
+uint64_t MemoryHeatmap::countAt(accessKind kind, int index, bool cumulative, bool perPage) const {
+    int first = perPage ? index << 8 : index, last = perPage ? first + 0xff : first;
+    uint64_t sum = 0;
+    for (int address = first; address <= last; address++) {
+        sum += cumulative ? total(kind, static_cast<uint16_t>(address)) : lastFrameCounts[kind][address];
+    }
+    return sum;
+}
+
+/*
+    Writes the counts of every frame so far, or of the last whole frame, as CSV with one row per
+    address or per page. Addresses and pages that were never accessed are left out.
+    Returns false if the file cannot be written.
+*/
+bool MemoryHeatmap::exportCSV(const std::string& path, bool cumulative, bool perPage) const {
+    std::ofstream file(path);
+    if (!file) {
+        std::println(stderr, "Could not open heatmap file {}.", path);
+        return false;
+    }
+
+    std::println(file, "{},reads,writes,fetches", perPage ? "page" : "address");
+    int entries = perPage ? 0x100 : 0x10000;
+    for (int index = 0; index < entries; index++) {
+        uint64_t reads = countAt(READ, index, cumulative, perPage),
+                 writes = countAt(WRITE, index, cumulative, perPage),
+                 fetches = countAt(FETCH, index, cumulative, perPage);
+        if (reads || writes || fetches) {
+            std::println(file, "{:0{}X},{},{},{}", index, perPage ? 2 : 4, reads, writes, fetches);
+        }
+    }
+    return static_cast<bool>(file);
+}
+
+/*
+    Writes the counts in binary: "NESHEAT" followed by MS-DOS EOF, then the read, write,
+    and fetch counts of every address or page in turn, as little-endian 64-bit numbers.
+    Returns false if the file cannot be written.
+*/
+bool MemoryHeatmap::exportBinary(const std::string& path, bool cumulative, bool perPage) const {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::println(stderr, "Could not open heatmap file {}.", path);
+        return false;
+    }
+
+    file.write("NESHEAT\x1A", 8);
+    int entries = perPage ? 0x100 : 0x10000;
+    for (int kind = 0; kind < ACCESS_KINDS; kind++) {
+        for (int index = 0; index < entries; index++) {
+            uint64_t count = countAt(static_cast<accessKind>(kind), index, cumulative, perPage);
+            char bytes[8];
+            for (int i = 0; i < 8; i++) {
+                bytes[i] = static_cast<char>(count >> (i * 8));
+            }
+            file.write(bytes, 8);
+        }
+    }
+    return static_cast<bool>(file);
+}